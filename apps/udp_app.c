@@ -103,7 +103,8 @@ int main(int argc, char *argv[])
      * - setup(): Performs any necessary setup operations.
      * - sock_open(): Opens a socket for communication.
      * - sock_bind(): Binds a socket to a local address and port.
-     * - sock_recvfrom(): Receives data from a socket.
+     * - sock_recvfrom_loan(): Receives a datagram from a socket without copying it.
+     * - sock_loan_release(): Returns the received datagram to the stack.
      * - sock_sendto(): Sends data to a remote host.
      * - udp_close(): Closes the UDP socket.
      * - network_shutdown(): Shuts down the network.
@@ -115,7 +116,7 @@ int main(int argc, char *argv[])
     long int port;
     struct sockaddr_in local = { .sin_family=AF_INET }, foreign;
     int foreignlen;
-    uint8_t buf[1024];
+    struct sock_loan loan;
     char addr[SOCKADDR_STR_LEN];
     ssize_t ret;
 
@@ -156,20 +157,22 @@ int main(int argc, char *argv[])
     }
     while (!terminate) {
         foreignlen = sizeof(foreignlen);
-        ret = sock_recvfrom(soc, buf, sizeof(buf), (struct sockaddr *)&foreign, &foreignlen);
+        ret = sock_recvfrom_loan(soc, &loan, (struct sockaddr *)&foreign, &foreignlen);
         if (ret == -1) {
             if (errno == EINTR) {
                 continue;
             }
-            errorf("sock_recvfrom() failure");
+            errorf("sock_recvfrom_loan() failure");
             break;
         }
         infof("%zu bytes data form %s", ret, sockaddr_ntop((struct sockaddr *)&foreign, addr, sizeof(addr)));
-        hexdump(stderr, buf, ret);
-        if (sock_sendto(soc, buf, ret, (struct sockaddr *)&foreign, foreignlen) == -1) {
+        hexdump(stderr, loan.data, loan.len);
+        if (sock_sendto(soc, loan.data, loan.len, (struct sockaddr *)&foreign, foreignlen) == -1) {
             errorf("sock_sendto() failure");
+            sock_loan_release(&loan);
             break;
         }
+        sock_loan_release(&loan);
     }
     udp_close(soc);
 
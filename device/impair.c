@@ -0,0 +1,340 @@
+/**
+ * @file impair.c
+ * @brief impaired wire, two Ethernet devices joined through a delaying, lossy and rate-limited queue
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "handler.h"
+
+#include "util.h"
+#include "net2.h"
+#include "ether.h"
+
+#include "impair.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/**
+ * @brief Frame on its way to the other end.
+ */
+struct impair_frame
+{
+    uint64_t due; /* delivery time */
+    uint64_t seq; /* order of transmission, between frames due at the same time */
+    struct pktbuf *pb;
+};
+
+/**
+ * @brief Private data of one end of an impaired wire, it holds the frames the end has transmitted.
+ */
+struct impair
+{
+    struct impair *next; /* all ends, walked by the timer */
+    struct network_device *dev;
+    struct network_device *peer;
+    mutex_t mutex; /* protects everything below */
+    struct impair_params params;
+    unsigned int seed; /* state of rand_r() */
+    struct impair_frame heap[IMPAIR_QUEUE_LIMIT_MAX]; /* min-heap on the delivery time */
+    unsigned int num;
+    uint64_t seq;
+    double tokens; /* bytes the bucket holds, negative while frames wait for the bandwidth */
+    uint64_t refilled; /* when the bucket was last refilled */
+    unsigned long sent; /* frames transmitted */
+    unsigned long delivered;
+    unsigned long lost;
+    unsigned long reordered;
+    unsigned long shaped; /* frames held back by the token bucket */
+    unsigned long overflows; /* frames tail-dropped */
+};
+
+#define PRIV(x) ((struct impair *)x->priv)
+
+static struct impair *impairs;
+
+
+static uint64_t impair_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static double impair_random(struct impair *imp)
+{
+    return rand_r(&imp->seed) / ((double)RAND_MAX + 1);
+}
+
+static int impair_before(const struct impair_frame *x, const struct impair_frame *y)
+{
+    return x->due < y->due || (x->due == y->due && x->seq < y->seq);
+}
+
+static void impair_heap_push(struct impair *imp, uint64_t due, struct pktbuf *pb)
+{
+    struct impair_frame frame, tmp;
+    unsigned int i, parent;
+
+    frame.due = due;
+    frame.seq = imp->seq++;
+    frame.pb = pb;
+    i = imp->num++;
+    imp->heap[i] = frame;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!impair_before(&imp->heap[i], &imp->heap[parent])) {
+            break;
+        }
+        tmp = imp->heap[parent];
+        imp->heap[parent] = imp->heap[i];
+        imp->heap[i] = tmp;
+        i = parent;
+    }
+}
+
+static struct pktbuf *impair_heap_pop(struct impair *imp)
+{
+    struct impair_frame tmp;
+    struct pktbuf *pb;
+    unsigned int i, child;
+
+    pb = imp->heap[0].pb;
+    imp->heap[0] = imp->heap[--imp->num];
+    for (i = 0; (child = 2 * i + 1) < imp->num; i = child) {
+        if (child + 1 < imp->num && impair_before(&imp->heap[child + 1], &imp->heap[child])) {
+            child++;
+        }
+        if (!impair_before(&imp->heap[child], &imp->heap[i])) {
+            break;
+        }
+        tmp = imp->heap[child];
+        imp->heap[child] = imp->heap[i];
+        imp->heap[i] = tmp;
+    }
+    return pb;
+}
+
+/* NOTE: must be called after imp->mutex locked, returns when the frame may leave as far as the bandwidth goes */
+static uint64_t impair_shape(struct impair *imp, size_t len, uint64_t now)
+{
+    double rate;
+    uint64_t depart = now;
+
+    if (!imp->params.rate) {
+        return now;
+    }
+    rate = imp->params.rate / 8.0 / NSEC_PER_SEC; /* bytes per nanosecond */
+    imp->tokens += (now - imp->refilled) * rate;
+    if (imp->tokens > imp->params.burst) {
+        imp->tokens = imp->params.burst;
+    }
+    imp->refilled = now;
+    if (imp->tokens < len) {
+        /* waits behind the frames already in debt for the tokens it lacks */
+        depart = now + (uint64_t)((len - imp->tokens) / rate);
+        imp->shaped++;
+    }
+    imp->tokens -= len;
+    return depart;
+}
+
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+/* the frame goes on the wire as one buffer, the sender's fragments are not kept beyond the call */
+static ssize_t impair_write(struct network_device *dev, struct pktbuf *pb, const struct iovec *iov, int iovcnt)
+{
+    struct impair *imp;
+    struct pktbuf *wpb;
+    size_t len = 0;
+    uint64_t now, due;
+    int64_t jitter;
+    int i;
+
+    imp = PRIV(dev);
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    wpb = pktbuf_alloc(len);
+    if (!wpb) {
+        errorf("pktbuf_alloc() failure");
+        return -1;
+    }
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(pktbuf_append(wpb, iov[i].iov_len), iov[i].iov_base, iov[i].iov_len);
+    }
+    now = impair_clock();
+    mutex_lock(&imp->mutex);
+    imp->sent++;
+    if (imp->params.loss > 0 && impair_random(imp) < imp->params.loss) {
+        /* lost on the wire, the sender does not notice */
+        imp->lost++;
+        mutex_unlock(&imp->mutex);
+        pktbuf_release(wpb);
+        return len;
+    }
+    if (imp->num >= imp->params.limit) {
+        /* tail-dropped like a full router queue, the sender does not notice either */
+        imp->overflows++;
+        mutex_unlock(&imp->mutex);
+        pktbuf_release(wpb);
+        return len;
+    }
+    due = impair_shape(imp, len, now);
+    if (imp->params.reorder > 0 && impair_random(imp) < imp->params.reorder) {
+        imp->reordered++;
+    } else {
+        due += imp->params.delay_us * 1000ULL;
+        if (imp->params.jitter_us) {
+            jitter = (int64_t)((impair_random(imp) * 2 - 1) * imp->params.jitter_us * 1000);
+            due = (jitter < 0 && (uint64_t)-jitter > due - now) ? now : due + jitter;
+        }
+    }
+    impair_heap_push(imp, due, wpb);
+    mutex_unlock(&imp->mutex);
+    return len;
+}
+
+static int impair_transmit(struct network_device *dev, uint16_t type, struct pktbuf *pb, const void *dst)
+{
+    return ether_transmit_helper(dev, type, pb, dst, impair_write);
+}
+
+/* runs on the interrupt thread every tick, hands the frames that are due to the other end */
+static void impair_timer(void)
+{
+    struct impair *imp;
+    struct pktbuf *pbs[PKTBUF_VEC_MAX];
+    unsigned int num, i;
+    uint64_t now;
+
+    now = impair_clock();
+    for (imp = impairs; imp; imp = imp->next) {
+        do {
+            mutex_lock(&imp->mutex);
+            for (num = 0; num < PKTBUF_VEC_MAX && imp->num && imp->heap[0].due <= now; num++) {
+                pbs[num] = impair_heap_pop(imp);
+            }
+            imp->delivered += num;
+            mutex_unlock(&imp->mutex);
+            if (!num) {
+                break;
+            }
+            if (NETWORK_DEVICE_IS_UP(imp->peer)) {
+                ether_input_batch_helper(imp->peer, pbs, num);
+            } else {
+                for (i = 0; i < num; i++) {
+                    pktbuf_release(pbs[i]);
+                }
+            }
+        } while (num == PKTBUF_VEC_MAX);
+    }
+}
+
+static int impair_close(struct network_device *dev)
+{
+    struct impair *imp;
+
+    imp = PRIV(dev);
+    mutex_lock(&imp->mutex);
+    infof("dev=%s, peer=%s, sent=%lu, delivered=%lu, lost=%lu, reordered=%lu, shaped=%lu, overflows=%lu, queued=%u",
+        dev->name, imp->peer->name, imp->sent, imp->delivered, imp->lost, imp->reordered, imp->shaped, imp->overflows, imp->num);
+    while (imp->num) {
+        pktbuf_release(impair_heap_pop(imp));
+    }
+    mutex_unlock(&imp->mutex);
+    return 0;
+}
+
+
+static struct network_device_operations impair_ops = {
+    .close = impair_close,
+    .transmit = impair_transmit,
+};
+
+static struct network_device *impair_alloc(const char *addr)
+{
+    struct network_device *dev;
+    struct impair *imp;
+    struct impair_params params = {};
+
+    dev = network_device_allocate(ether_setup_helper);
+    if (!dev) {
+        errorf("network_device_allocate() failure");
+        return NULL;
+    }
+    if (ether_addr_pton(addr, dev->address) == -1) {
+        errorf("invalid address, addr=%s", addr);
+        memory_free(dev);
+        return NULL;
+    }
+    dev->ops = &impair_ops;
+    imp = memory_alloc(sizeof(*imp));
+    if (!imp) {
+        errorf("memory_alloc() failure");
+        memory_free(dev);
+        return NULL;
+    }
+    imp->dev = dev;
+    mutex_init(&imp->mutex);
+    dev->priv = imp;
+    impair_set_params(dev, &params);
+    return dev;
+}
+
+int impair_init(struct network_device **a, struct network_device **b, const char *addr_a, const char *addr_b)
+{
+    struct network_device *da, *db;
+    struct timeval interval = {0, 0}; /* every tick of the interrupt thread's timer */
+
+    da = impair_alloc(addr_a);
+    db = impair_alloc(addr_b);
+    if (!da || !db) {
+        return -1;
+    }
+    PRIV(da)->peer = db;
+    PRIV(db)->peer = da;
+    if (network_device_register(da) == -1 || network_device_register(db) == -1) {
+        errorf("network_device_register() failure");
+        return -1;
+    }
+    if (!impairs && network_timer_register("impair", interval, impair_timer) == -1) {
+        errorf("network_timer_register() failure");
+        return -1;
+    }
+    PRIV(da)->next = PRIV(db);
+    PRIV(db)->next = impairs;
+    impairs = PRIV(da);
+    debugf("initialized, dev=%s, peer=%s", da->name, db->name);
+    *a = da;
+    *b = db;
+    return 0;
+}
+
+int impair_set_params(struct network_device *dev, const struct impair_params *params)
+{
+    struct impair *imp;
+
+    if (params->loss < 0 || params->loss > 1 || params->reorder < 0 || params->reorder > 1 || params->limit > IMPAIR_QUEUE_LIMIT_MAX) {
+        errorf("invalid parameters, dev=%s", dev->name);
+        return -1;
+    }
+    imp = PRIV(dev);
+    mutex_lock(&imp->mutex);
+    imp->params = *params;
+    if (!imp->params.burst) {
+        imp->params.burst = ETHER_FRAME_SIZE_MAX;
+    }
+    if (!imp->params.limit) {
+        imp->params.limit = IMPAIR_QUEUE_LIMIT_DEFAULT;
+    }
+    imp->seed = params->seed ? params->seed : (unsigned int)impair_clock();
+    imp->tokens = imp->params.burst;
+    imp->refilled = impair_clock();
+    mutex_unlock(&imp->mutex);
+    return 0;
+}
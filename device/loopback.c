@@ -8,7 +8,10 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include "handler.h"
+
 #include "util.h"
+#include "ring.h"
 #include "net2.h"
 
 #include "loopback.h"
@@ -18,19 +21,92 @@
  */
 #define LOOPBACK_MTU UINT16_MAX
 
+/**
+ * @brief Private data of the loopback interface
+ */
+struct loopback
+{
+    struct mpsc_ring queue; /* transmitted packets, drained by the interrupt thread */
+    unsigned long batches; /* number of times the queue was drained */
+    unsigned long packets; /* number of packets looped back */
+};
+
+#define PRIV(x) ((struct loopback *)x->priv)
+
+
+static int loopback_transmit(struct network_device *dev, uint16_t type, struct pktbuf *pb, const void *dst)
+{
+    struct pktbuf *lpb;
+
+    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, network_protocol_name(type), type, pktbuf_total_len(pb));
+    debugdump(pktbuf_data(pb), pktbuf_len(pb));
+    /* the transmitted buffer is looped back as is, unless it references sender-owned fragments */
+    lpb = pktbuf_linearize(pb);
+    if (!lpb) {
+        errorf("pktbuf_linearize() failure");
+        return -1;
+    }
+    lpb->protocol = type;
+    /* the sender only queues the packet, the interrupt thread hands it up with the rest of the batch */
+    if (mpsc_ring_enqueue(&PRIV(dev)->queue, lpb) == -1) {
+        debugf("queue full, dropped, dev=%s", dev->name);
+        pktbuf_release(lpb);
+        return -1;
+    }
+    network_device_tx_pending(dev);
+    return 0;
+}
+
+/* runs on the interrupt thread, input is batched per run of packets of the same protocol */
+static int loopback_flush(struct network_device *dev)
+{
+    struct pktbuf *pbs[PKTBUF_VEC_MAX];
+    unsigned int num, i, first;
+
+    while ((num = mpsc_ring_dequeue_batch(&PRIV(dev)->queue, (void **)pbs, PKTBUF_VEC_MAX)) > 0) {
+        PRIV(dev)->batches++;
+        PRIV(dev)->packets += num;
+        for (i = 0; i < num; i++) {
+            if (dev->flags & NETWORK_DEVICE_FLAG_NO_CSUM) {
+                /* the partial checksum is never completed, nor verified */
+                pbs[i]->flags = (pbs[i]->flags & ~PKTBUF_FLAG_CSUM_PARTIAL) | PKTBUF_FLAG_CSUM_VALID;
+            }
+        }
+        for (first = 0, i = 1; i <= num; i++) {
+            if (i == num || pbs[i]->protocol != pbs[first]->protocol) {
+                network_input_batch(pbs[first]->protocol, pbs + first, i - first, dev);
+                first = i;
+            }
+        }
+        for (i = 0; i < num; i++) {
+            pktbuf_release(pbs[i]);
+        }
+    }
+    return 0;
+}
 
-static int loopback_transmit(struct network_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+static int loopback_close(struct network_device *dev)
 {
-    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, network_protocol_name(type), type, len);
-    debugdump(data, len);
-    network_input_handler(type, data, len, dev);
+    struct pktbuf *pbs[PKTBUF_VEC_MAX];
+    unsigned int num, i;
+    unsigned long left = 0;
+
+    /* the interrupt thread is gone, nothing would handle what is still queued */
+    while ((num = mpsc_ring_dequeue_batch(&PRIV(dev)->queue, (void **)pbs, PKTBUF_VEC_MAX)) > 0) {
+        for (i = 0; i < num; i++) {
+            pktbuf_release(pbs[i]);
+        }
+        left += num;
+    }
+    infof("dev=%s, batches=%lu, packets=%lu, drops=%lu, left=%lu", dev->name, PRIV(dev)->batches, PRIV(dev)->packets, mpsc_ring_drops(&PRIV(dev)->queue), left);
     return 0;
 }
 
 
 static struct network_device_operations loopback_ops = {
-   
+    .close = loopback_close,
     .transmit = loopback_transmit,
+    .flush = loopback_flush,
 };
 
 static void loopback_setup(struct network_device *dev)
@@ -47,6 +123,7 @@ static void loopback_setup(struct network_device *dev)
 struct network_device *loopback_init(void)
 {
     struct network_device *dev;
+    struct loopback *lo;
 
     /* allocate and initialize the loopback network device */
     dev = network_device_allocate(loopback_setup);
@@ -54,12 +131,35 @@ struct network_device *loopback_init(void)
         errorf("net_device_alloc() failure");
         return NULL;
     }
+    lo = memory_alloc(sizeof(*lo));
+    if (!lo) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    if (mpsc_ring_init(&lo->queue, LOOPBACK_QUEUE_SIZE) == -1) {
+        errorf("mpsc_ring_init() failure");
+        memory_free(lo);
+        return NULL;
+    }
+    dev->priv = lo;
     /* register the loopback network device */
     if (network_device_register(dev) == -1) {
         errorf("net_device_register() failure");
+        mpsc_ring_destroy(&lo->queue);
+        memory_free(lo);
         return NULL;
     }
     debugf("initialized, dev=%s", dev->name);
     return dev;
 }
 
+int loopback_set_csum_skip(struct network_device *dev, int enable)
+{
+    /* UDP then leaves its checksum partial, and the device never completes it */
+    if (enable) {
+        dev->flags |= (NETWORK_DEVICE_FLAG_TX_CSUM | NETWORK_DEVICE_FLAG_NO_CSUM);
+    } else {
+        dev->flags &= ~(NETWORK_DEVICE_FLAG_TX_CSUM | NETWORK_DEVICE_FLAG_NO_CSUM);
+    }
+    return 0;
+}
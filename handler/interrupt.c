@@ -7,12 +7,15 @@
 #include <pthread.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include "handler.h"
 
 #include "util.h"
 #include "net2.h"
-// #include <linux/time.h>
-#include <asm-generic/signal-defs.h>
+
+#define INTR_EVENTS_MAX 16
 
 struct irq_entry {
     struct irq_entry *next;
@@ -21,10 +24,29 @@ struct irq_entry {
     int flags;
     char name[16];
     void *dev;
+    int fd; /* readiness source watched by the interrupt thread, -1 if none */
 };
 
-sigset_t sigmask;
-struct irq_entry *irq_vec;
+static struct irq_entry *irq_vec;
+static mutex_t irq_mutex = MUTEX_INITIALIZER;
+
+static int epfd = -1;
+static int softirq_fd = -1;
+static int event_fd = -1;
+static int timer_fd = -1;
+
+static int softirq_pending;
+static int terminate;
+static __thread int intr_context;
+
+static int intr_softirq_isr(unsigned int irq, void *dev);
+static int intr_event_isr(unsigned int irq, void *dev);
+static int intr_timer_isr(unsigned int irq, void *dev);
+
+/* internal sources, dispatched like device IRQs but without a device */
+static struct irq_entry softirq_entry = { .name = "softirq", .handler = intr_softirq_isr, .fd = -1 };
+static struct irq_entry event_entry = { .name = "event", .handler = intr_event_isr, .fd = -1 };
+static struct irq_entry timer_entry = { .name = "timer", .handler = intr_timer_isr, .fd = -1 };
 
 int
 intr_request_irq(unsigned int irq, int (*handler)(unsigned int irq, void *dev), int flags, const char *name, void *dev)
@@ -49,79 +71,209 @@ intr_request_irq(unsigned int irq, int (*handler)(unsigned int irq, void *dev),
     entry->flags = flags;
     strncpy(entry->name, name, sizeof(entry->name)-1);
     entry->dev = dev;
+    entry->fd = -1;
     entry->next = irq_vec;
     irq_vec = entry;
-    sigaddset(&sigmask, irq);
     debugf("registered: irq=%u, name=%s", irq, name);
     return 0;
 }
 
 static int
-intr_timer_setup(struct itimerspec *interval)
+intr_watch(struct irq_entry *entry, int fd)
 {
-    timer_t id;
+    struct epoll_event ev = {};
 
-    if (timer_create(CLOCK_REALTIME, NULL, &id) == -1) {
-        errorf("timer_create: %s", strerror(errno));
+    ev.events = EPOLLIN;
+    ev.data.ptr = entry;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        errorf("epoll_ctl(EPOLL_CTL_ADD): %s, name=%s", strerror(errno), entry->name);
         return -1;
     }
-    if (timer_settime(id, 0, interval, NULL) == -1) {
-        errorf("timer_settime: %s", strerror(errno));
-        return -1;
+    entry->fd = fd;
+    return 0;
+}
+
+int
+intr_register_fd(unsigned int irq, void *dev, int fd)
+{
+    struct irq_entry *entry;
+    int ret = -1;
+
+    mutex_lock(&irq_mutex);
+    for (entry = irq_vec; entry; entry = entry->next) {
+        if (entry->irq == irq && entry->dev == dev) {
+            ret = intr_watch(entry, fd);
+            break;
+        }
+    }
+    mutex_unlock(&irq_mutex);
+    if (!entry) {
+        errorf("irq not requested, irq=%u", irq);
+    }
+    return ret;
+}
+
+int
+intr_unregister_fd(unsigned int irq, void *dev)
+{
+    struct irq_entry *entry;
+
+    mutex_lock(&irq_mutex);
+    for (entry = irq_vec; entry; entry = entry->next) {
+        if (entry->irq == irq && entry->dev == dev && entry->fd != -1) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, entry->fd, NULL);
+            entry->fd = -1;
+            break;
+        }
+    }
+    mutex_unlock(&irq_mutex);
+    return entry ? 0 : -1;
+}
+
+static int
+intr_mask(unsigned int irq, void *dev, uint32_t events)
+{
+    struct irq_entry *entry;
+    struct epoll_event ev = {};
+
+    for (entry = irq_vec; entry; entry = entry->next) {
+        if (entry->irq == irq && entry->dev == dev && entry->fd != -1) {
+            ev.events = events;
+            ev.data.ptr = entry;
+            if (epoll_ctl(epfd, EPOLL_CTL_MOD, entry->fd, &ev) == -1) {
+                errorf("epoll_ctl(EPOLL_CTL_MOD): %s, name=%s", strerror(errno), entry->name);
+                return -1;
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int
+intr_disable_irq(unsigned int irq, void *dev)
+{
+    return intr_mask(irq, dev, 0);
+}
+
+int
+intr_enable_irq(unsigned int irq, void *dev)
+{
+    return intr_mask(irq, dev, EPOLLIN);
+}
+
+int
+intr_in_context(void)
+{
+    return intr_context;
+}
+
+void
+raise_softirq(void)
+{
+    uint64_t one = 1;
+
+    if (__atomic_exchange_n(&softirq_pending, 1, __ATOMIC_ACQ_REL)) {
+        /* already pending, the interrupt thread has not run the protocol handlers yet */
+        return;
+    }
+    if (intr_context) {
+        /* the interrupt thread checks the flag before it waits again */
+        return;
     }
+    if (write(softirq_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        errorf("write: %s", strerror(errno));
+    }
+}
+
+void
+raise_event(void)
+{
+    uint64_t one = 1;
+
+    /* async-signal-safe, may be called from a signal handler */
+    write(event_fd, &one, sizeof(one));
+}
+
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static int
+intr_softirq_isr(unsigned int irq, void *dev)
+{
+    uint64_t count;
+
+    /* just consume the wakeup, the pending flag is handled by the loop */
+    read(softirq_fd, &count, sizeof(count));
     return 0;
 }
 
+static int
+intr_event_isr(unsigned int irq, void *dev)
+{
+    uint64_t count;
+
+    read(event_fd, &count, sizeof(count));
+    return network_event_handler();
+}
+
+static int
+intr_timer_isr(unsigned int irq, void *dev)
+{
+    uint64_t expirations;
+
+    read(timer_fd, &expirations, sizeof(expirations));
+    return network_timer_handler();
+}
+
 static void *
 intr_thread(void *arg)
 {
-    struct timespec ts = {0, 1000000}; // 1ms
-    struct itimerspec interval = {ts, ts};
-    int sig, err;
+    struct epoll_event evs[INTR_EVENTS_MAX];
     struct irq_entry *entry;
+    int n, i, polling = 0, stop = 0;
 
-    if (intr_timer_setup(&interval) == -1) {
-        return NULL;
-    }
-    while (1) {
-        err = sigwait(&sigmask, &sig);
-        if (err) {
-            errorf("sigwait() %s", strerror(err));
+    intr_context = 1;
+    while (!stop) {
+        /* what was raised before intr_shutdown() is still ready below, the last round handles it */
+        stop = __atomic_load_n(&terminate, __ATOMIC_ACQUIRE);
+        /* while devices are being polled or a softirq is pending, only check for other sources instead of waiting */
+        n = epoll_wait(epfd, evs, INTR_EVENTS_MAX, (polling || __atomic_load_n(&softirq_pending, __ATOMIC_ACQUIRE)) ? 0 : -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errorf("epoll_wait: %s", strerror(errno));
             break;
         }
-        switch (sig) {
-        case SIGUSR1:
-            network_protocol_handler();
-            break;
-        case SIGUSR2:
-            network_event_handler();
-            break;
-        case SIGALRM:
-            network_timer_handler();
-            break;
-        default:
-            for (entry = irq_vec; entry; entry = entry->next) {
-                if (entry->irq == (unsigned int)sig) {
-                    debugf("irq=%d, name=%s", entry->irq, entry->name);
-                    entry->handler(entry->irq, entry->dev);
-                }
+        for (i = 0; i < n; i++) {
+            entry = evs[i].data.ptr;
+            if (entry->dev) {
+                debugf("irq=%d, name=%s", entry->irq, entry->name);
             }
-            break;
+            entry->handler(entry->irq, entry->dev);
         }
+        polling = network_device_poll_handler();
+        /* run the softirq raised by the handlers above or by other threads */
+        while (__atomic_exchange_n(&softirq_pending, 0, __ATOMIC_ACQ_REL)) {
+            network_protocol_handler();
+        }
+        /* hand the frames transmitted meanwhile to the devices, one flush each */
+        network_device_flush_handler();
     }
     return NULL;
 }
 
 pthread_t tid;
+static int running;
 
 int
 intr_run(void)
 {
+    struct timespec ts = {0, 1000000}; // 1ms
+    struct itimerspec interval = {ts, ts};
     int err;
 
-    err = pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
-    if (err) {
-        errorf("pthread_sigmask() %s", strerror(err));
+    if (timerfd_settime(timer_fd, 0, &interval, NULL) == -1) {
+        errorf("timerfd_settime: %s", strerror(errno));
         return -1;
     }
     err = pthread_create(&tid, NULL, intr_thread, NULL);
@@ -129,15 +281,49 @@ intr_run(void)
         errorf("pthread_create() %s", strerror(err));
         return -1;
     }
+    running = 1;
     return 0;
 }
 
+void
+intr_shutdown(void)
+{
+    uint64_t one = 1;
+
+    if (!running) {
+        return;
+    }
+    __atomic_store_n(&terminate, 1, __ATOMIC_RELEASE);
+    if (write(softirq_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        errorf("write: %s", strerror(errno));
+    }
+    pthread_join(tid, NULL);
+    running = 0;
+}
+
 int
 intr_init(void)
 {
-    sigemptyset(&sigmask);
-    sigaddset(&sigmask, SIGUSR1);
-    sigaddset(&sigmask, SIGUSR2);
-    sigaddset(&sigmask, SIGALRM);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        errorf("epoll_create1: %s", strerror(errno));
+        return -1;
+    }
+    softirq_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (softirq_fd == -1 || event_fd == -1) {
+        errorf("eventfd: %s", strerror(errno));
+        return -1;
+    }
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        errorf("timerfd_create: %s", strerror(errno));
+        return -1;
+    }
+    if (intr_watch(&softirq_entry, softirq_fd) == -1 ||
+        intr_watch(&event_entry, event_fd) == -1 ||
+        intr_watch(&timer_entry, timer_fd) == -1) {
+        return -1;
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -1,4 +1,4 @@
-#define _GNU_SOURCE /* for F_SETSIG */
+#define _GNU_SOURCE /* for sendmmsg, pthread_setaffinity_np */
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -6,9 +6,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/poll.h>
 #include <linux/if.h>
 #include <linux/if_ether.h>
@@ -19,19 +22,81 @@
 #include "util.h"
 #include "net2.h"
 #include "ether.h"
+#include "etheruring.h"
 
-#include "ethertap.h"
+#include "etherpcap.h"
 
 #define ETHER_PCAP_IRQ (SIGRTMIN+3)
 
+/* TPACKET_V3 receive ring, the kernel hands over a block once it is full or has timed out */
+#define ETHER_PCAP_RING_BLOCK_SIZE (1 << 18)
+#define ETHER_PCAP_RING_BLOCK_NR 32
+#define ETHER_PCAP_RING_FRAME_SIZE 2048
+#define ETHER_PCAP_RING_RETIRE_MS 4
+/* frames are copied rather than lent while a block still lent is this close ahead of the walker */
+#define ETHER_PCAP_RING_LEND_GAP (ETHER_PCAP_RING_BLOCK_NR / 2)
+
+#define ETHER_PCAP_WORKER_BLOCK_MS 100
+/* how long a worker waits for its stuck ring before looking again */
+#define ETHER_PCAP_WORKER_STUCK_MS 1
+
+struct ether_pcap_ring;
+
+struct ether_pcap_block {
+    struct ether_pcap_ring *ring;
+    struct tpacket_block_desc *desc;
+    int refcnt; /* frames lent up the stack, plus one while the block is walked; 0 once given back to the kernel */
+};
+
+struct ether_pcap_ring {
+    struct network_device *dev;
+    unsigned int irq; /* 0 if the ring is serviced by a worker thread */
+    uint8_t *map; /* NULL if the ring is not in use */
+    size_t size;
+    struct ether_pcap_block blocks[ETHER_PCAP_RING_BLOCK_NR];
+    unsigned int current; /* block being walked, or the next one to wait for */
+    struct tpacket3_hdr *frame; /* next frame in the current block, NULL if not walking it */
+    unsigned int remaining; /* frames left in the current block */
+    int lend; /* frames of the current block are lent, not copied */
+    unsigned int held; /* blocks not given back to the kernel yet */
+    int stuck; /* the walker waits for the current block to be released, the irq stays masked meanwhile */
+    unsigned long blocks_walked;
+    unsigned long lent;
+    unsigned long copied;
+};
+
+/* one socket of the fanout group, serviced by its own thread unless it is the only one */
+struct ether_pcap_worker {
+    struct network_device *dev;
+    unsigned int index;
+    int fd;
+    int running;
+    pthread_t thread;
+    unsigned long frames;
+    struct ether_pcap_ring ring;
+};
+
 struct ether_pcap {
     char name[IFNAMSIZ];
-    int fd;
+    int fd; /* socket of worker 0, also used for transmitting */
     unsigned int irq;
+    struct ether_busy_poll busy_poll;
+    unsigned int nworkers;
+    int fanout_mode;
+    struct ether_pcap_worker workers[ETHER_PCAP_WORKERS_MAX];
+    struct ether_tx_queue txq;
+    int use_uring;
+    struct ether_uring *uring; /* NULL unless the socket is driven through io_uring */
 };
 
 #define PRIV(x) ((struct ether_pcap *)x->priv)
 
+/* worker serviced by the calling thread, NULL outside the worker threads */
+static __thread struct ether_pcap_worker *current_worker;
+
+static ssize_t ether_pcap_read(struct network_device *dev, struct pktbuf *pb);
+static int ether_pcap_ring_poll(struct network_device *dev, struct ether_pcap_ring *ring, int budget);
+
 static int
 ether_pcap_addr(struct network_device *dev) {
     int soc;
@@ -54,145 +119,587 @@ ether_pcap_addr(struct network_device *dev) {
     return 0;
 }
 
+/* maps a TPACKET_V3 receive ring, the socket keeps working with recv() if this fails */
 static int
-ether_pcap_open(struct network_device *dev)
+ether_pcap_ring_setup(struct network_device *dev, struct ether_pcap_ring *ring, int fd)
+{
+    struct tpacket_req3 req = {};
+    int version = TPACKET_V3;
+    unsigned int i;
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+        errorf("setsockopt(PACKET_VERSION): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    req.tp_block_size = ETHER_PCAP_RING_BLOCK_SIZE;
+    req.tp_block_nr = ETHER_PCAP_RING_BLOCK_NR;
+    req.tp_frame_size = ETHER_PCAP_RING_FRAME_SIZE;
+    req.tp_frame_nr = (ETHER_PCAP_RING_BLOCK_SIZE / ETHER_PCAP_RING_FRAME_SIZE) * ETHER_PCAP_RING_BLOCK_NR;
+    req.tp_retire_blk_tov = ETHER_PCAP_RING_RETIRE_MS;
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1) {
+        errorf("setsockopt(PACKET_RX_RING): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    ring->dev = dev;
+    ring->irq = 0;
+    ring->size = (size_t)ETHER_PCAP_RING_BLOCK_SIZE * ETHER_PCAP_RING_BLOCK_NR;
+    ring->map = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (ring->map == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), dev->name);
+        ring->map = NULL;
+        return -1;
+    }
+    for (i = 0; i < ETHER_PCAP_RING_BLOCK_NR; i++) {
+        ring->blocks[i].ring = ring;
+        ring->blocks[i].desc = (struct tpacket_block_desc *)(ring->map + (size_t)ETHER_PCAP_RING_BLOCK_SIZE * i);
+        ring->blocks[i].refcnt = 0;
+    }
+    ring->current = 0;
+    ring->frame = NULL;
+    ring->remaining = 0;
+    ring->lend = 0;
+    ring->held = 0;
+    ring->stuck = 0;
+    infof("rx ring mapped, dev=%s, blocks=%u, block_size=%u", dev->name, ETHER_PCAP_RING_BLOCK_NR, ETHER_PCAP_RING_BLOCK_SIZE);
+    return 0;
+}
+
+/* drops a reference to a block, the last one gives it back to the kernel and resumes a walker stuck on it */
+static void
+ether_pcap_block_put(void *arg)
+{
+    struct ether_pcap_block *block = arg;
+    struct ether_pcap_ring *ring = block->ring;
+    int old;
+
+    old = __atomic_load_n(&block->refcnt, __ATOMIC_RELAXED);
+    while (old > 1 && !__atomic_compare_exchange_n(&block->refcnt, &old, old - 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    if (old == 1) {
+        /* nobody else can take a reference now, only the walker does while it holds its own */
+        __atomic_sub_fetch(&ring->held, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&block->desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        /* cleared last, the walker must not take the stale status for a block handed over again */
+        __atomic_store_n(&block->refcnt, 0, __ATOMIC_SEQ_CST);
+        if (__atomic_exchange_n(&ring->stuck, 0, __ATOMIC_SEQ_CST) && ring->irq) {
+            intr_enable_irq(ring->irq, ring->dev);
+        }
+    }
+}
+
+static void
+ether_pcap_ring_teardown(struct network_device *dev, struct ether_pcap_ring *ring)
+{
+    if (ring->frame) {
+        ether_pcap_block_put(&ring->blocks[ring->current]);
+        ring->frame = NULL;
+    }
+    infof("dev=%s, blocks=%lu, lent=%lu, copied=%lu", dev->name, ring->blocks_walked, ring->lent, ring->copied);
+    if (__atomic_load_n(&ring->held, __ATOMIC_ACQUIRE)) {
+        /* frames are still referenced somewhere, the mapping must outlive them */
+        errorf("rx ring still lent, left mapped, dev=%s, blocks=%u", dev->name, ring->held);
+        return;
+    }
+    munmap(ring->map, ring->size);
+    ring->map = NULL;
+}
+
+/* opens a socket bound to the interface, with a receive ring mapped into ring if given */
+static int
+ether_pcap_socket(struct network_device *dev, struct ether_pcap_ring *ring)
 {
-    struct ether_pcap *pcap;
     struct sockaddr_ll addr = {};
     struct ifreq ifr = {};
+    int fd;
 
-    pcap = PRIV(dev);
-
-    pcap->fd = socket(PF_PACKET, SOCK_RAW, hton16(ETH_P_ALL));
-    if (pcap->fd == -1) {
+    fd = socket(PF_PACKET, SOCK_RAW, hton16(ETH_P_ALL));
+    if (fd == -1) {
         errorf("socket: %s, dev=%s", strerror(errno), dev->name);
         return -1;
     }
-    strncpy(ifr.ifr_name, pcap->name, sizeof(ifr.ifr_name)-1);
-    if (ioctl(pcap->fd, SIOCGIFINDEX, &ifr) == -1) {
+    strncpy(ifr.ifr_name, PRIV(dev)->name, sizeof(ifr.ifr_name)-1);
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) == -1) {
         errorf("ioctl(SIOCGIFINDEX): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
+        close(fd);
         return -1;
     }
+    /* the ring is set up before binding, so no frame is received outside of it */
+    if (ring && ether_pcap_ring_setup(dev, ring, fd) == -1) {
+        infof("falling back to recv(), dev=%s", dev->name);
+    }
     addr.sll_family = AF_PACKET;
     addr.sll_protocol = hton16(ETH_P_ALL);
     addr.sll_ifindex = ifr.ifr_ifindex;
-    if (bind(pcap->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
         errorf("bind: %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
+        if (ring && ring->map) {
+            ether_pcap_ring_teardown(dev, ring);
+        }
+        close(fd);
         return -1;
     }
+    return fd;
+}
+
+static void *
+ether_pcap_worker_thread(void *arg)
+{
+    struct ether_pcap_worker *worker = arg;
+    struct pollfd pfd;
+    cpu_set_t cpus;
+    long ncpus;
+    int ret, num;
+
+    current_worker = worker;
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus > 0) {
+        /* the kernel spreads flows across the group, each worker stays on one core */
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->index % ncpus, &cpus);
+        ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (ret) {
+            errorf("pthread_setaffinity_np() %s, dev=%s, worker=%u", strerror(ret), worker->dev->name, worker->index);
+        }
+    }
+    pfd.fd = worker->fd;
+    pfd.events = POLLIN;
+    while (__atomic_load_n(&worker->running, __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(&worker->ring.stuck, __ATOMIC_ACQUIRE)) {
+            /* the fd stays readable until the block is released, so don't spin on it */
+            poll(NULL, 0, ETHER_PCAP_WORKER_STUCK_MS);
+            continue;
+        }
+        ret = poll(&pfd, 1, ETHER_PCAP_WORKER_BLOCK_MS);
+        if (ret == -1 && errno != EINTR) {
+            errorf("poll: %s, dev=%s, worker=%u", strerror(errno), worker->dev->name, worker->index);
+            break;
+        }
+        if (ret <= 0) {
+            continue;
+        }
+        do {
+            if (worker->ring.map) {
+                num = ether_pcap_ring_poll(worker->dev, &worker->ring, PKTBUF_VEC_MAX);
+            } else {
+                num = ether_poll_batch_helper(worker->dev, ether_pcap_read, PKTBUF_VEC_MAX);
+            }
+            worker->frames += num;
+            /* a full batch may also be read errors only, e.g. the socket being closed under the thread */
+        } while (num == PKTBUF_VEC_MAX && __atomic_load_n(&worker->running, __ATOMIC_ACQUIRE));
+    }
+    return NULL;
+}
+
+static void
+ether_pcap_close_workers(struct network_device *dev, unsigned int num)
+{
+    struct ether_pcap_worker *worker;
+    unsigned int i;
+
+    for (i = 0; i < num; i++) {
+        worker = &PRIV(dev)->workers[i];
+        if (worker->running) {
+            __atomic_store_n(&worker->running, 0, __ATOMIC_RELEASE);
+            pthread_join(worker->thread, NULL);
+            infof("dev=%s, worker=%u, frames=%lu", dev->name, i, worker->frames);
+        }
+        if (worker->ring.map) {
+            ether_pcap_ring_teardown(dev, &worker->ring);
+        }
+        close(worker->fd);
+        worker->fd = -1;
+    }
+}
+
+static int
+ether_pcap_open_workers(struct network_device *dev)
+{
+    struct ether_pcap *pcap;
+    struct ether_pcap_worker *worker;
+    unsigned int i;
+    int arg, err;
+
+    pcap = PRIV(dev);
+    pcap->workers[0].fd = pcap->fd;
+    for (i = 1; i < pcap->nworkers; i++) {
+        pcap->workers[i].fd = ether_pcap_socket(dev, &pcap->workers[i].ring);
+        if (pcap->workers[i].fd == -1) {
+            ether_pcap_close_workers(dev, i);
+            return -1;
+        }
+    }
+    /* the group id only has to be unique among the fanout groups on this host */
+    arg = ((getpid() + dev->index) & 0xffff) | (pcap->fanout_mode << 16);
+    for (i = 0; i < pcap->nworkers; i++) {
+        if (setsockopt(pcap->workers[i].fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) == -1) {
+            errorf("setsockopt(PACKET_FANOUT): %s, dev=%s", strerror(errno), dev->name);
+            ether_pcap_close_workers(dev, pcap->nworkers);
+            return -1;
+        }
+    }
+    for (i = 0; i < pcap->nworkers; i++) {
+        worker = &pcap->workers[i];
+        worker->dev = dev;
+        worker->index = i;
+        worker->frames = 0;
+        worker->running = 1;
+        err = pthread_create(&worker->thread, NULL, ether_pcap_worker_thread, worker);
+        if (err) {
+            errorf("pthread_create() %s, dev=%s, worker=%u", strerror(err), dev->name, i);
+            worker->running = 0;
+            ether_pcap_close_workers(dev, pcap->nworkers);
+            return -1;
+        }
+    }
+    infof("fanout, dev=%s, workers=%u, mode=%d", dev->name, pcap->nworkers, pcap->fanout_mode);
+    return 0;
+}
+
+static int
+ether_pcap_open(struct network_device *dev)
+{
+    struct ether_pcap *pcap;
+    struct ether_pcap_ring *ring;
+    struct ifreq ifr = {};
+    int rcvbuf;
+
+    pcap = PRIV(dev);
+    /* busy-poll and io_uring mode read without the ring */
+    ring = ((pcap->busy_poll.spin_us || pcap->use_uring) && pcap->nworkers == 1) ? NULL : &pcap->workers[0].ring;
+    pcap->fd = ether_pcap_socket(dev, ring);
+    if (pcap->fd == -1) {
+        return -1;
+    }
+    strncpy(ifr.ifr_name, pcap->name, sizeof(ifr.ifr_name)-1);
     if (ioctl(pcap->fd, SIOCGIFFLAGS, &ifr) == -1) {
         errorf("ioctl(SIOCGIFFLAGS): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
-        return -1;
+        goto error;
     }
     ifr.ifr_flags = ifr.ifr_flags | IFF_PROMISC;
     if (ioctl(pcap->fd, SIOCSIFFLAGS, &ifr) == -1) {
         errorf("ioctl(SIOCSIFFLAGS): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
-        return -1;
-    }
-    /* Set Asynchronous I/O signal delivery destination */
-    if (fcntl(pcap->fd, F_SETOWN, getpid()) == -1) {
-        errorf("fcntl(F_SETOWN): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
-        return -1;
-    }
-    /* Enable Asynchronous I/O */
-    if (fcntl(pcap->fd, F_SETFL, O_ASYNC) == -1) {
-        errorf("fcntl(F_SETFL): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
-        return -1;
-    }
-    /* Use other signal instead of SIGIO */
-    if (fcntl(pcap->fd, F_SETSIG, pcap->irq) == -1) {
-        errorf("fcntl(F_SETSIG): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
-        return -1;
+        goto error;
     }
     if (memcmp(dev->address, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
         if (ether_pcap_addr(dev) == -1) {
             errorf("ether_pcap_addr() failure, dev=%s", dev->name);
-            close(pcap->fd);
-            return -1;
+            goto error;
         }
     }
+    if (pcap->nworkers > 1) {
+        /* every socket of the group is serviced by its own thread, busy-poll mode does not apply */
+        return ether_pcap_open_workers(dev);
+    }
+    if (pcap->use_uring && !pcap->busy_poll.spin_us) {
+        /* without the ring, bursts queue up in the socket buffer, sized like the ring (as far as allowed) */
+        rcvbuf = ETHER_PCAP_RING_BLOCK_SIZE * ETHER_PCAP_RING_BLOCK_NR;
+        if (setsockopt(pcap->fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) == -1) {
+            setsockopt(pcap->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        }
+        pcap->uring = ether_uring_open(dev, pcap->fd, pcap->irq, NULL);
+        if (pcap->uring) {
+            return 0;
+        }
+        infof("falling back to recv()/sendmsg(), dev=%s", dev->name);
+    }
+    if (pcap->busy_poll.spin_us) {
+        /* a dedicated thread spins on the fd instead of the interrupt thread */
+        if (ether_busy_poll_start(&pcap->busy_poll, dev, pcap->fd, ether_pcap_read) == -1) {
+            errorf("ether_busy_poll_start() failure, dev=%s", dev->name);
+            goto error;
+        }
+        return 0;
+    }
+    pcap->workers[0].ring.irq = pcap->irq;
+    if (intr_register_fd(pcap->irq, dev, pcap->fd) == -1) {
+        errorf("intr_register_fd() failure, dev=%s", dev->name);
+        goto error;
+    }
     return 0;
+error:
+    if (pcap->workers[0].ring.map) {
+        ether_pcap_ring_teardown(dev, &pcap->workers[0].ring);
+    }
+    close(pcap->fd);
+    return -1;
 };
 
 static int
 ether_pcap_close(struct network_device *dev)
 {
+    ether_tx_queue_destroy(dev, &PRIV(dev)->txq);
+    if (PRIV(dev)->nworkers > 1) {
+        ether_pcap_close_workers(dev, PRIV(dev)->nworkers);
+        return 0;
+    }
+    if (PRIV(dev)->uring) {
+        ether_uring_close(PRIV(dev)->uring);
+        PRIV(dev)->uring = NULL;
+    } else if (PRIV(dev)->busy_poll.spin_us) {
+        ether_busy_poll_stop(&PRIV(dev)->busy_poll);
+    } else {
+        intr_unregister_fd(PRIV(dev)->irq, dev);
+    }
+    if (PRIV(dev)->workers[0].ring.map) {
+        ether_pcap_ring_teardown(dev, &PRIV(dev)->workers[0].ring);
+    }
     close(PRIV(dev)->fd);
     return 0;
 }
 
 static ssize_t
-ether_pcap_write(struct network_device *dev, const uint8_t *frame, size_t flen)
+ether_pcap_write(struct network_device *dev, struct pktbuf *pb, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = {};
+
+    if (PRIV(dev)->uring) {
+        return ether_uring_write(PRIV(dev)->uring, iov, iovcnt);
+    }
+    if (dev->tx_batch != 1) {
+        return ether_tx_queue_push(dev, &PRIV(dev)->txq, pb);
+    }
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg(PRIV(dev)->fd, &msg, 0);
+}
+
+/* one sendmmsg() per batch, a frame the socket refuses is skipped */
+static int
+ether_pcap_send(struct network_device *dev, struct pktbuf **pbs, unsigned int num)
+{
+    struct mmsghdr msgs[ETHER_TX_QUEUE_MAX] = {};
+    struct iovec iov[ETHER_TX_QUEUE_MAX][2];
+    unsigned int i, done = 0;
+    int ret, sent = 0;
+
+    for (i = 0; i < num; i++) {
+        msgs[i].msg_hdr.msg_iov = iov[i];
+        msgs[i].msg_hdr.msg_iovlen = ether_tx_frame_iov(pbs[i], iov[i]);
+    }
+    while (done < num) {
+        ret = sendmmsg(PRIV(dev)->fd, msgs + done, num - done, 0);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errorf("sendmmsg: %s, dev=%s", strerror(errno), dev->name);
+            done++;
+            continue;
+        }
+        done += ret;
+        sent += ret;
+    }
+    return sent;
+}
+
+static int
+ether_pcap_flush(struct network_device *dev)
 {
-    return write(PRIV(dev)->fd, frame, flen);
+    if (PRIV(dev)->uring) {
+        ether_uring_flush(PRIV(dev)->uring);
+        return 0;
+    }
+    ether_tx_queue_flush(dev, &PRIV(dev)->txq);
+    return 0;
 }
 
 int
-ether_pcap_transmit(struct network_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst)
+ether_pcap_transmit(struct network_device *dev, uint16_t type, struct pktbuf *pb, const void *dst)
 {
-    return ether_transmit_helper(dev, type, buf, len, dst, ether_pcap_write);
+    return ether_transmit_helper(dev, type, pb, dst, ether_pcap_write);
 }
 
 static ssize_t
-ether_pcap_read(struct network_device *dev, uint8_t *buf, size_t size)
+ether_pcap_read(struct network_device *dev, struct pktbuf *pb)
 {
     ssize_t len;
 
-    len = read(PRIV(dev)->fd, buf, size);
+    /* reads never block, the socket is drained until EAGAIN, sends still may */
+    len = recv(current_worker ? current_worker->fd : PRIV(dev)->fd, pktbuf_data(pb), pktbuf_tailroom(pb), MSG_DONTWAIT);
     if (len <= 0) {
+        if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* drained */
+            return 0;
+        }
         if (len == -1 && errno != EINTR) {
-            errorf("read: %s, dev=%s", strerror(errno), dev->name);
+            errorf("recv: %s, dev=%s", strerror(errno), dev->name);
         }
         return -1;
     }
     return len;
 }
 
+/*
+ * a block still lent when the walker comes round to it again can be neither walked nor refilled by the kernel,
+ * so lending stops once one is within ETHER_PCAP_RING_LEND_GAP blocks ahead and the walker copies its way
+ * towards it, giving the stack that long to let go of the frames before the ring stops; lent frames are
+ * flagged PKTBUF_FLAG_PINNED, so only the input path holds them and the wait stays short
+ */
 static int
-ether_pcap_isr(unsigned int irq, void *id)
+ether_pcap_ring_lendable(struct ether_pcap_ring *ring)
 {
-    struct network_device *dev = (struct network_device *)id;
-    struct pollfd pfd;
-    int ret;
+    unsigned int i;
 
-    pfd.fd = PRIV(dev)->fd;
-    pfd.events = POLLIN;
-    while (1) {
-        ret = poll(&pfd, 1, 0);
-        if (ret == -1) {
-            if (errno == EINTR) {
-                continue;
+    for (i = 1; i <= ETHER_PCAP_RING_LEND_GAP; i++) {
+        if (__atomic_load_n(&ring->blocks[(ring->current + i) % ETHER_PCAP_RING_BLOCK_NR].refcnt, __ATOMIC_RELAXED)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* lends a frame to the stack in place, or copies it unless the block is lendable */
+static struct pktbuf *
+ether_pcap_ring_frame(struct ether_pcap_block *block, struct tpacket3_hdr *frame)
+{
+    struct ether_pcap_ring *ring;
+    struct pktbuf *pb = NULL;
+    uint8_t *data;
+    size_t len;
+
+    ring = block->ring;
+    data = (uint8_t *)frame + frame->tp_mac;
+    if (ring->lend) {
+        pb = pktbuf_alloc_ext(data, frame->tp_snaplen, ether_pcap_block_put, block);
+        if (pb) {
+            pb->flags |= PKTBUF_FLAG_PINNED;
+            __atomic_add_fetch(&block->refcnt, 1, __ATOMIC_RELAXED);
+            ring->lent++;
+        }
+    }
+    if (!pb) {
+        pb = pktbuf_alloc(ETHER_FRAME_SIZE_MAX);
+        if (!pb) {
+            errorf("pktbuf_alloc() failure");
+            return NULL;
+        }
+        len = MIN(frame->tp_snaplen, pktbuf_tailroom(pb));
+        memcpy(pktbuf_append(pb, len), data, len);
+        ring->copied++;
+    }
+    if (frame->tp_status & (TP_STATUS_CSUM_VALID | TP_STATUS_CSUMNOTREADY)) {
+        /* verified by the kernel, or sent by the local host leaving the checksum to us */
+        pb->flags |= PKTBUF_FLAG_CSUM_VALID;
+    }
+    return pb;
+}
+
+/* walks up to budget frames out of the receive ring, returns the number consumed */
+static int
+ether_pcap_ring_poll(struct network_device *dev, struct ether_pcap_ring *ring, int budget)
+{
+    struct ether_pcap_block *block;
+    struct tpacket3_hdr *frame;
+    struct pktbuf *pbs[PKTBUF_VEC_MAX];
+    unsigned int num = 0;
+    int total = 0;
+
+    while (total < budget) {
+        block = &ring->blocks[ring->current];
+        if (!ring->frame) {
+            if (__atomic_load_n(&block->refcnt, __ATOMIC_ACQUIRE)) {
+                /*
+                 * still lent since the last lap, its frames are stale and the kernel waits for it as well;
+                 * marked stuck before looking again, so that the last put either is seen here or resumes us
+                 */
+                __atomic_store_n(&ring->stuck, 1, __ATOMIC_SEQ_CST);
+                if (__atomic_load_n(&block->refcnt, __ATOMIC_SEQ_CST)) {
+                    break;
+                }
+                __atomic_store_n(&ring->stuck, 0, __ATOMIC_RELAXED);
             }
-            errorf("poll: %s, dev=%s", strerror(errno), dev->name);
-            return -1;
+            if (!(__atomic_load_n(&block->desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+                /* drained, the kernel still owns the next block */
+                break;
+            }
+            ring->frame = (struct tpacket3_hdr *)((uint8_t *)block->desc + block->desc->hdr.bh1.offset_to_first_pkt);
+            ring->remaining = block->desc->hdr.bh1.num_pkts;
+            ring->lend = ether_pcap_ring_lendable(ring);
+            __atomic_store_n(&block->refcnt, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&ring->held, 1, __ATOMIC_RELAXED);
+            ring->blocks_walked++;
         }
-        if (ret == 0) {
-            break;
+        while (ring->remaining && total < budget) {
+            frame = ring->frame;
+            pbs[num] = ether_pcap_ring_frame(block, frame);
+            if (pbs[num]) {
+                num++;
+            }
+            total++;
+            ring->frame = (struct tpacket3_hdr *)((uint8_t *)frame + frame->tp_next_offset);
+            ring->remaining--;
+            if (num == PKTBUF_VEC_MAX) {
+                ether_input_batch_helper(dev, pbs, num);
+                num = 0;
+            }
+        }
+        if (!ring->remaining) {
+            /* the lent frames keep the block until they are released */
+            ring->frame = NULL;
+            ring->current = (ring->current + 1) % ETHER_PCAP_RING_BLOCK_NR;
+            ether_pcap_block_put(block);
         }
-        ether_poll_helper(dev, ether_pcap_read);
     }
+    if (num) {
+        ether_input_batch_helper(dev, pbs, num);
+    }
+    return total;
+}
+
+static int
+ether_pcap_isr(unsigned int irq, void *id)
+{
+    struct network_device *dev = (struct network_device *)id;
+
+    /* mask the fd until ether_pcap_poll() has drained it */
+    intr_disable_irq(irq, dev);
+    network_device_schedule_poll(dev);
     return 0;
 }
 
+static int
+ether_pcap_poll(struct network_device *dev, int budget)
+{
+    int num;
+
+    if (PRIV(dev)->uring) {
+        num = ether_uring_poll(PRIV(dev)->uring, budget);
+    } else if (PRIV(dev)->workers[0].ring.map) {
+        num = ether_pcap_ring_poll(dev, &PRIV(dev)->workers[0].ring, budget);
+    } else {
+        num = ether_poll_batch_helper(dev, ether_pcap_read, budget);
+    }
+    /* a stuck ring leaves the fd readable, the put releasing the block re-enables the irq instead */
+    if (num < budget && !__atomic_load_n(&PRIV(dev)->workers[0].ring.stuck, __ATOMIC_ACQUIRE)) {
+        intr_enable_irq(PRIV(dev)->irq, dev);
+    }
+    return num;
+}
+
 static struct network_device_operations ether_pcap_ops = {
     .open = ether_pcap_open,
     .close = ether_pcap_close,
     .transmit = ether_pcap_transmit,
+    .poll = ether_pcap_poll,
+    .flush = ether_pcap_flush,
 };
 
 struct network_device *
 ether_pcap_init(const char *name, const char *addr)
+{
+    return ether_pcap_init_fanout(name, addr, 1, PACKET_FANOUT_HASH);
+}
+
+struct network_device *
+ether_pcap_init_fanout(const char *name, const char *addr, unsigned int workers, int mode)
 {
     struct network_device *dev;
     struct ether_pcap *pcap;
 
+    if (workers < 1 || workers > ETHER_PCAP_WORKERS_MAX) {
+        errorf("invalid number of workers, workers=%u", workers);
+        return NULL;
+    }
+
     dev = network_device_allocate(ether_setup_helper);
     if (!dev) {
         errorf("network_device_alloc() failure");
@@ -213,6 +720,9 @@ ether_pcap_init(const char *name, const char *addr)
     strncpy(pcap->name, name, sizeof(pcap->name)-1);
     pcap->fd = -1;
     pcap->irq = ETHER_PCAP_IRQ;
+    pcap->nworkers = workers;
+    pcap->fanout_mode = mode;
+    ether_tx_queue_init(&pcap->txq, ether_pcap_send);
     dev->priv = pcap;
     if (network_device_register(dev) == -1) {
         errorf("network_device_register() failure");
@@ -222,4 +732,26 @@ ether_pcap_init(const char *name, const char *addr)
     intr_request_irq(pcap->irq, ether_pcap_isr, NETWORK_IRQ_SHARED, dev->name, dev);
     debugf("ethernet device initialized, dev=%s", dev->name);
     return dev;
-}
\ No newline at end of file
+}
+
+int
+ether_pcap_set_busy_poll(struct network_device *dev, unsigned int spin_us)
+{
+    if (NETWORK_DEVICE_IS_UP(dev)) {
+        errorf("already opened, dev=%s", dev->name);
+        return -1;
+    }
+    PRIV(dev)->busy_poll.spin_us = spin_us;
+    return 0;
+}
+
+int
+ether_pcap_set_io_uring(struct network_device *dev, int enable)
+{
+    if (NETWORK_DEVICE_IS_UP(dev)) {
+        errorf("already opened, dev=%s", dev->name);
+        return -1;
+    }
+    PRIV(dev)->use_uring = enable;
+    return 0;
+}
@@ -0,0 +1,670 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+#include "handler.h"
+
+#include "util.h"
+#include "net2.h"
+#include "ether.h"
+
+#include "etherreplay.h"
+
+#define ETHER_REPLAY_IRQ (SIGRTMIN+6)
+
+#define ETHER_REPLAY_PCAP_MAGIC 0xa1b2c3d4
+#define ETHER_REPLAY_PCAP_MAGIC_NSEC 0xa1b23c4d
+#define ETHER_REPLAY_PCAP_HDR_SIZE 24
+#define ETHER_REPLAY_PCAP_REC_SIZE 16
+
+#define ETHER_REPLAY_PCAPNG_SHB 0x0a0d0d0a
+#define ETHER_REPLAY_PCAPNG_IDB 0x00000001
+#define ETHER_REPLAY_PCAPNG_SPB 0x00000003
+#define ETHER_REPLAY_PCAPNG_EPB 0x00000006
+#define ETHER_REPLAY_PCAPNG_BOM 0x1a2b3c4d
+#define ETHER_REPLAY_PCAPNG_OPT_TSRESOL 9
+
+/* interfaces of a pcapng section that are kept track of, packets of the others are skipped */
+#define ETHER_REPLAY_PCAPNG_IFACES_MAX 16
+
+#define ETHER_REPLAY_LINKTYPE_ETHERNET 1
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/* how long to wait before looking again when no frame could be injected, nor is one due later */
+#define ETHER_REPLAY_RETRY_NS 1000000
+
+/* a replayable frame of the capture */
+struct ether_replay_frame {
+    const uint8_t *data; /* inside the mapping */
+    uint32_t len;
+    uint64_t ts; /* nanoseconds */
+};
+
+/* one run through the file */
+struct ether_replay_stats {
+    unsigned long frames;
+    unsigned long bytes;
+    unsigned long late;
+    uint64_t max_lag;
+    uint64_t start;
+    uint64_t end;
+};
+
+/* state of the pcapng section being scanned */
+struct ether_replay_pcapng_iface {
+    int ether;
+    uint8_t tsresol;
+};
+
+struct ether_replay {
+    char file[256];
+    int mode;
+    unsigned long pps;
+    unsigned int loops;
+    int fd;
+    int timer_fd;
+    unsigned int irq;
+    uint8_t *map; /* NULL if not mapped */
+    size_t size;
+    struct ether_replay_frame *frames; /* NULL while counting them */
+    size_t nframes;
+    unsigned long skipped; /* records that cannot be replayed, e.g. truncated or not Ethernet */
+    size_t cursor; /* next frame of the current run */
+    unsigned int runs; /* runs completed */
+    int done;
+    uint64_t now; /* clock of the current poll */
+    uint64_t next_due; /* when the frame at the cursor is due, once it was found early */
+    struct ether_replay_stats run;
+    struct ether_replay_stats total;
+    unsigned long tx_frames;
+    unsigned long tx_bytes;
+};
+
+#define PRIV(x) ((struct ether_replay *)x->priv)
+
+static uint64_t
+ether_replay_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* the file may be of either byte order and its fields are not aligned */
+static uint32_t
+ether_replay_get32(const uint8_t *p, int swap)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t
+ether_replay_get16(const uint8_t *p, int swap)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap16(v) : v;
+}
+
+static void
+ether_replay_add(struct ether_replay *r, const uint8_t *data, uint32_t caplen, uint32_t origlen, uint64_t ts)
+{
+    if (caplen < origlen || caplen < ETHER_HDR_SIZE || caplen > ETHER_FRAME_SIZE_MAX) {
+        r->skipped++;
+        return;
+    }
+    if (r->frames) {
+        r->frames[r->nframes].data = data;
+        r->frames[r->nframes].len = caplen;
+        r->frames[r->nframes].ts = ts;
+    }
+    r->nframes++;
+}
+
+static int
+ether_replay_scan_pcap(struct ether_replay *r)
+{
+    uint32_t magic, caplen, origlen, sec, frac;
+    int swap, nsec;
+    size_t off;
+
+    magic = ether_replay_get32(r->map, 0);
+    swap = (magic == __builtin_bswap32(ETHER_REPLAY_PCAP_MAGIC) || magic == __builtin_bswap32(ETHER_REPLAY_PCAP_MAGIC_NSEC));
+    nsec = (ether_replay_get32(r->map, swap) == ETHER_REPLAY_PCAP_MAGIC_NSEC);
+    /* the upper bits of the link type carry FCS information */
+    if ((ether_replay_get32(r->map + 20, swap) & 0xffff) != ETHER_REPLAY_LINKTYPE_ETHERNET) {
+        errorf("not an Ethernet capture, file=%s, linktype=%u", r->file, ether_replay_get32(r->map + 20, swap) & 0xffff);
+        return -1;
+    }
+    off = ETHER_REPLAY_PCAP_HDR_SIZE;
+    while (off + ETHER_REPLAY_PCAP_REC_SIZE <= r->size) {
+        sec = ether_replay_get32(r->map + off, swap);
+        frac = ether_replay_get32(r->map + off + 4, swap);
+        caplen = ether_replay_get32(r->map + off + 8, swap);
+        origlen = ether_replay_get32(r->map + off + 12, swap);
+        off += ETHER_REPLAY_PCAP_REC_SIZE;
+        if (caplen > r->size - off) {
+            warnf("truncated record, file=%s, offset=%zu", r->file, off);
+            break;
+        }
+        ether_replay_add(r, r->map + off, caplen, origlen, sec * NSEC_PER_SEC + (nsec ? frac : frac * 1000ULL));
+        off += caplen;
+    }
+    return 0;
+}
+
+/* tsresol is a power of ten, or of two with the high bit set */
+static uint64_t
+ether_replay_pcapng_ts(uint64_t ts, uint8_t tsresol)
+{
+    uint64_t scale = 1;
+    int exp;
+
+    exp = tsresol & 0x7f;
+    if (tsresol & 0x80) {
+        if (exp >= 64) {
+            return 0;
+        }
+        return (ts >> exp) * NSEC_PER_SEC + (((ts & ((1ULL << exp) - 1)) * NSEC_PER_SEC) >> exp);
+    }
+    while (exp-- > 9) {
+        scale *= 10;
+    }
+    if (scale > 1) {
+        return ts / scale;
+    }
+    for (exp = tsresol; exp < 9; exp++) {
+        scale *= 10;
+    }
+    return ts * scale;
+}
+
+static void
+ether_replay_pcapng_idb(const uint8_t *body, uint32_t len, int swap, struct ether_replay_pcapng_iface *iface)
+{
+    uint16_t code, olen;
+    uint32_t off;
+
+    iface->ether = (ether_replay_get16(body, swap) == ETHER_REPLAY_LINKTYPE_ETHERNET);
+    iface->tsresol = 6;
+    for (off = 8; off + 4 <= len; off += 4 + ((olen + 3) & ~3)) {
+        code = ether_replay_get16(body + off, swap);
+        olen = ether_replay_get16(body + off + 2, swap);
+        if (!code || off + 4 + olen > len) {
+            break;
+        }
+        if (code == ETHER_REPLAY_PCAPNG_OPT_TSRESOL && olen == 1) {
+            iface->tsresol = body[off + 4];
+        }
+    }
+}
+
+static int
+ether_replay_scan_pcapng(struct ether_replay *r)
+{
+    struct ether_replay_pcapng_iface ifaces[ETHER_REPLAY_PCAPNG_IFACES_MAX];
+    unsigned int nifaces = 0;
+    uint32_t type, len, bom, id, caplen, origlen;
+    const uint8_t *body;
+    uint64_t ts = 0;
+    int swap = 0;
+    size_t off;
+
+    for (off = 0; off + 12 <= r->size; off += len) {
+        type = ether_replay_get32(r->map + off, 0);
+        if (type == ETHER_REPLAY_PCAPNG_SHB) {
+            /* every section has its own byte order and interfaces */
+            bom = ether_replay_get32(r->map + off + 8, 0);
+            if (bom != ETHER_REPLAY_PCAPNG_BOM && bom != __builtin_bswap32(ETHER_REPLAY_PCAPNG_BOM)) {
+                errorf("bad byte-order magic, file=%s, offset=%zu", r->file, off);
+                return -1;
+            }
+            swap = (bom != ETHER_REPLAY_PCAPNG_BOM);
+            nifaces = 0;
+        }
+        type = ether_replay_get32(r->map + off, swap);
+        len = ether_replay_get32(r->map + off + 4, swap);
+        if (len < 12 || len % 4 || len > r->size - off) {
+            warnf("truncated block, file=%s, offset=%zu", r->file, off);
+            break;
+        }
+        body = r->map + off + 8;
+        len -= 12;
+        switch (type) {
+        case ETHER_REPLAY_PCAPNG_IDB:
+            if (nifaces < ETHER_REPLAY_PCAPNG_IFACES_MAX) {
+                /* too short to tell the link type, the interface keeps its id but its packets are skipped */
+                ifaces[nifaces].ether = 0;
+                if (len >= 8) {
+                    ether_replay_pcapng_idb(body, len, swap, &ifaces[nifaces]);
+                }
+            }
+            nifaces++;
+            break;
+        case ETHER_REPLAY_PCAPNG_EPB:
+            if (len < 20) {
+                r->skipped++;
+                break;
+            }
+            id = ether_replay_get32(body, swap);
+            caplen = ether_replay_get32(body + 12, swap);
+            origlen = ether_replay_get32(body + 16, swap);
+            if (id >= MIN(nifaces, ETHER_REPLAY_PCAPNG_IFACES_MAX) || !ifaces[id].ether || caplen > len - 20) {
+                r->skipped++;
+                break;
+            }
+            ts = ((uint64_t)ether_replay_get32(body + 4, swap) << 32) | ether_replay_get32(body + 8, swap);
+            ts = ether_replay_pcapng_ts(ts, ifaces[id].tsresol);
+            ether_replay_add(r, body + 20, caplen, origlen, ts);
+            break;
+        case ETHER_REPLAY_PCAPNG_SPB:
+            /* no timestamp, it goes along with the previous packet */
+            if (len < 4 || !nifaces || !ifaces[0].ether) {
+                r->skipped++;
+                break;
+            }
+            origlen = ether_replay_get32(body, swap);
+            ether_replay_add(r, body + 4, MIN(origlen, len - 4), origlen, ts);
+            break;
+        default:
+            break;
+        }
+        len += 12;
+    }
+    return 0;
+}
+
+/* counts the frames first, then indexes them */
+static int
+ether_replay_scan(struct ether_replay *r)
+{
+    int (*scan)(struct ether_replay *r);
+    uint32_t magic;
+
+    if (r->size < ETHER_REPLAY_PCAP_HDR_SIZE) {
+        errorf("too short, file=%s", r->file);
+        return -1;
+    }
+    magic = ether_replay_get32(r->map, 0);
+    if (magic == ETHER_REPLAY_PCAPNG_SHB) {
+        scan = ether_replay_scan_pcapng;
+    } else if (magic == ETHER_REPLAY_PCAP_MAGIC || magic == ETHER_REPLAY_PCAP_MAGIC_NSEC ||
+        magic == __builtin_bswap32(ETHER_REPLAY_PCAP_MAGIC) || magic == __builtin_bswap32(ETHER_REPLAY_PCAP_MAGIC_NSEC)) {
+        scan = ether_replay_scan_pcap;
+    } else {
+        errorf("unknown format, file=%s, magic=0x%08x", r->file, magic);
+        return -1;
+    }
+    if (scan(r) == -1) {
+        return -1;
+    }
+    if (!r->nframes) {
+        errorf("no Ethernet frame to replay, file=%s, skipped=%lu", r->file, r->skipped);
+        return -1;
+    }
+    r->frames = memory_alloc(sizeof(*r->frames) * r->nframes);
+    if (!r->frames) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    r->nframes = 0;
+    r->skipped = 0;
+    return scan(r);
+}
+
+static void
+ether_replay_cleanup(struct network_device *dev)
+{
+    struct ether_replay *r;
+
+    r = PRIV(dev);
+    if (r->frames) {
+        memory_free(r->frames);
+        r->frames = NULL;
+    }
+    if (r->map) {
+        munmap(r->map, r->size);
+        r->map = NULL;
+    }
+    if (r->fd != -1) {
+        close(r->fd);
+        r->fd = -1;
+    }
+    if (r->timer_fd != -1) {
+        close(r->timer_fd);
+        r->timer_fd = -1;
+    }
+}
+
+static void
+ether_replay_arm(struct ether_replay *r, uint64_t due)
+{
+    struct itimerspec its = {};
+
+    /* a zero it_value would disarm the timer */
+    due = MAX(due, 1);
+    its.it_value.tv_sec = due / NSEC_PER_SEC;
+    its.it_value.tv_nsec = due % NSEC_PER_SEC;
+    if (timerfd_settime(r->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+        errorf("timerfd_settime: %s", strerror(errno));
+    }
+}
+
+static int
+ether_replay_open(struct network_device *dev)
+{
+    struct ether_replay *r;
+    struct stat st;
+
+    r = PRIV(dev);
+    r->fd = open(r->file, O_RDONLY | O_CLOEXEC);
+    if (r->fd == -1) {
+        errorf("open: %s, file=%s", strerror(errno), r->file);
+        return -1;
+    }
+    if (fstat(r->fd, &st) == -1) {
+        errorf("fstat: %s, file=%s", strerror(errno), r->file);
+        goto error;
+    }
+    r->size = st.st_size;
+    r->map = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, r->fd, 0);
+    if (r->map == MAP_FAILED) {
+        errorf("mmap: %s, file=%s", strerror(errno), r->file);
+        r->map = NULL;
+        goto error;
+    }
+    madvise(r->map, r->size, MADV_SEQUENTIAL);
+    if (ether_replay_scan(r) == -1) {
+        goto error;
+    }
+    r->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (r->timer_fd == -1) {
+        errorf("timerfd_create: %s", strerror(errno));
+        goto error;
+    }
+    if (intr_register_fd(r->irq, dev, r->timer_fd) == -1) {
+        errorf("intr_register_fd() failure, dev=%s", dev->name);
+        goto error;
+    }
+    /* the first run starts on the interrupt thread right away */
+    ether_replay_arm(r, ether_replay_clock());
+    infof("dev=%s, file=%s, frames=%zu, skipped=%lu, mode=%s, loops=%u", dev->name, r->file, r->nframes, r->skipped,
+        r->mode == ETHER_REPLAY_MODE_TIMED ? "timed" : r->mode == ETHER_REPLAY_MODE_MAX_RATE ? "max-rate" : "pps", r->loops);
+    return 0;
+error:
+    ether_replay_cleanup(dev);
+    return -1;
+}
+
+static void
+ether_replay_report(struct network_device *dev, const char *what, const struct ether_replay_stats *s)
+{
+    double elapsed;
+
+    elapsed = (double)(s->end - s->start) / NSEC_PER_SEC;
+    infof("dev=%s, %s, frames=%lu, bytes=%lu, elapsed=%.6fs, pps=%.0f, mbps=%.2f, skipped=%lu, late=%lu, max_lag=%luus",
+        dev->name, what, s->frames, s->bytes, elapsed,
+        elapsed > 0 ? s->frames / elapsed : 0.0, elapsed > 0 ? s->bytes * 8 / elapsed / 1000000 : 0.0,
+        PRIV(dev)->skipped, s->late, (unsigned long)(s->max_lag / 1000));
+}
+
+static int
+ether_replay_close(struct network_device *dev)
+{
+    struct ether_replay *r;
+    char what[32];
+
+    r = PRIV(dev);
+    intr_unregister_fd(r->irq, dev);
+    if (r->run.frames) {
+        snprintf(what, sizeof(what), "run=%u (partial)", r->runs + 1);
+        ether_replay_report(dev, what, &r->run);
+    }
+    snprintf(what, sizeof(what), "runs=%u", r->runs);
+    ether_replay_report(dev, what, &r->total);
+    infof("dev=%s, tx=%lu, tx_bytes=%lu", dev->name, r->tx_frames, r->tx_bytes);
+    ether_replay_cleanup(dev);
+    return 0;
+}
+
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+/* nothing is on the other end of the wire, what the stack sends is only counted */
+static ssize_t
+ether_replay_write(struct network_device *dev, struct pktbuf *pb, const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    PRIV(dev)->tx_frames++;
+    PRIV(dev)->tx_bytes += len;
+    return len;
+}
+
+int
+ether_replay_transmit(struct network_device *dev, uint16_t type, struct pktbuf *pb, const void *dst)
+{
+    return ether_transmit_helper(dev, type, pb, dst, ether_replay_write);
+}
+
+static void
+ether_replay_end_run(struct network_device *dev)
+{
+    struct ether_replay *r;
+    char what[16];
+
+    r = PRIV(dev);
+    r->runs++;
+    snprintf(what, sizeof(what), "run=%u", r->runs);
+    ether_replay_report(dev, what, &r->run);
+    if (!r->total.start) {
+        r->total.start = r->run.start;
+    }
+    r->total.end = r->run.end;
+    r->total.frames += r->run.frames;
+    r->total.bytes += r->run.bytes;
+    r->total.late += r->run.late;
+    r->total.max_lag = MAX(r->total.max_lag, r->run.max_lag);
+    memset(&r->run, 0, sizeof(r->run));
+    r->cursor = 0;
+    if (r->loops && r->runs >= r->loops) {
+        __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static uint64_t
+ether_replay_due(struct ether_replay *r)
+{
+    switch (r->mode) {
+    case ETHER_REPLAY_MODE_TIMED:
+        /* captures are not always in timestamp order, an earlier one is just due right away */
+        return r->run.start + (r->frames[r->cursor].ts > r->frames[0].ts ? r->frames[r->cursor].ts - r->frames[0].ts : 0);
+    case ETHER_REPLAY_MODE_PPS:
+        return r->run.start + r->cursor * NSEC_PER_SEC / r->pps;
+    default:
+        return 0;
+    }
+}
+
+/* the next frame of the run if it is due, else 0 as if the wire were drained */
+static ssize_t
+ether_replay_read(struct network_device *dev, struct pktbuf *pb)
+{
+    struct ether_replay *r;
+    struct ether_replay_frame *frame;
+    uint64_t due;
+    uint8_t *dst;
+    size_t len;
+
+    r = PRIV(dev);
+    if (r->cursor == r->nframes) {
+        ether_replay_end_run(dev);
+    }
+    if (r->done) {
+        return 0;
+    }
+    if (!r->run.start) {
+        r->run.start = r->now;
+    }
+    due = ether_replay_due(r);
+    if (due > r->now) {
+        r->next_due = due;
+        return 0;
+    }
+    if (due && r->now - due > ETHER_REPLAY_LATE_NS) {
+        r->run.late++;
+        r->run.max_lag = MAX(r->run.max_lag, r->now - due);
+    }
+    frame = &r->frames[r->cursor++];
+    len = MIN(frame->len, pktbuf_tailroom(pb));
+    memcpy(pktbuf_data(pb), frame->data, len);
+    dst = pktbuf_data(pb);
+    if (!(dst[0] & 0x01)) {
+        /* captured for another host, the stack would filter it out */
+        memcpy(dst, dev->address, ETHER_ADDR_LEN);
+    }
+    r->run.frames++;
+    r->run.bytes += len;
+    r->run.end = r->now;
+    return len;
+}
+
+static int
+ether_replay_isr(unsigned int irq, void *id)
+{
+    struct network_device *dev = (struct network_device *)id;
+
+    if (!NETWORK_DEVICE_IS_UP(dev)) {
+        /* fired before ether_replay_open() returned, the poll would be skipped; look again a bit later */
+        ether_replay_arm(PRIV(dev), ether_replay_clock() + ETHER_REPLAY_RETRY_NS);
+        return 0;
+    }
+    /* mask the timer until ether_replay_poll() has caught up with the schedule */
+    intr_disable_irq(irq, dev);
+    network_device_schedule_poll(dev);
+    return 0;
+}
+
+static int
+ether_replay_poll(struct network_device *dev, int budget)
+{
+    struct ether_replay *r;
+    uint64_t expirations;
+    int num;
+
+    r = PRIV(dev);
+    read(r->timer_fd, &expirations, sizeof(expirations));
+    r->now = ether_replay_clock();
+    num = ether_poll_batch_helper(dev, ether_replay_read, budget);
+    if (num < budget && !r->done) {
+        /* the next frame is early, sleep until it is due; if it was not looked at, no buffer was left for it */
+        ether_replay_arm(r, r->next_due > r->now ? r->next_due : r->now + ETHER_REPLAY_RETRY_NS);
+        intr_enable_irq(r->irq, dev);
+    }
+    return num;
+}
+
+static struct network_device_operations ether_replay_ops = {
+    .open = ether_replay_open,
+    .close = ether_replay_close,
+    .transmit = ether_replay_transmit,
+    .poll = ether_replay_poll,
+};
+
+struct network_device *
+ether_replay_init(const char *file, const char *addr)
+{
+    struct network_device *dev;
+    struct ether_replay *r;
+
+    if (strlen(file) >= sizeof(r->file)) {
+        errorf("file name too long, file=%s", file);
+        return NULL;
+    }
+    dev = network_device_allocate(ether_setup_helper);
+    if (!dev) {
+        errorf("network_device_alloc() failure");
+        return NULL;
+    }
+    if (addr) {
+        if (ether_addr_pton(addr, dev->address) == -1) {
+            errorf("invalid address, addr=%s", addr);
+            return NULL;
+        }
+    }
+    dev->ops = &ether_replay_ops;
+    r = memory_alloc(sizeof(*r));
+    if (!r) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    strncpy(r->file, file, sizeof(r->file)-1);
+    r->mode = ETHER_REPLAY_MODE_TIMED;
+    r->loops = 1;
+    r->fd = -1;
+    r->timer_fd = -1;
+    r->irq = ETHER_REPLAY_IRQ;
+    dev->priv = r;
+    if (network_device_register(dev) == -1) {
+        errorf("network_device_register() failure");
+        memory_free(r);
+        return NULL;
+    }
+    intr_request_irq(r->irq, ether_replay_isr, NETWORK_IRQ_SHARED, dev->name, dev);
+    debugf("ethernet device initialized, dev=%s", dev->name);
+    return dev;
+}
+
+int
+ether_replay_set_mode(struct network_device *dev, int mode, unsigned long pps)
+{
+    if (NETWORK_DEVICE_IS_UP(dev)) {
+        errorf("already opened, dev=%s", dev->name);
+        return -1;
+    }
+    if (mode != ETHER_REPLAY_MODE_TIMED && mode != ETHER_REPLAY_MODE_MAX_RATE && mode != ETHER_REPLAY_MODE_PPS) {
+        errorf("invalid mode, mode=%d", mode);
+        return -1;
+    }
+    if (mode == ETHER_REPLAY_MODE_PPS && !pps) {
+        errorf("rate required, dev=%s", dev->name);
+        return -1;
+    }
+    PRIV(dev)->mode = mode;
+    PRIV(dev)->pps = pps;
+    return 0;
+}
+
+int
+ether_replay_set_loops(struct network_device *dev, unsigned int loops)
+{
+    if (NETWORK_DEVICE_IS_UP(dev)) {
+        errorf("already opened, dev=%s", dev->name);
+        return -1;
+    }
+    PRIV(dev)->loops = loops;
+    return 0;
+}
+
+int
+ether_replay_done(struct network_device *dev)
+{
+    return __atomic_load_n(&PRIV(dev)->done, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,560 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "handler.h"
+
+#include "util.h"
+#include "net2.h"
+#include "ether.h"
+
+#include "ethershm.h"
+
+#define ETHER_SHM_IRQ (SIGRTMIN+5)
+
+#define ETHER_SHM_MAGIC 0x6c6e736d
+#define ETHER_SHM_VERSION 1
+
+#define ETHER_SHM_RING_MASK (ETHER_SHM_RING_SIZE - 1)
+
+/* fds handed over to the peer: the memfd, then the eventfd of each ring */
+#define ETHER_SHM_FDS 3
+
+/* how long the attaching side waits for the creator to hand the fds over */
+#define ETHER_SHM_ATTACH_TIMEOUT 5
+
+struct ether_shm_slot {
+    uint32_t len;
+    uint8_t data[ETHER_SHM_SLOT_SIZE];
+};
+
+/* one direction, each side only ever moves its own index */
+struct ether_shm_ring {
+    uint32_t head __attribute__((aligned(64))); /* next slot to fill, moved by the producer */
+    uint32_t tail __attribute__((aligned(64))); /* next slot to read, moved by the consumer */
+    uint32_t sleeping; /* set by the consumer before it waits on the eventfd, cleared by the producer signalling it */
+    struct ether_shm_slot slots[ETHER_SHM_RING_SIZE] __attribute__((aligned(64)));
+};
+
+/* layout of the memfd, the same in both processes */
+struct ether_shm_region {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ring_size;
+    uint32_t slot_size;
+    struct ether_shm_ring rings[2]; /* indexed by the side producing into it */
+};
+
+struct ether_shm {
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int side; /* 0 if this process created the region, 1 if it attached to it */
+    int listen_fd; /* -1 once the peer has attached */
+    int mem_fd;
+    int efds[2]; /* signals the ring of the same index */
+    unsigned int irq;
+    struct ether_shm_region *region; /* NULL if not mapped */
+    mutex_t mutex; /* serializes the producers of the TX ring */
+    unsigned int tx_unsignalled; /* frames produced since the peer was last looked at for a wakeup */
+    unsigned long rx_frames;
+    unsigned long tx_frames;
+    unsigned long tx_drops;
+    unsigned long wakeups;
+};
+
+#define PRIV(x) ((struct ether_shm *)x->priv)
+
+#define ETHER_SHM_TX(x) (&(x)->region->rings[(x)->side])
+#define ETHER_SHM_RX(x) (&(x)->region->rings[!(x)->side])
+
+static int
+ether_shm_map(struct network_device *dev)
+{
+    struct ether_shm *shm;
+
+    shm = PRIV(dev);
+    shm->region = mmap(NULL, sizeof(*shm->region), PROT_READ | PROT_WRITE, MAP_SHARED, shm->mem_fd, 0);
+    if (shm->region == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), dev->name);
+        shm->region = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void
+ether_shm_cleanup(struct network_device *dev)
+{
+    struct ether_shm *shm;
+    int i;
+
+    shm = PRIV(dev);
+    if (shm->region) {
+        munmap(shm->region, sizeof(*shm->region));
+        shm->region = NULL;
+    }
+    if (shm->listen_fd != -1) {
+        close(shm->listen_fd);
+        unlink(shm->path);
+        shm->listen_fd = -1;
+    }
+    if (shm->mem_fd != -1) {
+        close(shm->mem_fd);
+        shm->mem_fd = -1;
+    }
+    for (i = 0; i < 2; i++) {
+        if (shm->efds[i] != -1) {
+            close(shm->efds[i]);
+            shm->efds[i] = -1;
+        }
+    }
+}
+
+static int
+ether_shm_create(struct network_device *dev)
+{
+    struct ether_shm *shm;
+    struct sockaddr_un addr = {};
+    int i;
+
+    shm = PRIV(dev);
+    shm->mem_fd = memfd_create(dev->name, MFD_CLOEXEC);
+    if (shm->mem_fd == -1) {
+        errorf("memfd_create: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (ftruncate(shm->mem_fd, sizeof(*shm->region)) == -1) {
+        errorf("ftruncate: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (ether_shm_map(dev) == -1) {
+        return -1;
+    }
+    /* the memfd comes zeroed, both rings empty; neither consumer is polling yet */
+    shm->region->magic = ETHER_SHM_MAGIC;
+    shm->region->version = ETHER_SHM_VERSION;
+    shm->region->ring_size = ETHER_SHM_RING_SIZE;
+    shm->region->slot_size = ETHER_SHM_SLOT_SIZE;
+    for (i = 0; i < 2; i++) {
+        shm->region->rings[i].sleeping = 1;
+        shm->efds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (shm->efds[i] == -1) {
+            errorf("eventfd: %s, dev=%s", strerror(errno), dev->name);
+            return -1;
+        }
+    }
+    shm->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (shm->listen_fd == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, shm->path, sizeof(addr.sun_path)-1);
+    if (bind(shm->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        errorf("bind: %s, dev=%s, path=%s", strerror(errno), dev->name, shm->path);
+        close(shm->listen_fd);
+        shm->listen_fd = -1;
+        return -1;
+    }
+    if (listen(shm->listen_fd, 1) == -1) {
+        errorf("listen: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    shm->side = 0;
+    return 0;
+}
+
+static int
+ether_shm_attach(struct network_device *dev, int sock)
+{
+    struct ether_shm *shm;
+    struct timeval timeout = {ETHER_SHM_ATTACH_TIMEOUT, 0};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * ETHER_SHM_FDS)];
+    } control;
+    struct msghdr msg = {};
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    struct stat st;
+    int fds[ETHER_SHM_FDS];
+    char byte;
+
+    shm = PRIV(dev);
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    iov.iov_base = &byte;
+    iov.iov_len = sizeof(byte);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(byte)) {
+        errorf("recvmsg: %s, dev=%s, path=%s", strerror(errno), dev->name, shm->path);
+        return -1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        errorf("no fds handed over, dev=%s, path=%s", dev->name, shm->path);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    shm->mem_fd = fds[0];
+    shm->efds[0] = fds[1];
+    shm->efds[1] = fds[2];
+    if (fstat(shm->mem_fd, &st) == -1 || (size_t)st.st_size < sizeof(*shm->region)) {
+        errorf("region too small, dev=%s", dev->name);
+        return -1;
+    }
+    if (ether_shm_map(dev) == -1) {
+        return -1;
+    }
+    if (shm->region->magic != ETHER_SHM_MAGIC || shm->region->version != ETHER_SHM_VERSION ||
+        shm->region->ring_size != ETHER_SHM_RING_SIZE || shm->region->slot_size != ETHER_SHM_SLOT_SIZE) {
+        errorf("incompatible region, dev=%s, version=%u", dev->name, shm->region->version);
+        return -1;
+    }
+    shm->side = 1;
+    return 0;
+}
+
+/* runs in the interrupt thread of the creator once the peer has connected */
+static void
+ether_shm_hand_over(struct network_device *dev)
+{
+    struct ether_shm *shm;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * ETHER_SHM_FDS)];
+    } control = {};
+    struct msghdr msg = {};
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    int fds[ETHER_SHM_FDS];
+    char byte = 0;
+    int sock;
+
+    shm = PRIV(dev);
+    sock = accept4(shm->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            errorf("accept4: %s, dev=%s", strerror(errno), dev->name);
+        }
+        return;
+    }
+    fds[0] = shm->mem_fd;
+    fds[1] = shm->efds[0];
+    fds[2] = shm->efds[1];
+    iov.iov_base = &byte;
+    iov.iov_len = sizeof(byte);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(byte)) {
+        errorf("sendmsg: %s, dev=%s", strerror(errno), dev->name);
+        close(sock);
+        return;
+    }
+    close(sock);
+    /* one peer only, from now on the irq is the RX ring's eventfd */
+    intr_unregister_fd(shm->irq, dev);
+    close(shm->listen_fd);
+    unlink(shm->path);
+    shm->listen_fd = -1;
+    if (intr_register_fd(shm->irq, dev, shm->efds[!shm->side]) == -1) {
+        errorf("intr_register_fd() failure, dev=%s", dev->name);
+        return;
+    }
+    infof("peer attached, dev=%s, path=%s", dev->name, shm->path);
+}
+
+static int
+ether_shm_open(struct network_device *dev)
+{
+    struct ether_shm *shm;
+    struct sockaddr_un addr = {};
+    int sock, ret;
+
+    shm = PRIV(dev);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, shm->path, sizeof(addr.sun_path)-1);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        ret = ether_shm_attach(dev, sock);
+    } else if (errno == ENOENT || errno == ECONNREFUSED) {
+        if (errno == ECONNREFUSED) {
+            /* left behind by a creator that is gone */
+            unlink(shm->path);
+        }
+        ret = ether_shm_create(dev);
+    } else {
+        errorf("connect: %s, dev=%s, path=%s", strerror(errno), dev->name, shm->path);
+        ret = -1;
+    }
+    close(sock);
+    if (ret == -1) {
+        ether_shm_cleanup(dev);
+        return -1;
+    }
+    /* the creator watches for its peer first, see ether_shm_hand_over() */
+    if (intr_register_fd(shm->irq, dev, shm->listen_fd != -1 ? shm->listen_fd : shm->efds[!shm->side]) == -1) {
+        errorf("intr_register_fd() failure, dev=%s", dev->name);
+        ether_shm_cleanup(dev);
+        return -1;
+    }
+    infof("dev=%s, path=%s, side=%s", dev->name, shm->path, shm->side ? "attached" : "created");
+    return 0;
+}
+
+static int
+ether_shm_close(struct network_device *dev)
+{
+    struct ether_shm *shm;
+
+    shm = PRIV(dev);
+    intr_unregister_fd(shm->irq, dev);
+    infof("dev=%s, rx=%lu, tx=%lu, tx_drops=%lu, wakeups=%lu",
+        dev->name, shm->rx_frames, shm->tx_frames, shm->tx_drops, shm->wakeups);
+    ether_shm_cleanup(dev);
+    return 0;
+}
+
+/* NOTE: must be called after shm->mutex locked */
+static void
+ether_shm_signal(struct ether_shm *shm)
+{
+    struct ether_shm_ring *ring;
+    uint64_t one = 1;
+
+    ring = ETHER_SHM_TX(shm);
+    shm->tx_unsignalled = 0;
+    /* pairs with the consumer setting the flag before its last look at the head, one of the two sees the other */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED)) {
+        /* the peer is polling and will get to the frames without a syscall */
+        return;
+    }
+    __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+    if (write(shm->efds[shm->side], &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        errorf("write: %s", strerror(errno));
+        return;
+    }
+    shm->wakeups++;
+}
+
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+/* the frame is copied into the next slot of the TX ring, the peer is woken up per batch */
+static ssize_t
+ether_shm_write(struct network_device *dev, struct pktbuf *pb, const struct iovec *iov, int iovcnt)
+{
+    struct ether_shm *shm;
+    struct ether_shm_ring *ring;
+    struct ether_shm_slot *slot;
+    uint32_t head;
+    unsigned int batch;
+    size_t len = 0;
+    uint8_t *p;
+    int i;
+
+    shm = PRIV(dev);
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (len > ETHER_SHM_SLOT_SIZE) {
+        errorf("too long, dev=%s, len=%zu", dev->name, len);
+        return -1;
+    }
+    ring = ETHER_SHM_TX(shm);
+    mutex_lock(&shm->mutex);
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ETHER_SHM_RING_SIZE) {
+        shm->tx_drops++;
+        ether_shm_signal(shm);
+        mutex_unlock(&shm->mutex);
+        return -1;
+    }
+    slot = &ring->slots[head & ETHER_SHM_RING_MASK];
+    p = slot->data;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    slot->len = len;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    shm->tx_frames++;
+    shm->tx_unsignalled++;
+    batch = dev->tx_batch ? dev->tx_batch : NETWORK_TX_BATCH_DEFAULT;
+    if (shm->tx_unsignalled >= batch) {
+        ether_shm_signal(shm);
+        mutex_unlock(&shm->mutex);
+        return len;
+    }
+    mutex_unlock(&shm->mutex);
+    network_device_tx_pending(dev);
+    return len;
+}
+
+static int
+ether_shm_flush(struct network_device *dev)
+{
+    mutex_lock(&PRIV(dev)->mutex);
+    if (PRIV(dev)->tx_unsignalled) {
+        ether_shm_signal(PRIV(dev));
+    }
+    mutex_unlock(&PRIV(dev)->mutex);
+    return 0;
+}
+
+int
+ether_shm_transmit(struct network_device *dev, uint16_t type, struct pktbuf *pb, const void *dst)
+{
+    return ether_transmit_helper(dev, type, pb, dst, ether_shm_write);
+}
+
+static ssize_t
+ether_shm_read(struct network_device *dev, struct pktbuf *pb)
+{
+    struct ether_shm_ring *ring;
+    struct ether_shm_slot *slot;
+    uint32_t tail;
+    size_t len;
+
+    ring = ETHER_SHM_RX(PRIV(dev));
+    tail = ring->tail;
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+        /* drained */
+        return 0;
+    }
+    slot = &ring->slots[tail & ETHER_SHM_RING_MASK];
+    /* the length comes from the other process, never trust it beyond the buffer */
+    len = MIN(slot->len, pktbuf_tailroom(pb));
+    memcpy(pktbuf_data(pb), slot->data, len);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    if (!len) {
+        errorf("empty frame, dev=%s", dev->name);
+        return -1;
+    }
+    return len;
+}
+
+static int
+ether_shm_isr(unsigned int irq, void *id)
+{
+    struct network_device *dev = (struct network_device *)id;
+
+    if (PRIV(dev)->listen_fd != -1) {
+        ether_shm_hand_over(dev);
+        return 0;
+    }
+    /* mask the eventfd until ether_shm_poll() has drained the RX ring */
+    intr_disable_irq(irq, dev);
+    network_device_schedule_poll(dev);
+    return 0;
+}
+
+static int
+ether_shm_poll(struct network_device *dev, int budget)
+{
+    struct ether_shm *shm;
+    struct ether_shm_ring *ring;
+    uint64_t count;
+    int num;
+
+    shm = PRIV(dev);
+    ring = ETHER_SHM_RX(shm);
+    /* just consume the wakeup, the ring itself tells what is there */
+    read(shm->efds[!shm->side], &count, sizeof(count));
+    num = ether_poll_batch_helper(dev, ether_shm_read, budget);
+    shm->rx_frames += num;
+    if (num < budget) {
+        __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail) {
+            /* produced before the peer could see the flag, keep polling instead of waiting for a wakeup */
+            __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+            return budget;
+        }
+        intr_enable_irq(shm->irq, dev);
+    }
+    return num;
+}
+
+static struct network_device_operations ether_shm_ops = {
+    .open = ether_shm_open,
+    .close = ether_shm_close,
+    .transmit = ether_shm_transmit,
+    .poll = ether_shm_poll,
+    .flush = ether_shm_flush,
+};
+
+struct network_device *
+ether_shm_init(const char *path, const char *addr)
+{
+    struct network_device *dev;
+    struct ether_shm *shm;
+    pid_t pid;
+
+    if (strlen(path) >= sizeof(shm->path)) {
+        errorf("path too long, path=%s", path);
+        return NULL;
+    }
+    dev = network_device_allocate(ether_setup_helper);
+    if (!dev) {
+        errorf("network_device_alloc() failure");
+        return NULL;
+    }
+    if (addr) {
+        if (ether_addr_pton(addr, dev->address) == -1) {
+            errorf("invalid address, addr=%s", addr);
+            return NULL;
+        }
+    } else {
+        /* no kernel interface to take an address from, make up a locally administered one */
+        pid = getpid();
+        dev->address[0] = 0x02;
+        dev->address[2] = (pid >> 24) & 0xff;
+        dev->address[3] = (pid >> 16) & 0xff;
+        dev->address[4] = (pid >> 8) & 0xff;
+        dev->address[5] = pid & 0xff;
+    }
+    dev->ops = &ether_shm_ops;
+    shm = memory_alloc(sizeof(*shm));
+    if (!shm) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    strncpy(shm->path, path, sizeof(shm->path)-1);
+    shm->listen_fd = -1;
+    shm->mem_fd = -1;
+    shm->efds[0] = shm->efds[1] = -1;
+    shm->irq = ETHER_SHM_IRQ;
+    mutex_init(&shm->mutex);
+    dev->priv = shm;
+    if (network_device_register(dev) == -1) {
+        errorf("network_device_register() failure");
+        memory_free(shm);
+        return NULL;
+    }
+    intr_request_irq(shm->irq, ether_shm_isr, NETWORK_IRQ_SHARED, dev->name, dev);
+    debugf("ethernet device initialized, dev=%s", dev->name);
+    return dev;
+}
@@ -1,40 +1,96 @@
 #include <pthread.h>
 #include <time.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "handler.h"
 
+/*
+ * Every wakeup advances ctx->seq. A sleeper samples seq while still holding
+ * the caller's mutex and parks until it changes, so a wakeup issued after the
+ * caller checked its condition (under the same mutex) is never lost.
+ */
+
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static int
+futex_wait(uint32_t *uaddr, uint32_t val, const struct timespec *abstime)
+{
+    /* FUTEX_WAIT_BITSET takes an absolute deadline, unlike FUTEX_WAIT */
+    return syscall(SYS_futex, uaddr, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME,
+        val, abstime, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+static int
+futex_wake(uint32_t *uaddr, int num)
+{
+    return syscall(SYS_futex, uaddr, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, num, NULL, NULL, 0);
+}
+
 int
 sched_ctx_init(struct sched_ctx *ctx)
 {
-    pthread_cond_init(&ctx->cond, NULL);
+    ctx->seq = 0;
     ctx->interrupted = 0;
     ctx->wc = 0;
+    ctx->spin = 0;
     return 0;
 }
 
+void
+sched_ctx_set_spin(struct sched_ctx *ctx, unsigned int spin)
+{
+    ctx->spin = spin;
+}
+
 int
 sched_ctx_destroy(struct sched_ctx *ctx)
 {
-    return pthread_cond_destroy(&ctx->cond);
+    if (__atomic_load_n(&ctx->wc, __ATOMIC_ACQUIRE)) {
+        return EBUSY;
+    }
+    return 0;
 }
 
 int
 sched_sleep(struct sched_ctx *ctx, mutex_t *mutex, const struct timespec *abstime)
 {
-    int ret;
+    uint32_t seq;
+    unsigned int i;
+    int ret = 0;
 
     if (ctx->interrupted) {
         errno = EINTR;
         return -1;
     }
-    ctx->wc++;
-    if (abstime) {
-        ret = pthread_cond_timedwait(&ctx->cond, mutex, abstime);
-    } else {
-        ret = pthread_cond_wait(&ctx->cond, mutex);
+    seq = __atomic_load_n(&ctx->seq, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&ctx->wc, 1, __ATOMIC_ACQ_REL);
+    mutex_unlock(mutex);
+    for (i = 0; i < ctx->spin; i++) {
+        if (__atomic_load_n(&ctx->seq, __ATOMIC_ACQUIRE) != seq) {
+            break;
+        }
+        cpu_relax();
+    }
+    while (__atomic_load_n(&ctx->seq, __ATOMIC_ACQUIRE) == seq) {
+        if (futex_wait(&ctx->seq, seq, abstime) == -1 && errno == ETIMEDOUT) {
+            ret = ETIMEDOUT;
+            break;
+        }
+        /* EAGAIN (seq already changed) and EINTR are rechecked by the loop */
     }
-    ctx->wc--;
+    mutex_lock(mutex);
+    __atomic_sub_fetch(&ctx->wc, 1, __ATOMIC_ACQ_REL);
     if (ctx->interrupted) {
         if (!ctx->wc) {
             ctx->interrupted = 0;
@@ -48,12 +104,26 @@ sched_sleep(struct sched_ctx *ctx, mutex_t *mutex, const struct timespec *abstim
 int
 sched_wakeup(struct sched_ctx *ctx)
 {
-    return pthread_cond_broadcast(&ctx->cond);
+    __atomic_add_fetch(&ctx->seq, 1, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&ctx->wc, __ATOMIC_ACQUIRE)) {
+        futex_wake(&ctx->seq, 1);
+    }
+    return 0;
+}
+
+int
+sched_wakeup_all(struct sched_ctx *ctx)
+{
+    __atomic_add_fetch(&ctx->seq, 1, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&ctx->wc, __ATOMIC_ACQUIRE)) {
+        futex_wake(&ctx->seq, INT_MAX);
+    }
+    return 0;
 }
 
 int
 sched_interrupt(struct sched_ctx *ctx)
 {
     ctx->interrupted = 1;
-    return pthread_cond_broadcast(&ctx->cond);
-}
\ No newline at end of file
+    return sched_wakeup_all(ctx);
+}
@@ -1,4 +1,4 @@
-#define _GNU_SOURCE /* for F_SETSIG */
+#define _GNU_SOURCE /* for pthread_setaffinity_np, sched_getcpu */
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -6,18 +6,23 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/poll.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 
 #include "handler.h"
 
 #include "util.h"
 #include "net2.h"
 #include "ether.h"
+#include "etheruring.h"
 
 #include "ethertap.h"
 
@@ -25,14 +30,48 @@
 
 #define ETHER_TAP_IRQ (SIGRTMIN+2)
 
+#define ETHER_TAP_QUEUE_BLOCK_MS 100
+
+/* not defined by older kernel headers */
+#ifndef TUN_F_USO4
+#define TUN_F_USO4 0x20
+#define TUN_F_USO6 0x40
+#endif
+#ifndef VIRTIO_NET_HDR_GSO_UDP_L4
+#define VIRTIO_NET_HDR_GSO_UDP_L4 5
+#endif
+
+#define ETHER_TAP_UDP_HDR_SIZE 8
+
+/* one fd of a multi-queue TAP, serviced by its own thread */
+struct ether_tap_queue {
+    struct network_device *dev;
+    unsigned int index;
+    int fd;
+    int running;
+    pthread_t thread;
+    unsigned long frames;
+};
+
 struct ether_tap {
     char name[IFNAMSIZ];
-    int fd;
+    int fd; /* fd of queue 0 */
     unsigned int irq;
+    struct ether_busy_poll busy_poll;
+    unsigned int nqueues;
+    struct ether_tap_queue queues[ETHER_TAP_QUEUES_MAX];
+    int use_uring;
+    struct ether_uring *uring; /* NULL unless the fd is driven through io_uring */
 };
 
 #define PRIV(x) ((struct ether_tap *)x->priv)
 
+/* queue serviced by the calling thread, NULL outside the queue threads */
+static __thread struct ether_tap_queue *current_queue;
+
+static ssize_t ether_tap_read(struct network_device *dev, struct pktbuf *pb);
+static int ether_tap_fixup(struct network_device *dev, struct pktbuf *pb);
+
 static int
 ether_tap_addr(struct network_device *dev) {
     int soc;
@@ -55,41 +94,163 @@ ether_tap_addr(struct network_device *dev) {
     return 0;
 }
 
+/* opens one fd attached to the TAP interface, non-blocking for reads */
 static int
-ether_tap_open(struct network_device *dev)
+ether_tap_open_fd(struct network_device *dev)
 {
     struct ether_tap *tap;
     struct ifreq ifr = {};
+    int fd;
 
     tap = PRIV(dev);
-    tap->fd = open(CLONE_DEVICE, O_RDWR);
-    if (tap->fd == -1) {
+    fd = open(CLONE_DEVICE, O_RDWR);
+    if (fd == -1) {
         errorf("open: %s, dev=%s", strerror(errno), dev->name);
         return -1;
     }
     strncpy(ifr.ifr_name, tap->name, sizeof(ifr.ifr_name)-1);
-    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
-    if (ioctl(tap->fd, TUNSETIFF, &ifr) == -1) {
-        errorf("ioctl(TUNSETIFF): %s, dev=%s", strerror(errno), dev->name);
-        close(tap->fd);
-        return -1;
+    /* every frame is preceded by a virtio-net header carrying the offload state */
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+    if (tap->nqueues > 1) {
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
     }
-    /* Set Asynchronous I/O signal delivery destination */
-    if (fcntl(tap->fd, F_SETOWN, getpid()) == -1) {
-        errorf("fcntl(F_SETOWN): %s, dev=%s", strerror(errno), dev->name);
-        close(tap->fd);
+    if (ioctl(fd, TUNSETIFF, &ifr) == -1) {
+        errorf("ioctl(TUNSETIFF): %s, dev=%s", strerror(errno), dev->name);
+        close(fd);
         return -1;
     }
-    /* Enable Asynchronous I/O */
-    if (fcntl(tap->fd, F_SETFL, O_ASYNC) == -1) {
+    /* reads never block, the fd is drained until EAGAIN */
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
         errorf("fcntl(F_SETFL): %s, dev=%s", strerror(errno), dev->name);
-        close(tap->fd);
+        close(fd);
         return -1;
     }
-    /* Use other signal instead of SIGIO */
-    if (fcntl(tap->fd, F_SETSIG, tap->irq) == -1) {
-        errorf("fcntl(F_SETSIG): %s, dev=%s", strerror(errno), dev->name);
-        close(tap->fd);
+    return fd;
+}
+
+/* negotiates checksum offload, and probes whether the kernel segments UDP super-packets */
+static void
+ether_tap_offload(struct network_device *dev)
+{
+    struct ether_tap *tap;
+
+    tap = PRIV(dev);
+    if (ioctl(tap->fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_USO4 | TUN_F_USO6) == 0) {
+        dev->flags |= NETWORK_DEVICE_FLAG_TX_GSO_UDP;
+    }
+    /* super-packets are only sent, the kernel must not hand any over to us */
+    if (ioctl(tap->fd, TUNSETOFFLOAD, TUN_F_CSUM) == -1) {
+        errorf("ioctl(TUNSETOFFLOAD): %s, dev=%s", strerror(errno), dev->name);
+        dev->flags &= ~NETWORK_DEVICE_FLAG_TX_GSO_UDP;
+        return;
+    }
+    dev->flags |= NETWORK_DEVICE_FLAG_TX_CSUM;
+    infof("offloads, dev=%s, csum=on, gso_udp=%s", dev->name, (dev->flags & NETWORK_DEVICE_FLAG_TX_GSO_UDP) ? "on" : "off");
+}
+
+static void *
+ether_tap_queue_thread(void *arg)
+{
+    struct ether_tap_queue *queue = arg;
+    struct pollfd pfd;
+    cpu_set_t cpus;
+    long ncpus;
+    int ret, num;
+
+    current_queue = queue;
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus > 0) {
+        /* the kernel spreads flows across the queues, each queue stays on one core */
+        CPU_ZERO(&cpus);
+        CPU_SET(queue->index % ncpus, &cpus);
+        ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (ret) {
+            errorf("pthread_setaffinity_np() %s, dev=%s, queue=%u", strerror(ret), queue->dev->name, queue->index);
+        }
+    }
+    pfd.fd = queue->fd;
+    pfd.events = POLLIN;
+    while (__atomic_load_n(&queue->running, __ATOMIC_ACQUIRE)) {
+        ret = poll(&pfd, 1, ETHER_TAP_QUEUE_BLOCK_MS);
+        if (ret == -1 && errno != EINTR) {
+            errorf("poll: %s, dev=%s, queue=%u", strerror(errno), queue->dev->name, queue->index);
+            break;
+        }
+        if (ret <= 0) {
+            continue;
+        }
+        do {
+            num = ether_poll_batch_helper(queue->dev, ether_tap_read, PKTBUF_VEC_MAX);
+            queue->frames += num;
+            /* a full batch may also be read errors only, e.g. the fd being closed under the thread */
+        } while (num == PKTBUF_VEC_MAX && __atomic_load_n(&queue->running, __ATOMIC_ACQUIRE));
+    }
+    return NULL;
+}
+
+static void
+ether_tap_close_queues(struct network_device *dev, unsigned int num)
+{
+    struct ether_tap *tap;
+    struct ether_tap_queue *queue;
+    unsigned int i;
+
+    tap = PRIV(dev);
+    for (i = 0; i < num; i++) {
+        queue = &tap->queues[i];
+        if (queue->running) {
+            __atomic_store_n(&queue->running, 0, __ATOMIC_RELEASE);
+            pthread_join(queue->thread, NULL);
+            infof("dev=%s, queue=%u, frames=%lu", dev->name, i, queue->frames);
+        }
+        close(queue->fd);
+        queue->fd = -1;
+    }
+}
+
+static int
+ether_tap_open_queues(struct network_device *dev)
+{
+    struct ether_tap *tap;
+    struct ether_tap_queue *queue;
+    unsigned int i;
+    int err;
+
+    tap = PRIV(dev);
+    tap->queues[0].fd = tap->fd;
+    for (i = 1; i < tap->nqueues; i++) {
+        tap->queues[i].fd = ether_tap_open_fd(dev);
+        if (tap->queues[i].fd == -1) {
+            ether_tap_close_queues(dev, i);
+            return -1;
+        }
+    }
+    for (i = 0; i < tap->nqueues; i++) {
+        queue = &tap->queues[i];
+        queue->dev = dev;
+        queue->index = i;
+        queue->frames = 0;
+        queue->running = 1;
+        err = pthread_create(&queue->thread, NULL, ether_tap_queue_thread, queue);
+        if (err) {
+            errorf("pthread_create() %s, dev=%s, queue=%u", strerror(err), dev->name, i);
+            queue->running = 0;
+            ether_tap_close_queues(dev, tap->nqueues);
+            return -1;
+        }
+    }
+    infof("multi-queue, dev=%s, queues=%u", dev->name, tap->nqueues);
+    return 0;
+}
+
+static int
+ether_tap_open(struct network_device *dev)
+{
+    struct ether_tap *tap;
+
+    tap = PRIV(dev);
+    tap->fd = ether_tap_open_fd(dev);
+    if (tap->fd == -1) {
         return -1;
     }
     if (memcmp(dev->address, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
@@ -99,81 +260,236 @@ ether_tap_open(struct network_device *dev)
             return -1;
         }
     }
+    ether_tap_offload(dev);
+    if (tap->nqueues > 1) {
+        /* every queue is serviced by its own thread, busy-poll mode does not apply */
+        return ether_tap_open_queues(dev);
+    }
+    if (tap->use_uring && !tap->busy_poll.spin_us) {
+        /* io_uring hands back -EAGAIN on a non-blocking fd instead of waiting for a frame */
+        fcntl(tap->fd, F_SETFL, 0);
+        tap->uring = ether_uring_open(dev, tap->fd, tap->irq, ether_tap_fixup);
+        if (tap->uring) {
+            return 0;
+        }
+        infof("falling back to read()/write(), dev=%s", dev->name);
+        fcntl(tap->fd, F_SETFL, O_NONBLOCK);
+    }
+    if (tap->busy_poll.spin_us) {
+        /* a dedicated thread spins on the fd instead of the interrupt thread */
+        if (ether_busy_poll_start(&tap->busy_poll, dev, tap->fd, ether_tap_read) == -1) {
+            errorf("ether_busy_poll_start() failure, dev=%s", dev->name);
+            close(tap->fd);
+            return -1;
+        }
+        return 0;
+    }
+    if (intr_register_fd(tap->irq, dev, tap->fd) == -1) {
+        errorf("intr_register_fd() failure, dev=%s", dev->name);
+        close(tap->fd);
+        return -1;
+    }
     return 0;
 };
 
 static int
 ether_tap_close(struct network_device *dev)
 {
+    if (PRIV(dev)->nqueues > 1) {
+        ether_tap_close_queues(dev, PRIV(dev)->nqueues);
+        return 0;
+    }
+    if (PRIV(dev)->uring) {
+        ether_uring_close(PRIV(dev)->uring);
+        PRIV(dev)->uring = NULL;
+    } else if (PRIV(dev)->busy_poll.spin_us) {
+        ether_busy_poll_stop(&PRIV(dev)->busy_poll);
+    } else {
+        intr_unregister_fd(PRIV(dev)->irq, dev);
+    }
     close(PRIV(dev)->fd);
     return 0;
 }
 
+/* selects the fd of the queue the calling thread should use */
+static int
+ether_tap_fd(struct network_device *dev)
+{
+    struct ether_tap *tap;
+    int cpu;
+
+    tap = PRIV(dev);
+    if (current_queue && current_queue->dev == dev) {
+        return current_queue->fd;
+    }
+    if (tap->nqueues > 1) {
+        /* other threads transmit on the queue of the core they run on */
+        cpu = sched_getcpu();
+        if (cpu >= 0) {
+            return tap->queues[cpu % tap->nqueues].fd;
+        }
+    }
+    return tap->fd;
+}
+
 static ssize_t
-ether_tap_write(struct network_device *dev, const uint8_t *frame, size_t flen)
+ether_tap_write(struct network_device *dev, struct pktbuf *pb, const struct iovec *iov, int iovcnt)
 {
-    return write(PRIV(dev)->fd, frame, flen);
+    struct virtio_net_hdr vnet = {};
+    struct iovec vec[PKTBUF_FRAG_MAX + 3];
+    ssize_t len;
+    int i;
+
+    /* the frame starts at the head of the buffer, the offsets are relative to it */
+    if (pb->flags & PKTBUF_FLAG_CSUM_PARTIAL) {
+        vnet.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vnet.csum_start = pb->csum_start - pb->head;
+        vnet.csum_offset = pb->csum_offset;
+        if (pb->gso_size) {
+            vnet.gso_type = VIRTIO_NET_HDR_GSO_UDP_L4;
+            vnet.gso_size = pb->gso_size;
+            vnet.hdr_len = vnet.csum_start + ETHER_TAP_UDP_HDR_SIZE;
+        }
+    }
+    vec[0].iov_base = &vnet;
+    vec[0].iov_len = sizeof(vnet);
+    for (i = 0; i < iovcnt; i++) {
+        vec[i + 1] = iov[i];
+    }
+    if (PRIV(dev)->uring) {
+        if (!pb->gso_size) {
+            len = ether_uring_write(PRIV(dev)->uring, vec, iovcnt + 1);
+            return len == -1 ? -1 : len - (ssize_t)sizeof(vnet);
+        }
+        /* super-packets do not fit a transmit buffer, they are written behind the submitted frames */
+        ether_uring_flush(PRIV(dev)->uring);
+    }
+    /* without io_uring the fd takes one frame per syscall anyway, queueing would only add a copy and latency */
+    len = writev(ether_tap_fd(dev), vec, iovcnt + 1);
+    if (len == -1) {
+        return -1;
+    }
+    return len - sizeof(vnet);
+}
+
+static int
+ether_tap_flush(struct network_device *dev)
+{
+    if (PRIV(dev)->uring) {
+        ether_uring_flush(PRIV(dev)->uring);
+    }
+    return 0;
 }
 
 int
-ether_tap_transmit(struct network_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst)
+ether_tap_transmit(struct network_device *dev, uint16_t type, struct pktbuf *pb, const void *dst)
 {
-    return ether_transmit_helper(dev, type, buf, len, dst, ether_tap_write);
+    return ether_transmit_helper(dev, type, pb, dst, ether_tap_write);
 }
 
 static ssize_t
-ether_tap_read(struct network_device *dev, uint8_t *buf, size_t size)
+ether_tap_read(struct network_device *dev, struct pktbuf *pb)
 {
+    struct virtio_net_hdr vnet;
+    struct iovec iov[2];
     ssize_t len;
 
-    len = read(PRIV(dev)->fd, buf, size);
+    iov[0].iov_base = &vnet;
+    iov[0].iov_len = sizeof(vnet);
+    iov[1].iov_base = pktbuf_data(pb);
+    iov[1].iov_len = pktbuf_tailroom(pb);
+    len = readv(ether_tap_fd(dev), iov, 2);
     if (len <= 0) {
+        if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* drained */
+            return 0;
+        }
         if (len == -1 && errno != EINTR) {
             errorf("read: %s, dev=%s", strerror(errno), dev->name);
         }
         return -1;
     }
-    return len;
+    if ((size_t)len < sizeof(vnet)) {
+        errorf("too short, len=%zd, dev=%s", len, dev->name);
+        return -1;
+    }
+    if (vnet.flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+        /* verified by the kernel, or sent by the local host leaving the checksum to us */
+        pb->flags |= PKTBUF_FLAG_CSUM_VALID;
+    }
+    return len - sizeof(vnet);
+}
+
+/* strips the virtio-net header from a frame read through io_uring */
+static int
+ether_tap_fixup(struct network_device *dev, struct pktbuf *pb)
+{
+    struct virtio_net_hdr *vnet;
+
+    if (pktbuf_len(pb) < sizeof(*vnet)) {
+        errorf("too short, len=%zu, dev=%s", pktbuf_len(pb), dev->name);
+        return -1;
+    }
+    vnet = (struct virtio_net_hdr *)pktbuf_data(pb);
+    if (vnet->flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+        pb->flags |= PKTBUF_FLAG_CSUM_VALID;
+    }
+    pktbuf_pull(pb, sizeof(*vnet));
+    return 0;
 }
 
 static int
 ether_tap_isr(unsigned int irq, void *id)
 {
     struct network_device *dev = (struct network_device *)id;
-    struct pollfd pfd;
-    int ret;
 
-    pfd.fd = PRIV(dev)->fd;
-    pfd.events = POLLIN;
-    while (1) {
-        ret = poll(&pfd, 1, 0);
-        if (ret == -1) {
-            if (errno == EINTR) {
-                continue;
-            }
-            errorf("poll: %s, dev=%s", strerror(errno), dev->name);
-            return -1;
-        }
-        if (ret == 0) {
-            break;
-        }
-        ether_poll_helper(dev, ether_tap_read);
-    }
+    /* mask the fd until ether_tap_poll() has drained it */
+    intr_disable_irq(irq, dev);
+    network_device_schedule_poll(dev);
     return 0;
 }
 
+static int
+ether_tap_poll(struct network_device *dev, int budget)
+{
+    int num;
+
+    if (PRIV(dev)->uring) {
+        num = ether_uring_poll(PRIV(dev)->uring, budget);
+    } else {
+        num = ether_poll_batch_helper(dev, ether_tap_read, budget);
+    }
+    if (num < budget) {
+        intr_enable_irq(PRIV(dev)->irq, dev);
+    }
+    return num;
+}
+
 static struct network_device_operations ether_tap_ops = {
     .open = ether_tap_open,
     .close = ether_tap_close,
     .transmit = ether_tap_transmit,
+    .poll = ether_tap_poll,
+    .flush = ether_tap_flush,
 };
 
 struct network_device *
 ether_tap_init(const char *name, const char *addr)
+{
+    return ether_tap_init_mq(name, addr, 1);
+}
+
+struct network_device *
+ether_tap_init_mq(const char *name, const char *addr, unsigned int queues)
 {
     struct network_device *dev;
     struct ether_tap *tap;
 
+    if (queues < 1 || queues > ETHER_TAP_QUEUES_MAX) {
+        errorf("invalid number of queues, queues=%u", queues);
+        return NULL;
+    }
+
     dev = network_device_allocate(ether_setup_helper);
     if (!dev) {
         errorf("net_device_alloc() failure");
@@ -194,6 +510,7 @@ ether_tap_init(const char *name, const char *addr)
     strncpy(tap->name, name, sizeof(tap->name)-1);
     tap->fd = -1;
     tap->irq = ETHER_TAP_IRQ;
+    tap->nqueues = queues;
     dev->priv = tap;
     if (network_device_register(dev) == -1) {
         errorf("net_device_register() failure");
@@ -203,4 +520,26 @@ ether_tap_init(const char *name, const char *addr)
     intr_request_irq(tap->irq, ether_tap_isr, NETWORK_IRQ_SHARED, dev->name, dev);
     debugf("ethernet device initialized, dev=%s", dev->name);
     return dev;
-}
\ No newline at end of file
+}
+
+int
+ether_tap_set_busy_poll(struct network_device *dev, unsigned int spin_us)
+{
+    if (NETWORK_DEVICE_IS_UP(dev)) {
+        errorf("already opened, dev=%s", dev->name);
+        return -1;
+    }
+    PRIV(dev)->busy_poll.spin_us = spin_us;
+    return 0;
+}
+
+int
+ether_tap_set_io_uring(struct network_device *dev, int enable)
+{
+    if (NETWORK_DEVICE_IS_UP(dev)) {
+        errorf("already opened, dev=%s", dev->name);
+        return -1;
+    }
+    PRIV(dev)->use_uring = enable;
+    return 0;
+}
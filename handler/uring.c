@@ -0,0 +1,494 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "handler.h"
+
+#include "util.h"
+#include "net2.h"
+#include "ether.h"
+
+#include "etheruring.h"
+
+/* upper half of the user data of an SQE, the lower half is the buffer index */
+#define ETHER_URING_OP_READ 1
+#define ETHER_URING_OP_WRITE 2
+
+struct ether_uring;
+
+/* read completion reaped but not handed to the stack yet */
+struct ether_uring_done {
+    unsigned int index;
+    int res;
+};
+
+/* argument of a receive buffer lent up the stack */
+struct ether_uring_buf {
+    struct ether_uring *u;
+    unsigned int index;
+};
+
+struct ether_uring {
+    struct network_device *dev;
+    int fd;
+    unsigned int irq;
+    int (*fixup)(struct network_device *dev, struct pktbuf *pb);
+    int ring_fd;
+    int event_fd;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map; /* same as sq_map if the kernel maps both rings at once */
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_entries;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    uint8_t *bufs; /* receive buffers followed by transmit buffers, registered as one */
+    size_t bufs_size;
+    mutex_t mutex; /* protects both queues, the free buffers and the reaped reads */
+    unsigned int unsubmitted;
+    unsigned int rx_free[ETHER_URING_READS]; /* receive buffers to re-arm */
+    unsigned int nrx_free;
+    unsigned int tx_free[ETHER_URING_WRITES];
+    unsigned int ntx_free;
+    struct ether_uring_done done[ETHER_URING_READS];
+    unsigned int ndone;
+    unsigned int armed; /* reads in flight, only touched by the poll */
+    unsigned int lent; /* receive buffers currently referenced up the stack */
+    struct ether_uring_buf rx_bufs[ETHER_URING_READS];
+    unsigned long reads;
+    unsigned long lent_total;
+    unsigned long copied;
+    unsigned long writes;
+    unsigned long write_errors;
+    unsigned long tx_drops;
+};
+
+static int
+ether_uring_setup(struct ether_uring *u)
+{
+    struct io_uring_params p = {};
+    struct iovec iov;
+
+    /* no liburing, the ring is set up and driven with the raw system calls */
+    u->ring_fd = syscall(__NR_io_uring_setup, ETHER_URING_ENTRIES, &p);
+    if (u->ring_fd == -1) {
+        errorf("io_uring_setup: %s, dev=%s", strerror(errno), u->dev->name);
+        return -1;
+    }
+    u->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->sq_map_size = MAX(u->sq_map_size, u->cq_map_size);
+    }
+    u->sq_map = mmap(NULL, u->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), u->dev->name);
+        u->sq_map = NULL;
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_map = u->sq_map;
+    } else {
+        u->cq_map = mmap(NULL, u->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+        if (u->cq_map == MAP_FAILED) {
+            errorf("mmap: %s, dev=%s", strerror(errno), u->dev->name);
+            u->cq_map = NULL;
+            return -1;
+        }
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), u->dev->name);
+        u->sqes = NULL;
+        return -1;
+    }
+    u->sq_head = (unsigned int *)((uint8_t *)u->sq_map + p.sq_off.head);
+    u->sq_tail = (unsigned int *)((uint8_t *)u->sq_map + p.sq_off.tail);
+    u->sq_mask = (unsigned int *)((uint8_t *)u->sq_map + p.sq_off.ring_mask);
+    u->sq_entries = (unsigned int *)((uint8_t *)u->sq_map + p.sq_off.ring_entries);
+    u->sq_array = (unsigned int *)((uint8_t *)u->sq_map + p.sq_off.array);
+    u->cq_head = (unsigned int *)((uint8_t *)u->cq_map + p.cq_off.head);
+    u->cq_tail = (unsigned int *)((uint8_t *)u->cq_map + p.cq_off.tail);
+    u->cq_mask = (unsigned int *)((uint8_t *)u->cq_map + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((uint8_t *)u->cq_map + p.cq_off.cqes);
+    /* registered once, so the kernel does not pin the pages per operation */
+    u->bufs_size = (size_t)ETHER_URING_BUF_SIZE * (ETHER_URING_READS + ETHER_URING_WRITES);
+    u->bufs = mmap(NULL, u->bufs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (u->bufs == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), u->dev->name);
+        u->bufs = NULL;
+        return -1;
+    }
+    iov.iov_base = u->bufs;
+    iov.iov_len = u->bufs_size;
+    if (syscall(__NR_io_uring_register, u->ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == -1) {
+        errorf("io_uring_register(IORING_REGISTER_BUFFERS): %s, dev=%s", strerror(errno), u->dev->name);
+        return -1;
+    }
+    u->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (u->event_fd == -1) {
+        errorf("eventfd: %s, dev=%s", strerror(errno), u->dev->name);
+        return -1;
+    }
+    if (syscall(__NR_io_uring_register, u->ring_fd, IORING_REGISTER_EVENTFD, &u->event_fd, 1) == -1) {
+        errorf("io_uring_register(IORING_REGISTER_EVENTFD): %s, dev=%s", strerror(errno), u->dev->name);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+ether_uring_destroy(struct ether_uring *u)
+{
+    /* closing the ring cancels the reads still in flight */
+    if (u->ring_fd != -1) {
+        close(u->ring_fd);
+    }
+    if (u->event_fd != -1) {
+        close(u->event_fd);
+    }
+    if (u->sqes) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->cq_map && u->cq_map != u->sq_map) {
+        munmap(u->cq_map, u->cq_map_size);
+    }
+    if (u->sq_map) {
+        munmap(u->sq_map, u->sq_map_size);
+    }
+    if (u->bufs) {
+        if (__atomic_load_n(&u->lent, __ATOMIC_ACQUIRE)) {
+            /* buffers are still referenced somewhere, they must outlive them */
+            errorf("buffers still lent, left mapped, dev=%s, bufs=%u", u->dev->name, u->lent);
+            return;
+        }
+        munmap(u->bufs, u->bufs_size);
+    }
+    memory_free(u);
+}
+
+/* NOTE: must be called after u->mutex locked */
+static struct io_uring_sqe *
+ether_uring_sqe(struct ether_uring *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail, index;
+
+    tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == *u->sq_entries) {
+        return NULL;
+    }
+    index = tail & *u->sq_mask;
+    sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    u->unsubmitted++;
+    return sqe;
+}
+
+/* NOTE: must be called after u->mutex locked */
+static void
+ether_uring_commit(struct ether_uring *u)
+{
+    /* publishes the SQE filled in since ether_uring_sqe() */
+    __atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+/* NOTE: must be called after u->mutex locked */
+static void
+ether_uring_submit(struct ether_uring *u)
+{
+    int ret;
+
+    while (u->unsubmitted) {
+        ret = syscall(__NR_io_uring_enter, u->ring_fd, u->unsubmitted, 0, 0, NULL, 0);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* left queued, the next submission retries them */
+            errorf("io_uring_enter: %s, dev=%s", strerror(errno), u->dev->name);
+            return;
+        }
+        u->unsubmitted -= ret;
+    }
+}
+
+/* NOTE: must be called after u->mutex locked */
+static void
+ether_uring_arm(struct ether_uring *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int index;
+
+    while (u->nrx_free) {
+        sqe = ether_uring_sqe(u);
+        if (!sqe) {
+            break;
+        }
+        index = u->rx_free[--u->nrx_free];
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = u->fd;
+        sqe->addr = (uintptr_t)(u->bufs + (size_t)ETHER_URING_BUF_SIZE * index);
+        sqe->len = ETHER_URING_BUF_SIZE;
+        sqe->buf_index = 0;
+        sqe->user_data = ((uint64_t)ETHER_URING_OP_READ << 32) | index;
+        ether_uring_commit(u);
+        u->armed++;
+    }
+}
+
+static void
+ether_uring_rearm(struct ether_uring *u, unsigned int index)
+{
+    mutex_lock(&u->mutex);
+    u->rx_free[u->nrx_free++] = index;
+    mutex_unlock(&u->mutex);
+}
+
+static void
+ether_uring_buf_put(void *arg)
+{
+    struct ether_uring_buf *buf = arg;
+
+    __atomic_sub_fetch(&buf->u->lent, 1, __ATOMIC_RELAXED);
+    /* re-armed by the next poll */
+    ether_uring_rearm(buf->u, buf->index);
+}
+
+struct ether_uring *
+ether_uring_open(struct network_device *dev, int fd, unsigned int irq, int (*fixup)(struct network_device *dev, struct pktbuf *pb))
+{
+    struct ether_uring *u;
+    unsigned int i;
+
+    u = memory_alloc(sizeof(*u));
+    if (!u) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    u->dev = dev;
+    u->fd = fd;
+    u->irq = irq;
+    u->fixup = fixup;
+    u->ring_fd = -1;
+    u->event_fd = -1;
+    mutex_init(&u->mutex);
+    if (ether_uring_setup(u) == -1) {
+        ether_uring_destroy(u);
+        return NULL;
+    }
+    for (i = 0; i < ETHER_URING_READS; i++) {
+        u->rx_bufs[i].u = u;
+        u->rx_bufs[i].index = i;
+        u->rx_free[u->nrx_free++] = i;
+    }
+    for (i = 0; i < ETHER_URING_WRITES; i++) {
+        u->tx_free[u->ntx_free++] = ETHER_URING_READS + i;
+    }
+    mutex_lock(&u->mutex);
+    ether_uring_arm(u);
+    ether_uring_submit(u);
+    mutex_unlock(&u->mutex);
+    if (intr_register_fd(irq, dev, u->event_fd) == -1) {
+        errorf("intr_register_fd() failure, dev=%s", dev->name);
+        ether_uring_destroy(u);
+        return NULL;
+    }
+    infof("io_uring, dev=%s, reads=%u, writes=%u", dev->name, ETHER_URING_READS, ETHER_URING_WRITES);
+    return u;
+}
+
+void
+ether_uring_close(struct ether_uring *u)
+{
+    intr_unregister_fd(u->irq, u->dev);
+    infof("dev=%s, reads=%lu, lent=%lu, copied=%lu, writes=%lu, write_errors=%lu, tx_drops=%lu",
+        u->dev->name, u->reads, u->lent_total, u->copied, u->writes, u->write_errors, u->tx_drops);
+    ether_uring_destroy(u);
+}
+
+/* lends a filled buffer to the stack in place, or copies it once half of the reads are waiting to be re-armed */
+static struct pktbuf *
+ether_uring_frame(struct ether_uring *u, unsigned int index, size_t len)
+{
+    struct pktbuf *pb;
+    uint8_t *data;
+
+    data = u->bufs + (size_t)ETHER_URING_BUF_SIZE * index;
+    if (u->armed > ETHER_URING_READS / 2) {
+        pb = pktbuf_alloc_ext(data, len, ether_uring_buf_put, &u->rx_bufs[index]);
+        if (pb) {
+            __atomic_add_fetch(&u->lent, 1, __ATOMIC_RELAXED);
+            u->lent_total++;
+            return pb;
+        }
+    }
+    pb = pktbuf_alloc(ETHER_URING_BUF_SIZE);
+    if (pb) {
+        memcpy(pktbuf_append(pb, len), data, len);
+        u->copied++;
+    } else {
+        errorf("pktbuf_alloc() failure");
+    }
+    ether_uring_rearm(u, index);
+    return pb;
+}
+
+/* NOTE: must be called after u->mutex locked */
+static void
+ether_uring_reap(struct ether_uring *u)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head, tail, index;
+
+    /* write buffers are free again right away, reads are left for the poll */
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        cqe = &u->cqes[head & *u->cq_mask];
+        index = cqe->user_data & 0xffffffff;
+        if (cqe->user_data >> 32 == ETHER_URING_OP_WRITE) {
+            if (cqe->res < 0) {
+                u->write_errors++;
+            }
+            u->tx_free[u->ntx_free++] = index;
+        } else {
+            u->done[u->ndone].index = index;
+            u->done[u->ndone].res = cqe->res;
+            u->ndone++;
+        }
+        head++;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+int
+ether_uring_poll(struct ether_uring *u, int budget)
+{
+    struct ether_uring_done done[ETHER_URING_READS];
+    struct pktbuf *pbs[ETHER_URING_READS], *pb;
+    unsigned int i, num = 0, ndone;
+    uint64_t count;
+
+    /* reset before reaping, completions posted from now on signal the eventfd again */
+    if (read(u->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        errorf("read: %s, dev=%s", strerror(errno), u->dev->name);
+    }
+    mutex_lock(&u->mutex);
+    ether_uring_reap(u);
+    ndone = MIN(u->ndone, (unsigned int)budget);
+    memcpy(done, u->done, sizeof(*done) * ndone);
+    u->ndone -= ndone;
+    memmove(u->done, u->done + ndone, sizeof(*done) * u->ndone);
+    mutex_unlock(&u->mutex);
+    u->armed -= ndone;
+    for (i = 0; i < ndone; i++) {
+        if (done[i].res <= 0) {
+            if (done[i].res != -EAGAIN && done[i].res != -EINTR) {
+                errorf("read: %s, dev=%s", strerror(-done[i].res), u->dev->name);
+            }
+            ether_uring_rearm(u, done[i].index);
+            continue;
+        }
+        pb = ether_uring_frame(u, done[i].index, done[i].res);
+        if (!pb) {
+            continue;
+        }
+        if (u->fixup && u->fixup(u->dev, pb) == -1) {
+            pktbuf_release(pb);
+            continue;
+        }
+        pbs[num++] = pb;
+    }
+    if (num) {
+        ether_input_batch_helper(u->dev, pbs, num);
+    }
+    u->reads += ndone;
+    /* one submission re-arms the reads and carries any writes queued meanwhile */
+    mutex_lock(&u->mutex);
+    ether_uring_arm(u);
+    ether_uring_submit(u);
+    mutex_unlock(&u->mutex);
+    return ndone;
+}
+
+ssize_t
+ether_uring_write(struct ether_uring *u, const struct iovec *iov, int iovcnt)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int index, batch;
+    size_t len = 0;
+    uint8_t *p;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (len > ETHER_URING_BUF_SIZE) {
+        errorf("too long, dev=%s, len=%zu", u->dev->name, len);
+        return -1;
+    }
+    mutex_lock(&u->mutex);
+    if (!u->ntx_free) {
+        /* completions are normally reaped by the poll, a burst of writes reaps its own */
+        ether_uring_submit(u);
+        ether_uring_reap(u);
+    }
+    if (!u->ntx_free || !(sqe = ether_uring_sqe(u))) {
+        /* every buffer is still in flight */
+        u->tx_drops++;
+        ether_uring_submit(u);
+        mutex_unlock(&u->mutex);
+        return -1;
+    }
+    index = u->tx_free[--u->ntx_free];
+    p = u->bufs + (size_t)ETHER_URING_BUF_SIZE * index;
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = u->fd;
+    sqe->addr = (uintptr_t)p;
+    sqe->len = len;
+    sqe->buf_index = 0;
+    sqe->user_data = ((uint64_t)ETHER_URING_OP_WRITE << 32) | index;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    ether_uring_commit(u);
+    u->writes++;
+    batch = u->dev->tx_batch ? u->dev->tx_batch : NETWORK_TX_BATCH_DEFAULT;
+    if (u->unsubmitted >= batch) {
+        ether_uring_submit(u);
+        mutex_unlock(&u->mutex);
+        return len;
+    }
+    mutex_unlock(&u->mutex);
+    network_device_tx_pending(u->dev);
+    return len;
+}
+
+void
+ether_uring_flush(struct ether_uring *u)
+{
+    mutex_lock(&u->mutex);
+    ether_uring_submit(u);
+    mutex_unlock(&u->mutex);
+}
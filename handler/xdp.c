@@ -0,0 +1,663 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/if.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+
+#include "handler.h"
+
+#include "util.h"
+#include "net2.h"
+#include "ether.h"
+
+#include "etherxdp.h"
+
+#define ETHER_XDP_IRQ (SIGRTMIN+4)
+
+/* slots of the XSKMAP, i.e. the highest queue index a socket can be bound to, plus one */
+#define ETHER_XDP_QUEUES_MAX 64
+
+#define ETHER_XDP_RING_MASK (ETHER_XDP_RING_SIZE - 1)
+
+/* wakeups in a row while the kernel asks to be called again, in copy mode it sends at most 32 frames per call */
+#define ETHER_XDP_KICK_MAX (ETHER_XDP_RING_SIZE / 32 + 1)
+
+struct ether_xdp;
+
+/* argument of a frame lent up the stack */
+struct ether_xdp_frame {
+    struct ether_xdp *xdp;
+    uint64_t addr;
+};
+
+/* ring shared with the kernel, each side only ever moves its own index */
+struct ether_xdp_ring {
+    void *map; /* NULL if not mapped */
+    size_t size;
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descs;
+};
+
+struct ether_xdp {
+    char name[IFNAMSIZ];
+    unsigned int queue;
+    int flags;
+    int fd;
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+    unsigned int irq;
+    uint8_t *umem; /* NULL if not allocated */
+    size_t umem_size;
+    struct ether_xdp_ring fill; /* produced by the poll, frames handed to the kernel for receiving */
+    struct ether_xdp_ring comp; /* consumed under the mutex, frames the kernel has sent */
+    struct ether_xdp_ring rx; /* consumed by the poll */
+    struct ether_xdp_ring tx; /* produced under the mutex */
+    mutex_t mutex; /* protects the free frames, the TX and the completion ring */
+    uint64_t free[ETHER_XDP_FRAME_NR];
+    unsigned int nfree;
+    unsigned int tx_unkicked; /* descriptors produced since the kernel was last woken up, for batching the wakeups */
+    unsigned int lent; /* frames currently referenced up the stack */
+    struct ether_xdp_frame frames[ETHER_XDP_FRAME_NR];
+    unsigned long rx_frames;
+    unsigned long tx_frames;
+    unsigned long lent_total;
+    unsigned long copied;
+    unsigned long tx_drops;
+};
+
+#define PRIV(x) ((struct ether_xdp *)x->priv)
+
+static int
+ether_xdp_bpf(int cmd, union bpf_attr *attr)
+{
+    /* no libbpf, the few commands needed are issued directly */
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* looks up the interface, takes over its address if none was given and makes it promiscuous */
+static int
+ether_xdp_ifsetup(struct network_device *dev, int *ifindex)
+{
+    int soc;
+    struct ifreq ifr = {};
+
+    soc = socket(AF_INET, SOCK_DGRAM, 0);
+    if (soc == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    strncpy(ifr.ifr_name, PRIV(dev)->name, sizeof(ifr.ifr_name)-1);
+    if (ioctl(soc, SIOCGIFINDEX, &ifr) == -1) {
+        errorf("ioctl(SIOCGIFINDEX): %s, dev=%s", strerror(errno), dev->name);
+        goto error;
+    }
+    *ifindex = ifr.ifr_ifindex;
+    if (memcmp(dev->address, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
+        if (ioctl(soc, SIOCGIFHWADDR, &ifr) == -1) {
+            errorf("ioctl(SIOCGIFHWADDR): %s, dev=%s", strerror(errno), dev->name);
+            goto error;
+        }
+        memcpy(dev->address, ifr.ifr_hwaddr.sa_data, ETHER_ADDR_LEN);
+    }
+    if (ioctl(soc, SIOCGIFFLAGS, &ifr) == -1) {
+        errorf("ioctl(SIOCGIFFLAGS): %s, dev=%s", strerror(errno), dev->name);
+        goto error;
+    }
+    ifr.ifr_flags = ifr.ifr_flags | IFF_PROMISC;
+    if (ioctl(soc, SIOCSIFFLAGS, &ifr) == -1) {
+        errorf("ioctl(SIOCSIFFLAGS): %s, dev=%s", strerror(errno), dev->name);
+        goto error;
+    }
+    close(soc);
+    return 0;
+error:
+    close(soc);
+    return -1;
+}
+
+static int
+ether_xdp_ring_map(struct network_device *dev, struct ether_xdp_ring *ring, const struct xdp_ring_offset *off, size_t entry, off_t pgoff)
+{
+    ring->size = off->desc + ETHER_XDP_RING_SIZE * entry;
+    ring->map = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, PRIV(dev)->fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), dev->name);
+        ring->map = NULL;
+        return -1;
+    }
+    ring->producer = (uint32_t *)((uint8_t *)ring->map + off->producer);
+    ring->consumer = (uint32_t *)((uint8_t *)ring->map + off->consumer);
+    ring->flags = (uint32_t *)((uint8_t *)ring->map + off->flags);
+    ring->descs = (uint8_t *)ring->map + off->desc;
+    return 0;
+}
+
+static void
+ether_xdp_ring_unmap(struct ether_xdp_ring *ring)
+{
+    if (ring->map) {
+        munmap(ring->map, ring->size);
+        ring->map = NULL;
+    }
+}
+
+/* registers the UMEM and maps the four rings of the socket */
+static int
+ether_xdp_umem_setup(struct network_device *dev)
+{
+    struct ether_xdp *xdp;
+    struct xdp_umem_reg reg = {};
+    struct xdp_mmap_offsets off = {};
+    socklen_t optlen;
+    int size = ETHER_XDP_RING_SIZE;
+    unsigned int i;
+
+    xdp = PRIV(dev);
+    xdp->umem_size = (size_t)ETHER_XDP_FRAME_SIZE * ETHER_XDP_FRAME_NR;
+    xdp->umem = mmap(NULL, xdp->umem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (xdp->umem == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), dev->name);
+        xdp->umem = NULL;
+        return -1;
+    }
+    reg.addr = (uintptr_t)xdp->umem;
+    reg.len = xdp->umem_size;
+    reg.chunk_size = ETHER_XDP_FRAME_SIZE;
+    reg.headroom = 0;
+    if (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1) {
+        errorf("setsockopt(XDP_UMEM_REG): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) == -1 ||
+        setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) == -1 ||
+        setsockopt(xdp->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) == -1 ||
+        setsockopt(xdp->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) == -1) {
+        errorf("setsockopt(XDP_*_RING): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    optlen = sizeof(off);
+    if (getsockopt(xdp->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1) {
+        errorf("getsockopt(XDP_MMAP_OFFSETS): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (ether_xdp_ring_map(dev, &xdp->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) == -1 ||
+        ether_xdp_ring_map(dev, &xdp->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) == -1 ||
+        ether_xdp_ring_map(dev, &xdp->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) == -1 ||
+        ether_xdp_ring_map(dev, &xdp->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) == -1) {
+        return -1;
+    }
+    /* every frame starts out free, shared by the fill ring and transmission */
+    for (i = 0; i < ETHER_XDP_FRAME_NR; i++) {
+        xdp->frames[i].xdp = xdp;
+        xdp->free[i] = (uint64_t)ETHER_XDP_FRAME_SIZE * (ETHER_XDP_FRAME_NR - 1 - i);
+    }
+    xdp->nfree = ETHER_XDP_FRAME_NR;
+    xdp->tx_unkicked = 0;
+    xdp->lent = 0;
+    return 0;
+}
+
+/* creates the XSKMAP holding the socket and attaches a program redirecting the queue to it */
+static int
+ether_xdp_attach(struct network_device *dev, int ifindex)
+{
+    struct ether_xdp *xdp;
+    union bpf_attr attr;
+    int key;
+
+    xdp = PRIV(dev);
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(int);
+    attr.value_size = sizeof(int);
+    attr.max_entries = ETHER_XDP_QUEUES_MAX;
+    xdp->map_fd = ether_xdp_bpf(BPF_MAP_CREATE, &attr);
+    if (xdp->map_fd == -1) {
+        errorf("bpf(BPF_MAP_CREATE): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    key = xdp->queue;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xdp->map_fd;
+    attr.key = (uintptr_t)&key;
+    attr.value = (uintptr_t)&xdp->fd;
+    attr.flags = BPF_ANY;
+    if (ether_xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1) {
+        errorf("bpf(BPF_MAP_UPDATE_ELEM): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    /* return bpf_redirect_map(&xskmap, ctx->rx_queue_index, XDP_PASS); queues without a socket go to the kernel */
+    struct bpf_insn prog[] = {
+        { .code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1, .off = offsetof(struct xdp_md, rx_queue_index) },
+        { .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1, .src_reg = BPF_PSEUDO_MAP_FD, .imm = xdp->map_fd },
+        { 0 },
+        { .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS },
+        { .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+        { .code = BPF_JMP | BPF_EXIT },
+    };
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uintptr_t)prog;
+    attr.insn_cnt = countof(prog);
+    attr.license = (uintptr_t)"GPL";
+    xdp->prog_fd = ether_xdp_bpf(BPF_PROG_LOAD, &attr);
+    if (xdp->prog_fd == -1) {
+        errorf("bpf(BPF_PROG_LOAD): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    /* a link detaches the program by itself once its fd is closed, even if the process dies */
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = xdp->prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = (xdp->flags & ETHER_XDP_FLAG_DRV_MODE) ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+    xdp->link_fd = ether_xdp_bpf(BPF_LINK_CREATE, &attr);
+    if (xdp->link_fd == -1) {
+        errorf("bpf(BPF_LINK_CREATE): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    return 0;
+}
+
+/* NOTE: must be called after xdp->mutex locked */
+static void
+ether_xdp_complete(struct ether_xdp *xdp)
+{
+    uint32_t cons, prod;
+
+    cons = *xdp->comp.consumer;
+    prod = __atomic_load_n(xdp->comp.producer, __ATOMIC_ACQUIRE);
+    while (cons != prod) {
+        xdp->free[xdp->nfree++] = ((uint64_t *)xdp->comp.descs)[cons & ETHER_XDP_RING_MASK];
+        cons++;
+    }
+    __atomic_store_n(xdp->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+/* NOTE: must be called after xdp->mutex locked, returns 1 while the kernel has not consumed the whole TX ring */
+static int
+ether_xdp_kick(struct network_device *dev)
+{
+    struct ether_xdp *xdp;
+    int i;
+
+    xdp = PRIV(dev);
+    xdp->tx_unkicked = 0;
+    for (i = 0; i < ETHER_XDP_KICK_MAX; i++) {
+        if (*xdp->tx.producer == __atomic_load_n(xdp->tx.consumer, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        if (!(__atomic_load_n(xdp->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)) {
+            /* the driver is still working through the ring */
+            break;
+        }
+        if (sendto(xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) != -1) {
+            break;
+        }
+        if (errno == EAGAIN) {
+            /* sent a batch, more are left */
+            continue;
+        }
+        if (errno != EBUSY && errno != ENOBUFS && errno != ENETDOWN) {
+            errorf("sendto: %s, dev=%s", strerror(errno), dev->name);
+        }
+        break;
+    }
+    return *xdp->tx.producer != __atomic_load_n(xdp->tx.consumer, __ATOMIC_ACQUIRE);
+}
+
+/* hands free frames to the kernel for receiving, only ever called by the poll */
+static void
+ether_xdp_refill(struct ether_xdp *xdp)
+{
+    uint32_t prod, space, i;
+
+    prod = *xdp->fill.producer;
+    space = ETHER_XDP_RING_SIZE - (prod - __atomic_load_n(xdp->fill.consumer, __ATOMIC_ACQUIRE));
+    mutex_lock(&xdp->mutex);
+    ether_xdp_complete(xdp);
+    for (i = 0; i < space && xdp->nfree; i++) {
+        ((uint64_t *)xdp->fill.descs)[(prod + i) & ETHER_XDP_RING_MASK] = xdp->free[--xdp->nfree];
+    }
+    mutex_unlock(&xdp->mutex);
+    __atomic_store_n(xdp->fill.producer, prod + i, __ATOMIC_RELEASE);
+}
+
+static void
+ether_xdp_frame_free(struct ether_xdp *xdp, uint64_t addr)
+{
+    mutex_lock(&xdp->mutex);
+    xdp->free[xdp->nfree++] = addr;
+    mutex_unlock(&xdp->mutex);
+}
+
+static void
+ether_xdp_frame_put(void *arg)
+{
+    struct ether_xdp_frame *frame = arg;
+
+    __atomic_sub_fetch(&frame->xdp->lent, 1, __ATOMIC_RELAXED);
+    ether_xdp_frame_free(frame->xdp, frame->addr);
+}
+
+static void
+ether_xdp_cleanup(struct network_device *dev)
+{
+    struct ether_xdp *xdp;
+
+    xdp = PRIV(dev);
+    if (xdp->link_fd != -1) {
+        close(xdp->link_fd);
+        xdp->link_fd = -1;
+    }
+    if (xdp->prog_fd != -1) {
+        close(xdp->prog_fd);
+        xdp->prog_fd = -1;
+    }
+    if (xdp->map_fd != -1) {
+        close(xdp->map_fd);
+        xdp->map_fd = -1;
+    }
+    ether_xdp_ring_unmap(&xdp->fill);
+    ether_xdp_ring_unmap(&xdp->comp);
+    ether_xdp_ring_unmap(&xdp->rx);
+    ether_xdp_ring_unmap(&xdp->tx);
+    if (xdp->fd != -1) {
+        close(xdp->fd);
+        xdp->fd = -1;
+    }
+    if (xdp->umem) {
+        if (__atomic_load_n(&xdp->lent, __ATOMIC_ACQUIRE)) {
+            /* frames are still referenced somewhere, the memory must outlive them */
+            errorf("umem still lent, left mapped, dev=%s, frames=%u", dev->name, xdp->lent);
+            return;
+        }
+        munmap(xdp->umem, xdp->umem_size);
+        xdp->umem = NULL;
+    }
+}
+
+static int
+ether_xdp_open(struct network_device *dev)
+{
+    struct ether_xdp *xdp;
+    struct sockaddr_xdp addr = {};
+    int ifindex;
+
+    xdp = PRIV(dev);
+    if (ether_xdp_ifsetup(dev, &ifindex) == -1) {
+        return -1;
+    }
+    xdp->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (xdp->fd == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (ether_xdp_umem_setup(dev) == -1) {
+        goto error;
+    }
+    ether_xdp_refill(xdp);
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = ifindex;
+    addr.sxdp_queue_id = xdp->queue;
+    addr.sxdp_flags = XDP_USE_NEED_WAKEUP | ((xdp->flags & ETHER_XDP_FLAG_ZEROCOPY) ? XDP_ZEROCOPY : XDP_COPY);
+    if (bind(xdp->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        errorf("bind: %s, dev=%s, queue=%u", strerror(errno), dev->name, xdp->queue);
+        goto error;
+    }
+    if (ether_xdp_attach(dev, ifindex) == -1) {
+        goto error;
+    }
+    if (intr_register_fd(xdp->irq, dev, xdp->fd) == -1) {
+        errorf("intr_register_fd() failure, dev=%s", dev->name);
+        goto error;
+    }
+    infof("dev=%s, if=%s, queue=%u, mode=%s", dev->name, xdp->name, xdp->queue,
+        (xdp->flags & ETHER_XDP_FLAG_ZEROCOPY) ? "zerocopy" : (xdp->flags & ETHER_XDP_FLAG_DRV_MODE) ? "drv" : "skb");
+    return 0;
+error:
+    ether_xdp_cleanup(dev);
+    return -1;
+}
+
+static int
+ether_xdp_close(struct network_device *dev)
+{
+    struct ether_xdp *xdp;
+
+    xdp = PRIV(dev);
+    intr_unregister_fd(xdp->irq, dev);
+    infof("dev=%s, rx=%lu, lent=%lu, copied=%lu, tx=%lu, tx_drops=%lu",
+        dev->name, xdp->rx_frames, xdp->lent_total, xdp->copied, xdp->tx_frames, xdp->tx_drops);
+    ether_xdp_cleanup(dev);
+    return 0;
+}
+
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+/* the frame is copied into a free UMEM frame and left on the TX ring, the kernel is woken up per batch */
+static ssize_t
+ether_xdp_write(struct network_device *dev, struct pktbuf *pb, const struct iovec *iov, int iovcnt)
+{
+    struct ether_xdp *xdp;
+    struct xdp_desc *desc;
+    uint32_t prod;
+    unsigned int batch;
+    size_t len = 0;
+    uint8_t *p;
+    int i;
+
+    xdp = PRIV(dev);
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (len > ETHER_XDP_FRAME_SIZE) {
+        errorf("too long, dev=%s, len=%zu", dev->name, len);
+        return -1;
+    }
+    mutex_lock(&xdp->mutex);
+    ether_xdp_complete(xdp);
+    prod = *xdp->tx.producer;
+    if (!xdp->nfree || prod - __atomic_load_n(xdp->tx.consumer, __ATOMIC_ACQUIRE) == ETHER_XDP_RING_SIZE) {
+        xdp->tx_drops++;
+        ether_xdp_kick(dev);
+        mutex_unlock(&xdp->mutex);
+        network_device_tx_pending(dev);
+        return -1;
+    }
+    desc = &((struct xdp_desc *)xdp->tx.descs)[prod & ETHER_XDP_RING_MASK];
+    desc->addr = xdp->free[--xdp->nfree];
+    desc->len = len;
+    desc->options = 0;
+    p = xdp->umem + desc->addr;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    __atomic_store_n(xdp->tx.producer, prod + 1, __ATOMIC_RELEASE);
+    xdp->tx_frames++;
+    xdp->tx_unkicked++;
+    batch = dev->tx_batch ? dev->tx_batch : NETWORK_TX_BATCH_DEFAULT;
+    if (xdp->tx_unkicked >= batch && !ether_xdp_kick(dev)) {
+        mutex_unlock(&xdp->mutex);
+        return len;
+    }
+    mutex_unlock(&xdp->mutex);
+    network_device_tx_pending(dev);
+    return len;
+}
+
+static int
+ether_xdp_flush(struct network_device *dev)
+{
+    int pending;
+
+    mutex_lock(&PRIV(dev)->mutex);
+    ether_xdp_complete(PRIV(dev));
+    pending = ether_xdp_kick(dev);
+    mutex_unlock(&PRIV(dev)->mutex);
+    if (pending) {
+        /* looked at again on the next round of the interrupt thread, at the latest on its timer tick */
+        network_device_tx_pending(dev);
+    }
+    return 0;
+}
+
+int
+ether_xdp_transmit(struct network_device *dev, uint16_t type, struct pktbuf *pb, const void *dst)
+{
+    return ether_transmit_helper(dev, type, pb, dst, ether_xdp_write);
+}
+
+/* lends a received frame to the stack in place, or copies it once a quarter of the UMEM is left free */
+static struct pktbuf *
+ether_xdp_frame(struct ether_xdp *xdp, const struct xdp_desc *desc)
+{
+    struct ether_xdp_frame *frame;
+    struct pktbuf *pb = NULL;
+    uint64_t base;
+    uint8_t *data;
+    size_t len;
+
+    /* the kernel places the data behind some headroom inside the frame */
+    base = desc->addr - desc->addr % ETHER_XDP_FRAME_SIZE;
+    data = xdp->umem + desc->addr;
+    if (__atomic_load_n(&xdp->nfree, __ATOMIC_RELAXED) > ETHER_XDP_FRAME_NR / 4) {
+        frame = &xdp->frames[base / ETHER_XDP_FRAME_SIZE];
+        frame->addr = base;
+        pb = pktbuf_alloc_ext(data, desc->len, ether_xdp_frame_put, frame);
+        if (pb) {
+            __atomic_add_fetch(&xdp->lent, 1, __ATOMIC_RELAXED);
+            xdp->lent_total++;
+            return pb;
+        }
+    }
+    pb = pktbuf_alloc(ETHER_FRAME_SIZE_MAX);
+    if (pb) {
+        len = MIN(desc->len, pktbuf_tailroom(pb));
+        memcpy(pktbuf_append(pb, len), data, len);
+        xdp->copied++;
+    } else {
+        errorf("pktbuf_alloc() failure");
+    }
+    ether_xdp_frame_free(xdp, base);
+    return pb;
+}
+
+static int
+ether_xdp_isr(unsigned int irq, void *id)
+{
+    struct network_device *dev = (struct network_device *)id;
+
+    /* mask the fd until ether_xdp_poll() has drained the RX ring */
+    intr_disable_irq(irq, dev);
+    network_device_schedule_poll(dev);
+    return 0;
+}
+
+static int
+ether_xdp_poll(struct network_device *dev, int budget)
+{
+    struct ether_xdp *xdp;
+    struct pktbuf *pbs[PKTBUF_VEC_MAX];
+    uint32_t cons, prod;
+    unsigned int num = 0;
+    int total = 0;
+
+    xdp = PRIV(dev);
+    cons = *xdp->rx.consumer;
+    prod = __atomic_load_n(xdp->rx.producer, __ATOMIC_ACQUIRE);
+    while (cons != prod && total < budget) {
+        pbs[num] = ether_xdp_frame(xdp, &((struct xdp_desc *)xdp->rx.descs)[cons & ETHER_XDP_RING_MASK]);
+        if (pbs[num]) {
+            num++;
+        }
+        cons++;
+        total++;
+        if (num == PKTBUF_VEC_MAX) {
+            ether_input_batch_helper(dev, pbs, num);
+            num = 0;
+        }
+    }
+    __atomic_store_n(xdp->rx.consumer, cons, __ATOMIC_RELEASE);
+    if (num) {
+        ether_input_batch_helper(dev, pbs, num);
+    }
+    xdp->rx_frames += total;
+    ether_xdp_refill(xdp);
+    if (total < budget) {
+        intr_enable_irq(xdp->irq, dev);
+    }
+    return total;
+}
+
+static struct network_device_operations ether_xdp_ops = {
+    .open = ether_xdp_open,
+    .close = ether_xdp_close,
+    .transmit = ether_xdp_transmit,
+    .poll = ether_xdp_poll,
+    .flush = ether_xdp_flush,
+};
+
+struct network_device *
+ether_xdp_init(const char *name, const char *addr, unsigned int queue, int flags)
+{
+    struct network_device *dev;
+    struct ether_xdp *xdp;
+
+    if (queue >= ETHER_XDP_QUEUES_MAX) {
+        errorf("invalid queue, queue=%u", queue);
+        return NULL;
+    }
+    if (flags & ETHER_XDP_FLAG_ZEROCOPY) {
+        flags |= ETHER_XDP_FLAG_DRV_MODE;
+    }
+    dev = network_device_allocate(ether_setup_helper);
+    if (!dev) {
+        errorf("network_device_alloc() failure");
+        return NULL;
+    }
+    if (addr) {
+        if (ether_addr_pton(addr, dev->address) == -1) {
+            errorf("invalid address, addr=%s", addr);
+            return NULL;
+        }
+    }
+    dev->ops = &ether_xdp_ops;
+    xdp = memory_alloc(sizeof(*xdp));
+    if (!xdp) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    strncpy(xdp->name, name, sizeof(xdp->name)-1);
+    xdp->queue = queue;
+    xdp->flags = flags;
+    xdp->fd = -1;
+    xdp->map_fd = -1;
+    xdp->prog_fd = -1;
+    xdp->link_fd = -1;
+    xdp->irq = ETHER_XDP_IRQ;
+    mutex_init(&xdp->mutex);
+    dev->priv = xdp;
+    if (network_device_register(dev) == -1) {
+        errorf("network_device_register() failure");
+        memory_free(xdp);
+        return NULL;
+    }
+    intr_request_irq(xdp->irq, ether_xdp_isr, NETWORK_IRQ_SHARED, dev->name, dev);
+    debugf("ethernet device initialized, dev=%s", dev->name);
+    return dev;
+}
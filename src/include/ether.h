@@ -5,7 +5,10 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
+#include "handler.h"
 #include "net2.h"
 
 // Length of an Ethernet address
@@ -44,11 +47,91 @@ extern int ether_addr_pton(const char *p, uint8_t *n);
 // Function to convert a binary Ethernet address to a string representation
 extern char *ether_addr_ntop(const uint8_t *n, char *p, size_t size);
 
-// Helper function for transmitting an Ethernet frame
-extern int ether_transmit_helper(struct network_device *dev, uint16_t type, const uint8_t *payload, size_t plen, const void *dst, ssize_t (*callback)(struct network_device *dev, const uint8_t *buf, size_t len));
-
-// Helper function for polling an Ethernet device for received frames
-extern int ether_poll_helper(struct network_device *dev, ssize_t (*callback)(struct network_device *dev, uint8_t *buf, size_t size));
+// Helper function for transmitting an Ethernet frame, the header is prepended to the packet buffer in place
+// and the frame is handed to the driver as a gather list (header, payload fragments, padding) along with the buffer
+extern int ether_transmit_helper(struct network_device *dev, uint16_t type, struct pktbuf *pb, const void *dst, ssize_t (*callback)(struct network_device *dev, struct pktbuf *pb, const struct iovec *iov, int iovcnt));
+
+// Helper function for polling an Ethernet device for received frames, the callback reads a frame into the
+// packet buffer and returns its length,
+// 0 if no frame is available (non-blocking read) or -1 on error;
+// returns 1 if a frame was consumed, 0 if none was available or -1 on error
+extern int ether_poll_helper(struct network_device *dev, ssize_t (*callback)(struct network_device *dev, struct pktbuf *pb));
+
+// Helper function for polling an Ethernet device for up to budget received frames at once, the frames are read
+// as vectors of up to PKTBUF_VEC_MAX, classified by ethertype and handed up with one network_input_batch() per type;
+// returns the number of frames consumed, read errors included, less than budget once the device is drained or
+// no packet buffer is left
+extern int ether_poll_batch_helper(struct network_device *dev, ssize_t (*callback)(struct network_device *dev, struct pktbuf *pb), int budget);
+
+// Helper function for handing up a vector of up to PKTBUF_VEC_MAX received frames the driver has already
+// placed in packet buffers (e.g. lent from a receive ring), classified like ether_poll_batch_helper();
+// takes over the caller's references
+extern void ether_input_batch_helper(struct network_device *dev, struct pktbuf **pbs, unsigned int num);
+
+// Maximum number of frames held by a transmit queue
+#define ETHER_TX_QUEUE_MAX 64
+
+// Number of batch size buckets of a transmit queue: 1, 2-3, 4-7, 8-15, 16-31, 32 and more frames
+#define ETHER_TX_BATCH_BUCKETS 6
+
+// Transmit queue of a driver, the frames are held by reference when transmitted and handed to the device at once
+struct ether_tx_queue {
+    mutex_t mutex;
+    struct pktbuf *pbs[ETHER_TX_QUEUE_MAX];
+    unsigned int num;
+    int (*send)(struct network_device *dev, struct pktbuf **pbs, unsigned int num); // returns the number sent
+    unsigned long flushes;
+    unsigned long frames;
+    unsigned long errors; // frames the send callback did not take
+    unsigned long batches[ETHER_TX_BATCH_BUCKETS]; // flushes by batch size
+};
+
+// Function to initialize a transmit queue with the driver's callback sending a batch of frames
+extern void ether_tx_queue_init(struct ether_tx_queue *q, int (*send)(struct network_device *dev, struct pktbuf **pbs, unsigned int num));
+
+// Function to queue a frame, the buffer starting at its Ethernet header, returns the frame length with the padding or -1;
+// the buffer is held by reference (its fragments are gathered into a copy), so it must not be modified once transmitted;
+// the queue is flushed right away once dev->tx_batch frames are queued, otherwise at the end of the softirq
+extern ssize_t ether_tx_queue_push(struct network_device *dev, struct ether_tx_queue *q, struct pktbuf *pb);
+
+// Function for the send callback, describes a queued frame in iov[0], then its padding to the minimum frame size
+// in iov[1] if it is too short; returns the number of iovecs used
+extern int ether_tx_frame_iov(struct pktbuf *pb, struct iovec *iov);
+
+// Function to hand the queued frames to the driver's send callback
+extern void ether_tx_queue_flush(struct network_device *dev, struct ether_tx_queue *q);
+
+// Function to flush a transmit queue for the last time and log its statistics
+extern void ether_tx_queue_destroy(struct network_device *dev, struct ether_tx_queue *q);
+
+// Timeout of the blocking wait of a busy-poll thread, bounds how long stopping it takes
+#define ETHER_BUSY_POLL_BLOCK_MS 100
+
+// Statistics of a busy-poll thread
+struct ether_busy_poll_stats {
+    uint64_t frames;  // frames consumed
+    uint64_t busy_ns; // time spent reading and processing frames
+    uint64_t spin_ns; // time spent spinning on an empty fd
+    uint64_t idle_ns; // time spent blocked after the spin budget ran out
+    uint64_t sleeps;  // number of times the spin budget ran out
+};
+
+// Busy-poll receive thread, spins on a non-blocking fd instead of waiting for the interrupt thread
+struct ether_busy_poll {
+    unsigned int spin_us; // how long to spin without traffic before blocking (0 = busy-poll disabled)
+    int running;
+    pthread_t thread;
+    struct network_device *dev;
+    int fd;
+    ssize_t (*callback)(struct network_device *dev, struct pktbuf *pb);
+    struct ether_busy_poll_stats stats;
+};
+
+// Function to start a busy-poll thread on a non-blocking fd, bp->spin_us must be set
+extern int ether_busy_poll_start(struct ether_busy_poll *bp, struct network_device *dev, int fd, ssize_t (*callback)(struct network_device *dev, struct pktbuf *pb));
+
+// Function to stop a busy-poll thread and log its statistics
+extern void ether_busy_poll_stop(struct ether_busy_poll *bp);
 
 // Helper function for setting up an Ethernet device
 extern void ether_setup_helper(struct network_device *network_device);
@@ -0,0 +1,23 @@
+#ifndef ETHER_PCAP_H
+#define ETHER_PCAP_H
+
+#include "net2.h"
+
+// Maximum number of workers of a PF_PACKET device
+#define ETHER_PCAP_WORKERS_MAX 16
+
+extern struct network_device * ether_pcap_init(const char *name, const char *addr);
+
+// Same as ether_pcap_init(), but with workers > 1 as many sockets join a PACKET_FANOUT group of the given mode
+// (PACKET_FANOUT_HASH, PACKET_FANOUT_CPU, PACKET_FANOUT_QM, ...), each received on by its own thread pinned to a core
+extern struct network_device * ether_pcap_init_fanout(const char *name, const char *addr, unsigned int workers, int mode);
+
+// Receive on a dedicated thread spinning for up to spin_us without traffic before blocking,
+// instead of on the interrupt thread (0 = disabled); must be called before the device is opened
+extern int ether_pcap_set_busy_poll(struct network_device *dev, unsigned int spin_us);
+
+// Drive the socket through io_uring (see etheruring.h) instead of the receive ring and recv()/sendmsg(), falling back
+// to them if io_uring is unavailable; single-worker devices without busy-poll only, must be called before the device is opened
+extern int ether_pcap_set_io_uring(struct network_device *dev, int enable);
+
+#endif
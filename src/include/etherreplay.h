@@ -0,0 +1,28 @@
+#ifndef ETHER_REPLAY_H
+#define ETHER_REPLAY_H
+
+#include "net2.h"
+
+// Replay modes: the capture's own inter-frame gaps, as fast as the stack takes them, or a fixed packet rate
+#define ETHER_REPLAY_MODE_TIMED 0
+#define ETHER_REPLAY_MODE_MAX_RATE 1
+#define ETHER_REPLAY_MODE_PPS 2
+
+// A frame injected later than this behind its schedule is counted as late, the stack did not keep up with the rate
+#define ETHER_REPLAY_LATE_NS 1000000
+
+// Ethernet device receiving the frames of a classic pcap (micro or nanosecond) or pcapng capture file, mapped into
+// memory when the device is opened. Unicast frames are rewritten to the device's address so the stack accepts them;
+// what the stack transmits is counted and discarded. Throughput and drop statistics are logged after every run
+// through the file and in total when the device is closed
+extern struct network_device * ether_replay_init(const char *file, const char *addr);
+
+// Replay mode, pps is the rate of ETHER_REPLAY_MODE_PPS; must be called before the device is opened
+extern int ether_replay_set_mode(struct network_device *dev, int mode, unsigned long pps);
+// Runs through the file (0 = until the device is closed, default 1); must be called before the device is opened
+extern int ether_replay_set_loops(struct network_device *dev, unsigned int loops);
+
+// Returns 1 once the last run is over
+extern int ether_replay_done(struct network_device *dev);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef ETHER_SHM_H
+#define ETHER_SHM_H
+
+#include "net2.h"
+
+// Slots of the ring in each direction, and the largest frame a slot holds
+#define ETHER_SHM_RING_SIZE 1024
+#define ETHER_SHM_SLOT_SIZE 2048
+
+// Ethernet device wired to a peer process over shared memory: a memfd holding one SPSC frame ring per direction,
+// and an eventfd per direction to wake up a sleeping consumer. The first process to open the device at path creates
+// them and listens on a UNIX socket bound there; the second one connects and is handed the fds. No root privileges
+// and no kernel networking involved. Without addr, a locally administered address is derived from the pid
+extern struct network_device * ether_shm_init(const char *path, const char *addr);
+
+#endif
@@ -3,6 +3,21 @@
 
 #include "net2.h"
 
+// Maximum number of queues of a multi-queue TAP device
+#define ETHER_TAP_QUEUES_MAX 16
+
 extern struct network_device * ether_tap_init(const char *name, const char *addr);
 
-#endif
\ No newline at end of file
+// Same as ether_tap_init(), but with queues > 1 the interface is opened with IFF_MULTI_QUEUE as that many fds,
+// each serviced by its own receive thread pinned to a core; transmits use the queue of the calling core
+extern struct network_device * ether_tap_init_mq(const char *name, const char *addr, unsigned int queues);
+
+// Receive on a dedicated thread spinning for up to spin_us without traffic before blocking,
+// instead of on the interrupt thread (0 = disabled); must be called before the device is opened
+extern int ether_tap_set_busy_poll(struct network_device *dev, unsigned int spin_us);
+
+// Drive the fd through io_uring (see etheruring.h) instead of read()/write() per frame, falling back to them
+// if io_uring is unavailable; single-queue devices without busy-poll only, must be called before the device is opened
+extern int ether_tap_set_io_uring(struct network_device *dev, int enable);
+
+#endif
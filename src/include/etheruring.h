@@ -0,0 +1,33 @@
+#ifndef ETHER_URING_H
+#define ETHER_URING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "net2.h"
+
+// Entries of the submission queue
+#define ETHER_URING_ENTRIES 256
+// Reads kept outstanding, and transmit buffers, each of ETHER_URING_BUF_SIZE bytes of registered memory
+#define ETHER_URING_READS 64
+#define ETHER_URING_WRITES 64
+#define ETHER_URING_BUF_SIZE 2048
+
+struct ether_uring;
+
+// I/O engine for a device fd on io_uring: reads stay outstanding on registered buffers and are reaped in the
+// interrupt thread, signalled through an eventfd registered as the device's irq; writes are submitted per batch.
+// fixup (may be NULL) strips any per-frame header the fd prepends. Returns NULL if io_uring is unavailable,
+// in which case the device keeps using read()/write()
+extern struct ether_uring * ether_uring_open(struct network_device *dev, int fd, unsigned int irq, int (*fixup)(struct network_device *dev, struct pktbuf *pb));
+extern void ether_uring_close(struct ether_uring *u);
+
+// Reaps up to budget received frames and hands them to the stack, then re-arms the reads; returns the number reaped
+extern int ether_uring_poll(struct ether_uring *u, int budget);
+
+// Copies a frame into a transmit buffer and queues its write, submitted once dev->tx_batch writes are queued
+extern ssize_t ether_uring_write(struct ether_uring *u, const struct iovec *iov, int iovcnt);
+// Submits the queued writes
+extern void ether_uring_flush(struct ether_uring *u);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef ETHER_XDP_H
+#define ETHER_XDP_H
+
+#include "net2.h"
+
+// Attach the XDP program in native driver mode instead of generic (SKB) mode
+#define ETHER_XDP_FLAG_DRV_MODE 0x0001
+// Bind in zero-copy mode, the driver DMAs straight into the UMEM (implies ETHER_XDP_FLAG_DRV_MODE)
+#define ETHER_XDP_FLAG_ZEROCOPY 0x0002
+
+// Frames of the UMEM shared with the kernel, received frames are lent up the stack from it
+#define ETHER_XDP_FRAME_SIZE 2048
+#define ETHER_XDP_FRAME_NR 4096
+
+// Entries of each of the fill, completion, RX and TX rings
+#define ETHER_XDP_RING_SIZE 2048
+
+// AF_XDP socket on one queue of an interface; an XDP program redirecting that queue to the socket is
+// attached for as long as the device is open. Without flags it works in copy mode on any driver (e.g. veth)
+extern struct network_device * ether_xdp_init(const char *name, const char *addr, unsigned int queue, int flags);
+
+#endif
@@ -7,6 +7,7 @@
 #define HANDLE_H
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <time.h>
 #include <signal.h>
@@ -71,14 +72,19 @@ static inline int mutex_unlock(mutex_t *mutex)
 
 /**
  * @brief Structure representing the scheduling context.
+ *
+ * Sleepers park on a futex word that every wakeup advances, so a wakeup does
+ * not need the sleeper's mutex to be released first and can target a single
+ * sleeper.
  */
 struct sched_ctx {
-    pthread_cond_t cond; /**< Condition variable for signaling threads. */
+    uint32_t seq; /**< Futex word, advanced by every wakeup. */
     int interrupted; /**< Flag indicating if the context is interrupted. */
     int wc; /**< Wait count. */
+    unsigned int spin; /**< Number of polls of the futex word before parking (0 = park at once). */
 };
 
-#define SCHED_CTX_INITIALIZER {PTHREAD_COND_INITIALIZER, 0, 0}
+#define SCHED_CTX_INITIALIZER {0, 0, 0, 0}
 
 /**
  * @brief Initializes a scheduling context.
@@ -87,31 +93,52 @@ struct sched_ctx {
  */
 extern int sched_ctx_init(struct sched_ctx *ctx);
 
+/**
+ * @brief Sets how long sleepers spin before parking in the kernel.
+ *
+ * Spinning avoids a context switch when the wakeup is expected within a few
+ * microseconds, at the cost of burning CPU while waiting.
+ *
+ * @param ctx A pointer to the scheduling context.
+ * @param spin Number of polls of the wakeup counter before parking.
+ */
+extern void sched_ctx_set_spin(struct sched_ctx *ctx, unsigned int spin);
+
 /**
  * @brief Destroys a scheduling context.
  * @param ctx A pointer to the scheduling context to destroy.
- * @return 0 on success, or an error code on failure.
+ * @return 0 on success, or EBUSY if threads are still sleeping on it.
  */
 extern int sched_ctx_destroy(struct sched_ctx *ctx);
 
 /**
- * @brief Puts the calling thread to sleep until the specified absolute time.
+ * @brief Puts the calling thread to sleep until woken up or the specified absolute time.
+ *
+ * The mutex is released while sleeping and reacquired before returning.
+ *
  * @param ctx A pointer to the scheduling context.
- * @param mutex A pointer to the mutex to lock before sleeping.
- * @param abstime A pointer to the absolute time to sleep until.
- * @return 0 on success, or an error code on failure.
+ * @param mutex A pointer to the mutex held by the caller.
+ * @param abstime A pointer to the absolute time (CLOCK_REALTIME) to sleep until, or NULL to sleep without a deadline.
+ * @return 0 when woken up, ETIMEDOUT when the deadline passed, or -1 with errno set to EINTR when interrupted.
  */
 extern int sched_sleep(struct sched_ctx *ctx, mutex_t *mutex, const struct timespec *abstime);
 
 /**
- * @brief Wakes up a thread waiting in the scheduling context.
+ * @brief Wakes up one thread waiting in the scheduling context.
  * @param ctx A pointer to the scheduling context.
  * @return 0 on success, or an error code on failure.
  */
 extern int sched_wakeup(struct sched_ctx *ctx);
 
 /**
- * @brief Interrupts the scheduling context.
+ * @brief Wakes up every thread waiting in the scheduling context.
+ * @param ctx A pointer to the scheduling context.
+ * @return 0 on success, or an error code on failure.
+ */
+extern int sched_wakeup_all(struct sched_ctx *ctx);
+
+/**
+ * @brief Interrupts the scheduling context, waking up every waiting thread with EINTR.
  * @param ctx A pointer to the scheduling context.
  * @return 0 on success, or an error code on failure.
  */
@@ -119,6 +146,10 @@ extern int sched_interrupt(struct sched_ctx *ctx);
 
 /**
  * @brief Requests an interrupt handler for the specified IRQ.
+ *
+ * The handler runs on the interrupt thread whenever a file descriptor attached
+ * with intr_register_fd() becomes readable.
+ *
  * @param irq The IRQ number.
  * @param handler A pointer to the interrupt handler function.
  * @param flags Flags for the interrupt handler.
@@ -128,12 +159,59 @@ extern int sched_interrupt(struct sched_ctx *ctx);
  */
 extern int intr_request_irq(unsigned int irq, int (*handler)(unsigned int irq, void *id), int flags, const char *name, void *dev);
 
+/**
+ * @brief Attaches a file descriptor as the readiness source of a requested IRQ.
+ * @param irq The IRQ number passed to intr_request_irq().
+ * @param dev The device passed to intr_request_irq().
+ * @param fd The file descriptor to watch for input.
+ * @return 0 on success, -1 on failure.
+ */
+extern int intr_register_fd(unsigned int irq, void *dev, int fd);
+
+/**
+ * @brief Stops watching the file descriptor of a requested IRQ. Must be called before the descriptor is closed.
+ * @param irq The IRQ number passed to intr_request_irq().
+ * @param dev The device passed to intr_request_irq().
+ * @return 0 on success, -1 if no file descriptor was attached.
+ */
+extern int intr_unregister_fd(unsigned int irq, void *dev);
+
+/**
+ * @brief Stops reporting readiness of the file descriptor of a requested IRQ, e.g. while the device is polled.
+ * @param irq The IRQ number passed to intr_request_irq().
+ * @param dev The device passed to intr_request_irq().
+ * @return 0 on success, -1 on failure.
+ */
+extern int intr_disable_irq(unsigned int irq, void *dev);
+
+/**
+ * @brief Resumes reporting readiness of the file descriptor of a requested IRQ.
+ * @param irq The IRQ number passed to intr_request_irq().
+ * @param dev The device passed to intr_request_irq().
+ * @return 0 on success, -1 on failure.
+ */
+extern int intr_enable_irq(unsigned int irq, void *dev);
+
+/**
+ * @brief Tells whether the caller runs on the interrupt thread.
+ * @return 1 on the interrupt thread, 0 otherwise.
+ */
+extern int intr_in_context(void);
+
 /**
  * @brief Runs the interrupt handling loop.
  * @return 0 on success, or an error code on failure.
  */
 extern int intr_run(void);
 
+/**
+ * @brief Stops the interrupt handling loop and waits for its thread to exit.
+ *
+ * What was raised before the call is still handled. Afterwards the caller is
+ * the only thread left to touch device queues drained by the interrupt thread.
+ */
+extern void intr_shutdown(void);
+
 /**
  * @brief Initializes the interrupt handling subsystem.
  * @return 0 on success, or an error code on failure.
@@ -141,11 +219,18 @@ extern int intr_run(void);
 extern int intr_init(void);
 
 /**
- * @brief Raises a software interrupt.
+ * @brief Raises a software interrupt, running the protocol handlers on the interrupt thread.
+ *
+ * Raising it again before it has run costs nothing, and raising it from the
+ * interrupt thread itself needs no system call.
  */
-static inline void raise_softirq(void)
-{
-    kill(getpid(), SIGUSR1);
-}
+extern void raise_softirq(void);
+
+/**
+ * @brief Raises an event interrupt, running the event handlers on the interrupt thread.
+ *
+ * Safe to call from a signal handler.
+ */
+extern void raise_event(void);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,59 @@
+#ifndef IMPAIR_H
+#define IMPAIR_H
+
+#include "net2.h"
+
+/**
+ * @brief Frames an impaired wire holds in each direction before it tail-drops, unless impair_params::limit says otherwise.
+ */
+#define IMPAIR_QUEUE_LIMIT_DEFAULT 1000
+
+/**
+ * @brief Upper bound of impair_params::limit.
+ */
+#define IMPAIR_QUEUE_LIMIT_MAX 8192
+
+/**
+ * @brief Impairments applied to the frames transmitted by one end of an impaired wire.
+ *
+ * Frames are released from a queue ordered by delivery time on the stack's
+ * timer tick, so delays resolve to about a millisecond.
+ */
+struct impair_params
+{
+    unsigned int delay_us; /**< One-way delay. */
+    unsigned int jitter_us; /**< The delay varies uniformly by up to this much either way, which may reorder frames. */
+    double loss; /**< Probability of losing a frame, 0 to 1. */
+    double reorder; /**< Probability of a frame skipping the delay, overtaking the frames queued before it, 0 to 1. */
+    unsigned long rate; /**< Token-bucket bandwidth limit in bits per second (0 = unlimited). */
+    unsigned int burst; /**< Depth of the token bucket in bytes (0 = one maximum-sized frame). */
+    unsigned int limit; /**< Frames queued before tail drops (0 = IMPAIR_QUEUE_LIMIT_DEFAULT). */
+    unsigned int seed; /**< Seed of the random draws, so that a run can be reproduced (0 = from the clock). */
+};
+
+/**
+ * @brief Initialize an impaired wire, two Ethernet devices joined back to back.
+ *
+ * What one device transmits is received by the other, after the impairments
+ * set on the transmitting device with impair_set_params(); none by default.
+ *
+ * @param a Set to the first device.
+ * @param b Set to the second device.
+ * @param addr_a Ethernet address of the first device.
+ * @param addr_b Ethernet address of the second device.
+ * @return 0 on success, -1 on failure.
+ */
+extern int impair_init(struct network_device **a, struct network_device **b, const char *addr_a, const char *addr_b);
+
+/**
+ * @brief Set the impairments of the frames transmitted by one end of an impaired wire.
+ *
+ * May be called while the wire is in use, frames already queued keep their delivery time.
+ *
+ * @param dev Pointer to one of the devices of the wire.
+ * @param params Impairments to apply.
+ * @return 0 on success, -1 on invalid parameters.
+ */
+extern int impair_set_params(struct network_device *dev, const struct impair_params *params);
+
+#endif
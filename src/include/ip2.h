@@ -60,6 +60,19 @@ struct IP_INTERFACE
 };
 
 
+/**
+ * @struct ip_batch
+ * @brief Batch of received packets of one upper protocol, with the addresses of each.
+ */
+struct ip_batch
+{
+    unsigned int num;                            /**< Number of packets */
+    struct pktbuf *pbs[PKTBUF_VEC_MAX];          /**< Packet buffers, positioned at the upper protocol header */
+    IPAddress src[PKTBUF_VEC_MAX];               /**< Source address of each packet */
+    IPAddress dst[PKTBUF_VEC_MAX];               /**< Destination address of each packet */
+    struct IP_INTERFACE *iface[PKTBUF_VEC_MAX];  /**< Receiving interface of each packet */
+};
+
 extern const IPAddress IP_ADDR_ANY ;       /**< Constant representing any IP address */
 extern const IPAddress IP_BROADCAST; /**< Constant representing the broadcast IP address */
 
@@ -144,27 +157,62 @@ extern int ip_register_interface(struct network_device *dev, struct IP_INTERFACE
  */
 extern struct IP_INTERFACE *ip_select_interface(IPAddress addr);
 
+/**
+ * @brief Returns the headroom to reserve in front of an IP payload sent to the given destination.
+ *
+ * The headroom covers the IP header and the link-layer header of the outgoing device.
+ *
+ * @param dst Destination IP address.
+ * @return Number of bytes to reserve in front of the payload.
+ */
+extern size_t ip_headroom(IPAddress dst);
+
+/**
+ * @brief Returns the device packets to the given destination are sent on.
+ *
+ * @param dst Destination IP address.
+ * @return Pointer to the outgoing device, or NULL if there is no route.
+ */
+extern struct network_device *ip_route_device(IPAddress dst);
+
 /**
  * @brief Sends an IP packet.
  *
+ * The IP header is prepended to the packet buffer in place, so the buffer must
+ * have been allocated with at least ip_headroom(dst) bytes of headroom.
+ * A UDP super-packet (pktbuf::gso_size set) may exceed the MTU of the device,
+ * which cuts it into datagrams.
+ *
  * @param protocol IP protocol number.
- * @param data Pointer to the data to be sent.
- * @param len Length of the data.
+ * @param pb Pointer to the packet buffer holding the IP payload.
  * @param src Source IP address.
  * @param dst Destination IP address.
- * @return Number of bytes sent on success, -1 on failure.
+ * @return Number of payload bytes sent on success, -1 on failure.
  */
-extern ssize_t ip_send_packet(uint8_t protocol, const uint8_t *data, size_t len, IPAddress src, IPAddress dst);
+extern ssize_t ip_send_packet(uint8_t protocol, struct pktbuf *pb, IPAddress src, IPAddress dst);
 
 /**
  * @brief Registers a handler function for a specific IP protocol.
  *
  * @param name Name of the IP protocol.
  * @param type IP protocol number.
- * @param handler Pointer to the handler function.
+ * @param handler Pointer to the handler function, called with a borrowed reference to
+ *                the packet buffer positioned at the IP payload.
  * @return 0 on success, -1 on failure.
  */
-extern int ip_register_protocol(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, IPAddress src, IPAddress dst, struct IP_INTERFACE *iface));
+extern int ip_register_protocol(const char *name, uint8_t type, void (*handler)(struct pktbuf *pb, IPAddress src, IPAddress dst, struct IP_INTERFACE *iface));
+
+/**
+ * @brief Sets a batch handler for a registered IP protocol.
+ *
+ * The batch handler is called once with all packets of the protocol in a
+ * received batch, instead of calling the per-packet handler for each.
+ *
+ * @param type IP protocol number.
+ * @param handler Function pointer to the batch handler, called with borrowed references.
+ * @return 0 on success, -1 if the protocol is not registered.
+ */
+extern int ip_set_protocol_batch_handler(uint8_t type, void (*handler)(struct ip_batch *batch));
 
 /**
  * @brief Retrieves the name of an IP protocol based on its number.
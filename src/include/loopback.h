@@ -3,6 +3,27 @@
 
 #include "net2.h"
 
+/**
+ * @brief Number of transmitted packets the loopback interface queues before it drops.
+ */
+#define LOOPBACK_QUEUE_SIZE 1024
+
+/**
+ * @brief Initialize the loopback interface.
+ *
+ * Transmitted packets are queued on a lock-free ring and handed up by the
+ * interrupt thread in batches, instead of on the sender's call stack.
+ *
+ * @return Pointer to the network device, or NULL on failure.
+ */
 extern struct network_device * loopback_init(void);
 
-#endif
\ No newline at end of file
+/**
+ * @brief Skip checksum generation and verification on the loopback interface.
+ * @param dev Pointer to the loopback network device.
+ * @param enable 1 to skip the checksums, 0 to compute them as on any device.
+ * @return 0 on success.
+ */
+extern int loopback_set_csum_skip(struct network_device *dev, int enable);
+
+#endif
@@ -0,0 +1,100 @@
+/**
+ * @file mempool.h
+ * @brief Fixed-size object pools used on the packet hot path instead of calloc().
+ *
+ * A pool hands out objects of one size from slabs allocated on demand, up to a
+ * fixed capacity, so memory stays bounded under bursts. Each thread keeps a
+ * small cache of free objects per pool, so most allocations and frees do not
+ * touch the pool lock; the cache goes back to the pool when the thread exits.
+ * Objects are not zeroed.
+ *
+ * Pools are defined statically with MEMPOOL_INITIALIZER and need no setup call.
+ */
+
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "handler.h"
+
+/**
+ * @brief Maximum number of pools that get a per-thread cache.
+ */
+#define MEMPOOL_MAX 16
+
+/**
+ * @brief Number of free objects each thread may cache per pool.
+ */
+#define MEMPOOL_CACHE_SIZE 32
+
+/**
+ * @brief Number of objects allocated at once when a pool grows.
+ */
+#define MEMPOOL_SLAB_OBJS 64
+
+/**
+ * @struct mempool
+ * @brief Pool of fixed-size objects.
+ */
+struct mempool
+{
+    struct mempool *next; /**< Next pool in the registry of pools in use. */
+    const char *name; /**< Name of the pool, used in statistics. */
+    size_t objsize; /**< Size of each object. */
+    unsigned int capacity; /**< Maximum number of objects the pool may create. */
+    int id; /**< Per-thread cache slot, assigned on first use (0 = unassigned). */
+    mutex_t mutex; /**< Protects the shared free list and the slab growth. */
+    void *free; /**< Shared free list. */
+    unsigned int created; /**< Number of objects created so far. */
+    unsigned int in_use; /**< Number of objects currently handed out. */
+    unsigned int high_water; /**< Highest value in_use has reached. */
+    unsigned long allocs; /**< Number of successful allocations. */
+    unsigned long failures; /**< Number of allocations refused because the pool was exhausted. */
+};
+
+#define MEMPOOL_INITIALIZER(n, size, cap) { .name = (n), .objsize = (size), .capacity = (cap), .mutex = MUTEX_INITIALIZER }
+
+/**
+ * @struct mempool_stats
+ * @brief Snapshot of the statistics of a pool.
+ */
+struct mempool_stats
+{
+    size_t objsize; /**< Size of each object. */
+    unsigned int capacity; /**< Maximum number of objects. */
+    unsigned int created; /**< Number of objects created so far. */
+    unsigned int in_use; /**< Number of objects currently handed out. */
+    unsigned int high_water; /**< Highest number of objects handed out at once. */
+    unsigned long allocs; /**< Number of successful allocations. */
+    unsigned long failures; /**< Number of allocations refused because the pool was exhausted. */
+};
+
+/**
+ * @brief Allocates an object from a pool.
+ * @param pool Pointer to the pool.
+ * @return Pointer to the (uninitialized) object, or NULL if the pool is exhausted.
+ */
+extern void *mempool_alloc(struct mempool *pool);
+
+/**
+ * @brief Returns an object to the pool it was allocated from.
+ * @param pool Pointer to the pool.
+ * @param obj Pointer to the object.
+ */
+extern void mempool_free(struct mempool *pool, void *obj);
+
+/**
+ * @brief Takes a snapshot of the statistics of a pool.
+ * @param pool Pointer to the pool.
+ * @param stats Pointer to store the statistics.
+ */
+extern void mempool_get_stats(struct mempool *pool, struct mempool_stats *stats);
+
+/**
+ * @brief Logs the statistics of every pool that has been used.
+ */
+extern void mempool_dump(void);
+
+#endif
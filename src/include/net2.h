@@ -11,6 +11,8 @@
 #include <sys/time.h>
 #include <signal.h>
 
+#include "pktbuf.h"
+
 #ifndef IFNAMSIZ
 #define IFNAMSIZ 16
 #endif
@@ -30,6 +32,20 @@
 #define NETWORK_DEVICE_FLAG_BROADCAST 0x0020
 #define NETWORK_DEVICE_FLAG_P2P 0x0040
 #define NETWORK_DEVICE_FLAG_NEED_ARP 0x0100
+#define NETWORK_DEVICE_FLAG_RUN_TO_COMPLETION 0x0200 /**< Frames received on the interrupt thread are handled inline, see network_input_handler(). */
+#define NETWORK_DEVICE_FLAG_TX_CSUM 0x0400 /**< The device completes partial transport checksums, see PKTBUF_FLAG_CSUM_PARTIAL. */
+#define NETWORK_DEVICE_FLAG_TX_GSO_UDP 0x0800 /**< The device cuts UDP super-packets into MTU-sized datagrams, see pktbuf::gso_size. */
+#define NETWORK_DEVICE_FLAG_NO_CSUM 0x1000 /**< Packets never leave memory, so IP header checksums are not generated and no checksum is verified. */
+
+/**
+ * @brief Maximum length of a UDP super-packet handed to a NETWORK_DEVICE_FLAG_TX_GSO_UDP device.
+ */
+#define NETWORK_GSO_MAX_SIZE 65535
+
+/**
+ * @brief Maximum nesting of inline protocol handler calls in run-to-completion mode.
+ */
+#define NETWORK_INLINE_DEPTH_MAX 4
 
 #define NETWORK_DEVICE_ADDR_LEN 16
 
@@ -57,6 +73,16 @@
 
 #define NETWORK_IRQ_SHARED 0x0001
 
+/**
+ * @brief Default number of frames a device may consume per poll round.
+ */
+#define NETWORK_POLL_BUDGET_DEFAULT 64
+
+/**
+ * @brief Default number of frames a device with a flush operation queues before it is flushed.
+ */
+#define NETWORK_TX_BATCH_DEFAULT 32
+
 /**
  * @struct network_interface
  * @brief Network interface structure.
@@ -76,8 +102,9 @@ struct network_device_operations
 {
     int (*open)(struct network_device *dev); /**< Function pointer to open the network device. */
     int (*close)(struct network_device *dev); /**< Function pointer to close the network device. */
-    int (*transmit)(struct network_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst); /**< Function pointer to transmit data through the network device. */
-    int (*poll)(struct network_device *dev); /**< Function pointer to poll the network device for incoming data. */
+    int (*transmit)(struct network_device *dev, uint16_t type, struct pktbuf *pb, const void *dst); /**< Function pointer to transmit a packet buffer through the network device. */
+    int (*poll)(struct network_device *dev, int budget); /**< Function pointer to consume up to budget received frames; returns the number consumed, less than budget once drained (the driver then re-enables its IRQ). */
+    int (*flush)(struct network_device *dev); /**< Function pointer to hand the frames queued by transmit to the device at once (optional), see network_device_tx_pending(). */
 };
 
 /**
@@ -103,6 +130,13 @@ struct network_device
     };
     struct network_device_operations *ops; /**< Pointer to the network device operations. */
     void *priv; /**< Pointer to private data associated with the network device. */
+    unsigned int poll_budget; /**< Frames consumed per poll round (0 = NETWORK_POLL_BUDGET_DEFAULT). */
+    int poll_scheduled; /**< Set while the device is on the poll list. */
+    struct network_device *poll_next; /**< Next device on the poll list. */
+    unsigned long poll_rounds; /**< Number of poll rounds run. */
+    unsigned long poll_exhausted; /**< Number of poll rounds that used up the whole budget. */
+    unsigned int tx_batch; /**< Frames queued before a flush is forced (0 = NETWORK_TX_BATCH_DEFAULT, 1 = transmit right away). */
+    int tx_pending; /**< Set while transmitted frames wait for the next flush. */
 };
 
 /**
@@ -136,34 +170,109 @@ extern int network_device_add_interface(struct network_device *dev, struct netwo
 extern struct network_interface *network_device_get_interface(struct network_device *dev, int family);
 
 /**
- * @brief Output data through a network device.
+ * @brief Output a packet buffer through a network device.
+ *
+ * The packet buffer must have at least dev->header_len bytes of headroom so the
+ * driver can prepend its link-layer header in place.
+ *
  * @param dev Pointer to the network device.
  * @param type Type of the protocol.
- * @param data Pointer to the data to transmit.
- * @param len Length of the data.
+ * @param pb Pointer to the packet buffer, positioned at the protocol header.
  * @param dst Destination address.
  * @return 0 on success, -1 on failure.
  */
-extern int network_device_output(struct network_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
+extern int network_device_output(struct network_device *dev, uint16_t type, struct pktbuf *pb, const void *dst);
+
+/**
+ * @brief Schedule a device for polling, NAPI-style.
+ *
+ * Called from a device ISR on the interrupt thread after it has disabled its
+ * IRQ. The device's poll operation is then called once per round, in
+ * round-robin order with the other scheduled devices, until it is drained.
+ *
+ * @param dev Pointer to the network device.
+ */
+extern void network_device_schedule_poll(struct network_device *dev);
+
+/**
+ * @brief Run one poll round over the scheduled devices.
+ * @return 1 if devices remain scheduled, 0 if all of them are drained.
+ */
+extern int network_device_poll_handler(void);
+
+/**
+ * @brief Flag a device as holding queued transmit frames.
+ *
+ * Called by a driver when its transmit operation queued a frame instead of
+ * sending it. The frames are then handed to the device with a single flush
+ * operation at the end of the softirq on the interrupt thread, which is
+ * raised if the caller is another thread.
+ *
+ * @param dev Pointer to the network device.
+ */
+extern void network_device_tx_pending(struct network_device *dev);
+
+/**
+ * @brief Flush every device holding queued transmit frames, called by the interrupt thread.
+ */
+extern void network_device_flush_handler(void);
 
 /**
  * @brief Network input handler.
+ *
+ * Queues the packet buffer for the registered protocol without copying it.
+ * The caller keeps its own reference and must release it after the call.
+ * Safe to call from any thread; the input queue is a bounded lock-free ring
+ * drained by the softirq, and the packet is dropped when it is full.
+ *
+ * On a device flagged NETWORK_DEVICE_FLAG_RUN_TO_COMPLETION, a packet received
+ * on the interrupt thread is instead passed to the protocol handler directly,
+ * unless the protocol queue still holds earlier packets or the inline calls
+ * are already nested NETWORK_INLINE_DEPTH_MAX deep (e.g. loopback replies).
+ *
  * @param type Type of the protocol.
- * @param data Pointer to the received data.
- * @param len Length of the received data.
+ * @param pb Pointer to the received packet buffer, positioned at the protocol header.
  * @param dev Pointer to the network device.
- * @return 0 on success, -1 on failure.
+ * @return 0 on success, -1 on failure (including a full input queue).
  */
-extern int network_input_handler(uint16_t type, const uint8_t *data, size_t len, struct network_device *dev);
+extern int network_input_handler(uint16_t type, struct pktbuf *pb, struct network_device *dev);
+
+/**
+ * @brief Network input handler for a batch of packets of the same protocol.
+ *
+ * Same as network_input_handler() for each packet, but the packets are handed
+ * to the protocol's batch handler (if any) together and a single softirq is
+ * raised for the whole batch.
+ *
+ * @param type Type of the protocol.
+ * @param pbs Array of received packet buffers, positioned at the protocol header.
+ * @param num Number of packet buffers, at most PKTBUF_VEC_MAX.
+ * @param dev Pointer to the network device.
+ * @return 0 on success, -1 if some packets were dropped.
+ */
+extern int network_input_batch(uint16_t type, struct pktbuf **pbs, unsigned int num, struct network_device *dev);
 
 /**
  * @brief Register a network protocol.
  * @param name Name of the protocol.
  * @param type Type of the protocol.
- * @param handler Function pointer to the protocol handler.
+ * @param handler Function pointer to the protocol handler, called with a borrowed reference to the packet buffer.
  * @return 0 on success, -1 on failure.
  */
-extern int network_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct network_device *dev));
+extern int network_protocol_register(const char *name, uint16_t type, void (*handler)(struct pktbuf *pb, struct network_device *dev));
+
+/**
+ * @brief Set a batch handler for a registered network protocol.
+ *
+ * The batch handler is called once with up to PKTBUF_VEC_MAX packets instead
+ * of calling the per-packet handler for each of them. Each packet buffer's dev
+ * member tells the device it was received on.
+ *
+ * @param type Type of the protocol.
+ * @param handler Function pointer to the batch handler, called with borrowed references.
+ * @return 0 on success, -1 if the protocol is not registered.
+ */
+extern int network_protocol_set_batch_handler(uint16_t type, void (*handler)(struct pktbuf **pbs, unsigned int num));
 
 /**
  * @brief Get the name of a network protocol.
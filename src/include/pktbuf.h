@@ -0,0 +1,267 @@
+/**
+ * @file pktbuf.h
+ * @brief Reference-counted packet buffer shared by every layer of the network stack.
+ *
+ * A packet buffer is filled once by the device driver and then handed up
+ * through the protocol layers without copying. Each layer strips its own
+ * header by advancing the head offset, and any layer that needs to keep the
+ * packet beyond the current call takes an extra reference.
+ *
+ * On transmit, the buffer is allocated with enough headroom for every header
+ * below the sending layer. Each layer then prepends its header in place with
+ * pktbuf_push(), so the driver receives the finished frame without copying.
+ *
+ * A transmitted buffer may additionally reference a chain of payload fragments
+ * owned by the sender (scatter-gather). The fragments follow the linear data,
+ * are only valid for the duration of the send call, and are gathered by the
+ * driver's writev()/sendmsg(). Anything that keeps such a buffer past the call
+ * must use pktbuf_linearize().
+ *
+ * Checksum offload: a received buffer flagged PKTBUF_FLAG_CSUM_VALID has had its
+ * checksums verified by the device, so the protocol layers skip verifying them.
+ * A transmitted buffer flagged PKTBUF_FLAG_CSUM_PARTIAL carries only the
+ * pseudo-header sum in its transport checksum field; the device completes it,
+ * or network_device_output() does so with pktbuf_csum_finish() when the device
+ * cannot.
+ *
+ * A received buffer may also wrap memory owned by the driver, such as a slot
+ * of a receive ring shared with the kernel (see pktbuf_alloc_ext()). Its
+ * storage goes back to the driver when the last reference is dropped, so such
+ * buffers are only ever read and stripped, never grown. When the driver
+ * needs that storage back to keep receiving, it flags the buffer
+ * PKTBUF_FLAG_PINNED, and layers queueing it for the application keep
+ * pktbuf_unpin()'s copy instead.
+ *
+ * Ownership convention: a function receiving a packet buffer borrows the
+ * caller's reference. Callees that queue or otherwise retain the buffer must
+ * take their own reference with pktbuf_ref(), and the caller always drops its
+ * reference with pktbuf_release() once the call returns.
+ */
+
+#ifndef PKTBUF_H
+#define PKTBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/**
+ * @brief Maximum number of payload fragments a packet buffer can reference.
+ */
+#define PKTBUF_FRAG_MAX 16
+
+/**
+ * @brief Maximum number of packet buffers processed together as one batch (vector) on the input path.
+ */
+#define PKTBUF_VEC_MAX 256
+
+/**
+ * @brief Storage size of pooled packet buffers, enough for a full Ethernet frame plus headroom.
+ */
+#define PKTBUF_POOL_DATA_SIZE 2048
+
+/**
+ * @brief Maximum number of pooled packet buffers.
+ */
+#define PKTBUF_POOL_CAPACITY 4096
+
+/**
+ * @brief Packet buffer flags.
+ */
+#define PKTBUF_FLAG_CSUM_VALID 0x0001 /**< Received: checksums were verified by the device. */
+#define PKTBUF_FLAG_CSUM_PARTIAL 0x0002 /**< Transmitted: the transport checksum is to be completed from csum_start on. */
+#define PKTBUF_FLAG_PINNED 0x0004 /**< Received: wraps driver storage that must not be held beyond the input path. */
+
+struct network_device;
+struct mempool;
+
+/**
+ * @struct pktbuf
+ * @brief Packet buffer with head/tail offsets into a single storage area.
+ */
+struct pktbuf
+{
+    uint8_t *data; /**< Start of the buffer storage. */
+    size_t size; /**< Capacity of the buffer storage. */
+    size_t head; /**< Offset of the first valid byte. */
+    size_t tail; /**< Offset one past the last valid byte. */
+    int refcnt; /**< Reference count, the buffer is freed when it drops to zero. */
+    struct network_device *dev; /**< Device the packet was received on. */
+    struct mempool *pool; /**< Pool the buffer was allocated from, or NULL if it came from malloc(). */
+    const struct iovec *frags; /**< Payload fragments following the linear data, or NULL. */
+    int nfrags; /**< Number of payload fragments. */
+    size_t fraglen; /**< Total length of the payload fragments. */
+    uint16_t flags; /**< PKTBUF_FLAG_* */
+    uint16_t csum_start; /**< Storage offset the partial checksum covers from (the transport header). */
+    uint16_t csum_offset; /**< Offset of the checksum field from csum_start. */
+    uint16_t gso_size; /**< Payload size of each datagram the device cuts the packet into, 0 for a single datagram. */
+    uint16_t protocol; /**< Protocol type (NETWORK_PROTOCOL_TYPE_*), kept by devices that queue packets before input. */
+    void (*ext_release)(void *arg); /**< Gives external storage back to its owner, or NULL for own storage. */
+    void *ext_arg; /**< Argument of ext_release. */
+};
+
+/**
+ * @brief Allocate a packet buffer with the given storage capacity.
+ *
+ * Buffers of up to PKTBUF_POOL_DATA_SIZE bytes come from a fixed-size pool,
+ * larger ones (e.g. loopback datagrams) from malloc().
+ *
+ * @param size Capacity of the buffer storage in bytes.
+ * @return Pointer to the packet buffer holding one reference, or NULL on failure.
+ */
+extern struct pktbuf *pktbuf_alloc(size_t size);
+
+/**
+ * @brief Wrap memory owned by someone else in a packet buffer without copying it.
+ *
+ * The whole area is valid data, there is no headroom or tailroom. The memory
+ * must stay valid until release is called, which happens once the last
+ * reference to the buffer is dropped, on whichever thread drops it.
+ *
+ * @param data Start of the memory.
+ * @param len Length of the memory.
+ * @param release Function giving the memory back to its owner.
+ * @param arg Argument passed to release.
+ * @return Pointer to the packet buffer holding one reference, or NULL on failure.
+ */
+extern struct pktbuf *pktbuf_alloc_ext(uint8_t *data, size_t len, void (*release)(void *arg), void *arg);
+
+/**
+ * @brief Take an additional reference to a packet buffer.
+ * @param pb Pointer to the packet buffer.
+ * @return The same packet buffer.
+ */
+extern struct pktbuf *pktbuf_ref(struct pktbuf *pb);
+
+/**
+ * @brief Drop a reference to a packet buffer, freeing it when no references remain.
+ * @param pb Pointer to the packet buffer.
+ */
+extern void pktbuf_release(struct pktbuf *pb);
+
+/**
+ * @brief Reserve headroom in an empty packet buffer for headers prepended later.
+ * @param pb Pointer to the packet buffer.
+ * @param len Number of bytes to reserve in front of the data.
+ * @return 0 on success, -1 if the buffer is not empty or too small.
+ */
+extern int pktbuf_reserve(struct pktbuf *pb, size_t len);
+
+/**
+ * @brief Prepend bytes in front of the valid data (e.g. a protocol header).
+ * @param pb Pointer to the packet buffer.
+ * @param len Number of bytes to prepend.
+ * @return Pointer to the new start of the data, or NULL if there is not enough headroom.
+ */
+extern uint8_t *pktbuf_push(struct pktbuf *pb, size_t len);
+
+/**
+ * @brief Extend the valid data at the tail of the buffer.
+ * @param pb Pointer to the packet buffer.
+ * @param len Number of bytes to append.
+ * @return Pointer to the first appended byte, or NULL if there is not enough tailroom.
+ */
+extern uint8_t *pktbuf_append(struct pktbuf *pb, size_t len);
+
+/**
+ * @brief Strip bytes from the front of the valid data (e.g. a consumed header).
+ * @param pb Pointer to the packet buffer.
+ * @param len Number of bytes to strip.
+ * @return Pointer to the new start of the data, or NULL if the buffer is too short.
+ */
+extern uint8_t *pktbuf_pull(struct pktbuf *pb, size_t len);
+
+/**
+ * @brief Shorten the valid data to the given length (e.g. to drop link-layer padding).
+ * @param pb Pointer to the packet buffer.
+ * @param len New length of the data.
+ * @return 0 on success, -1 if the buffer is shorter than len.
+ */
+extern int pktbuf_trim(struct pktbuf *pb, size_t len);
+
+/**
+ * @brief Attach sender-owned payload fragments after the linear data.
+ * @param pb Pointer to the packet buffer.
+ * @param iov Array of fragments, which must stay valid until the buffer is transmitted.
+ * @param iovcnt Number of fragments, at most PKTBUF_FRAG_MAX.
+ * @return 0 on success, -1 if there are too many fragments.
+ */
+extern int pktbuf_attach_frags(struct pktbuf *pb, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Get a packet buffer holding the linear data and all fragments contiguously.
+ *
+ * Buffers without fragments are returned as is with an additional reference.
+ *
+ * @param pb Pointer to the packet buffer.
+ * @return Pointer to a packet buffer holding one reference, or NULL on failure.
+ */
+extern struct pktbuf *pktbuf_linearize(struct pktbuf *pb);
+
+/**
+ * @brief Get a packet buffer that may be held for an unbounded time.
+ *
+ * @param pb Pointer to the packet buffer.
+ * @return A new reference to @p pb, or a copy if it is flagged
+ *         PKTBUF_FLAG_PINNED, or NULL on allocation failure.
+ */
+extern struct pktbuf *pktbuf_unpin(struct pktbuf *pb);
+
+/**
+ * @brief Leave the transport checksum of an outgoing packet to the device.
+ *
+ * The checksum field must already hold the folded pseudo-header sum.
+ *
+ * @param pb Pointer to the packet buffer.
+ * @param start Start of the transport header, inside the linear data.
+ * @param offset Offset of the checksum field from the start of the transport header.
+ */
+extern void pktbuf_csum_partial(struct pktbuf *pb, const uint8_t *start, uint16_t offset);
+
+/**
+ * @brief Complete a partial transport checksum in software.
+ * @param pb Pointer to the packet buffer flagged PKTBUF_FLAG_CSUM_PARTIAL.
+ */
+extern void pktbuf_csum_finish(struct pktbuf *pb);
+
+/**
+ * @brief Get a pointer to the first valid byte of the packet buffer.
+ */
+static inline uint8_t *pktbuf_data(const struct pktbuf *pb)
+{
+    return pb->data + pb->head;
+}
+
+/**
+ * @brief Get the length of the valid data in the packet buffer.
+ */
+static inline size_t pktbuf_len(const struct pktbuf *pb)
+{
+    return pb->tail - pb->head;
+}
+
+/**
+ * @brief Get the length of the linear data plus any attached payload fragments.
+ */
+static inline size_t pktbuf_total_len(const struct pktbuf *pb)
+{
+    return pktbuf_len(pb) + pb->fraglen;
+}
+
+/**
+ * @brief Get the number of bytes that can still be prepended to the packet buffer.
+ */
+static inline size_t pktbuf_headroom(const struct pktbuf *pb)
+{
+    return pb->head;
+}
+
+/**
+ * @brief Get the number of bytes that can still be appended to the packet buffer.
+ */
+static inline size_t pktbuf_tailroom(const struct pktbuf *pb)
+{
+    return pb->size - pb->tail;
+}
+
+#endif
@@ -0,0 +1,145 @@
+/**
+ * @file ring.h
+ * @brief Bounded lock-free rings of pointers.
+ *
+ * The MPSC ring lets any number of threads enqueue concurrently while exactly
+ * one thread dequeues. Every slot carries a sequence number that tells
+ * producers whether the slot is free and tells the consumer whether it has
+ * been published, so neither side takes a lock.
+ *
+ * The SPSC ring is the cheaper variant for exactly one producer thread and one
+ * consumer thread: each side owns one index and only reads the other's.
+ *
+ * A full ring refuses the enqueue and counts a drop instead of growing.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+
+/**
+ * @struct mpsc_ring_slot
+ * @brief Slot of an MPSC ring.
+ */
+struct mpsc_ring_slot
+{
+    unsigned long seq; /**< Sequence number telling who may use the slot next. */
+    void *data; /**< Stored pointer. */
+};
+
+/**
+ * @struct mpsc_ring
+ * @brief Bounded MPSC ring.
+ */
+struct mpsc_ring
+{
+    struct mpsc_ring_slot *slots; /**< Array of slots. */
+    unsigned int size; /**< Number of slots, a power of two. */
+    unsigned long head __attribute__((aligned(64))); /**< Next position to enqueue, shared by the producers. */
+    unsigned long drops; /**< Number of enqueues refused because the ring was full. */
+    unsigned long tail __attribute__((aligned(64))); /**< Next position to dequeue, owned by the consumer. */
+};
+
+/**
+ * @brief Initialize an MPSC ring.
+ * @param ring Pointer to the ring.
+ * @param size Number of slots, rounded up to a power of two.
+ * @return 0 on success, -1 on failure.
+ */
+extern int mpsc_ring_init(struct mpsc_ring *ring, unsigned int size);
+
+/**
+ * @brief Free the slots of an MPSC ring. The ring must be empty and idle.
+ * @param ring Pointer to the ring.
+ */
+extern void mpsc_ring_destroy(struct mpsc_ring *ring);
+
+/**
+ * @brief Enqueue a pointer. May be called from any thread.
+ * @param ring Pointer to the ring.
+ * @param data Pointer to store.
+ * @return 0 on success, -1 if the ring is full.
+ */
+extern int mpsc_ring_enqueue(struct mpsc_ring *ring, void *data);
+
+/**
+ * @brief Dequeue up to max pointers. Must only be called from the consumer thread.
+ * @param ring Pointer to the ring.
+ * @param objs Array to store the dequeued pointers.
+ * @param max Size of the array.
+ * @return Number of pointers dequeued.
+ */
+extern unsigned int mpsc_ring_dequeue_batch(struct mpsc_ring *ring, void **objs, unsigned int max);
+
+/**
+ * @brief Get the approximate number of pointers in the ring.
+ * @param ring Pointer to the ring.
+ * @return Number of pointers in the ring.
+ */
+extern unsigned int mpsc_ring_count(struct mpsc_ring *ring);
+
+/**
+ * @brief Get the number of enqueues refused because the ring was full.
+ * @param ring Pointer to the ring.
+ * @return Number of drops.
+ */
+extern unsigned long mpsc_ring_drops(struct mpsc_ring *ring);
+
+/**
+ * @struct spsc_ring
+ * @brief Bounded SPSC ring.
+ */
+struct spsc_ring
+{
+    void **slots; /**< Array of slots. */
+    unsigned int size; /**< Number of slots, a power of two. */
+    unsigned long head __attribute__((aligned(64))); /**< Next position to enqueue, owned by the producer. */
+    unsigned long drops; /**< Number of enqueues refused because the ring was full. */
+    unsigned long tail __attribute__((aligned(64))); /**< Next position to dequeue, owned by the consumer. */
+};
+
+/**
+ * @brief Initialize an SPSC ring.
+ * @param ring Pointer to the ring.
+ * @param size Number of slots, rounded up to a power of two.
+ * @return 0 on success, -1 on failure.
+ */
+extern int spsc_ring_init(struct spsc_ring *ring, unsigned int size);
+
+/**
+ * @brief Free the slots of an SPSC ring. The ring must be empty and idle.
+ * @param ring Pointer to the ring.
+ */
+extern void spsc_ring_destroy(struct spsc_ring *ring);
+
+/**
+ * @brief Enqueue a pointer. Must only be called from the producer thread.
+ * @param ring Pointer to the ring.
+ * @param data Pointer to store.
+ * @return 0 on success, -1 if the ring is full.
+ */
+extern int spsc_ring_enqueue(struct spsc_ring *ring, void *data);
+
+/**
+ * @brief Dequeue a pointer. Must only be called from the consumer thread.
+ * @param ring Pointer to the ring.
+ * @return The dequeued pointer, or NULL if the ring is empty.
+ */
+extern void *spsc_ring_dequeue(struct spsc_ring *ring);
+
+/**
+ * @brief Get the approximate number of pointers in the ring.
+ * @param ring Pointer to the ring.
+ * @return Number of pointers in the ring.
+ */
+extern unsigned int spsc_ring_count(struct spsc_ring *ring);
+
+/**
+ * @brief Get the number of enqueues refused because the ring was full.
+ * @param ring Pointer to the ring.
+ * @return Number of drops.
+ */
+extern unsigned long spsc_ring_drops(struct spsc_ring *ring);
+
+#endif
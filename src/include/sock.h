@@ -3,8 +3,10 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include "ip2.h"
+#include "udp.h"
 
 #define PF_UNSPEC   0
 #define PF_LOCAL    1
@@ -33,6 +35,12 @@ struct sock {
     int desc;
 };
 
+struct sock_loan {
+    const void *data; /* read-only view of the received datagram */
+    size_t len;
+    struct udp_loan udp;
+};
+
 struct sockaddr {
     unsigned short sa_family;
     char sa_data[14];
@@ -52,7 +60,10 @@ extern char *sockaddr_ntop(const struct sockaddr *n, char *p, size_t size);
 extern int sock_open(int domain, int type, int protocol);
 extern int sock_close(int id);
 extern ssize_t sock_recvfrom(int id, void *buf, size_t n, struct sockaddr *addr, int *addrlen);
+extern ssize_t sock_recvfrom_loan(int id, struct sock_loan *loan, struct sockaddr *addr, int *addrlen);
+extern void sock_loan_release(struct sock_loan *loan);
 extern ssize_t sock_sendto(int id, const void *buf, size_t n, const struct sockaddr *addr, int addrlen);
+extern ssize_t sock_sendmsg(int id, const struct iovec *iov, int iovcnt, const struct sockaddr *addr, int addrlen);
 extern int sock_bind(int id, const struct sockaddr *addr, int addrlen);
 extern int sock_listen(int id, int backlog);
 extern int sock_accept(int id, struct sockaddr *addr, int *addrlen);
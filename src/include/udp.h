@@ -13,8 +13,24 @@
 
 #include <stddef.h> /* size_t */
 #include <stdint.h> /* uint8_t */
+#include <sys/uio.h> /* struct iovec */
 
 #include "ip2.h"
+#include "pktbuf.h"
+
+/**
+ * @struct udp_loan
+ * @brief Read-only view of a received datagram lent to the application
+ *
+ * The view stays valid until it is returned with udp_loan_release().
+ */
+struct udp_loan
+{
+    const uint8_t *data;        /**< Datagram payload */
+    size_t len;                 /**< Length of the payload */
+    struct IP_ENDPOINT foreign; /**< Source IP endpoint */
+    struct pktbuf *pb;          /**< Packet buffer backing the view (internal) */
+};
 
 /**
  * @brief Output a UDP packet over the network
@@ -31,6 +47,49 @@
 extern ssize_t udp_output(struct IP_ENDPOINT *src, struct IP_ENDPOINT *dst,
                           const uint8_t *buf, size_t len);
 
+/**
+ * @brief Output a UDP packet whose payload is gathered from several buffers
+ *
+ * This function sends a UDP packet without flattening the payload. The
+ * fragments are referenced by the packet buffer and gathered by the device
+ * driver, so they only need to stay valid until the call returns.
+ *
+ * @param src Source IP endpoint
+ * @param dst Destination IP endpoint
+ * @param iov Array of payload fragments
+ * @param iovcnt Number of payload fragments (at most PKTBUF_FRAG_MAX)
+ * @return Number of bytes sent on success, negative on failure
+ */
+extern ssize_t udp_outputv(struct IP_ENDPOINT *src, struct IP_ENDPOINT *dst,
+                           const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Set the segment size of datagrams sent on a UDP socket
+ *
+ * With a segment size set, a send of more payload than that is cut into
+ * datagrams of that size (the last one may be shorter), like UDP_SEGMENT. If
+ * the outgoing device segments UDP, the payload is handed to it as a single
+ * super-packet, otherwise it is cut in software.
+ *
+ * @param id ID of the UDP socket
+ * @param size Payload size of each datagram, 0 to send every call as one datagram
+ * @return 0 on success, negative on failure
+ */
+extern int udp_set_gso_size(int id, uint16_t size);
+
+/**
+ * @brief Set how long receivers of a UDP socket spin before sleeping
+ *
+ * A receiver finding no datagram polls for a wakeup that many times before
+ * parking in the kernel, which saves a context switch when datagrams arrive
+ * back to back, at the cost of burning CPU while waiting.
+ *
+ * @param id ID of the UDP socket
+ * @param spin Number of polls before sleeping, 0 to sleep at once
+ * @return 0 on success, negative on failure
+ */
+extern int udp_set_spin(int id, unsigned int spin);
+
 /**
  * @brief Initialize UDP subsystem
  *
@@ -75,6 +134,20 @@ extern int udp_bind(int index, struct IP_ENDPOINT *local);
  */
 extern ssize_t udp_sendto(int id, uint8_t *buf, size_t len, struct IP_ENDPOINT *foreign);
 
+/**
+ * @brief Send a UDP packet gathered from several buffers over a socket
+ *
+ * This function sends a UDP packet whose payload is the concatenation of the
+ * given fragments, without copying them into an intermediate buffer.
+ *
+ * @param id Socket descriptor
+ * @param iov Array of payload fragments
+ * @param iovcnt Number of payload fragments
+ * @param foreign Destination IP endpoint
+ * @return Number of bytes sent on success, negative on failure
+ */
+extern ssize_t udp_sendmsg(int id, const struct iovec *iov, int iovcnt, struct IP_ENDPOINT *foreign);
+
 /**
  * @brief Receive a UDP packet from a socket
  *
@@ -88,6 +161,26 @@ extern ssize_t udp_sendto(int id, uint8_t *buf, size_t len, struct IP_ENDPOINT *
  */
 extern ssize_t udp_recvfrom(int id, uint8_t *buf, size_t size, struct IP_ENDPOINT *foreign);
 
+/**
+ * @brief Receive a UDP packet from a socket without copying it
+ *
+ * This function blocks like udp_recvfrom(), but instead of copying the
+ * payload into a caller-supplied buffer it lends the queued datagram to the
+ * caller. The datagram is never truncated.
+ *
+ * @param id Socket descriptor
+ * @param loan Pointer to store the view of the received datagram
+ * @return Length of the datagram on success, negative on failure
+ */
+extern ssize_t udp_recvfrom_loan(int id, struct udp_loan *loan);
+
+/**
+ * @brief Return a datagram lent by udp_recvfrom_loan()
+ *
+ * @param loan Pointer to the loan to release, its view must not be used afterwards
+ */
+extern void udp_loan_release(struct udp_loan *loan);
+
 /**
  * @brief Close a UDP socket
  *
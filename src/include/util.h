@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #ifndef MAX
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
@@ -50,25 +51,12 @@
 extern int lprintf(FILE *fp, int level, const char *file, int line, const char *func, const char *fmt, ...);
 extern void hexdump(FILE *fp, const void *data, size_t size);
 
-struct queue_entry;
-
-struct queue_head {
-    struct queue_entry *head;
-    struct queue_entry *tail;
-    unsigned int num;
-};
-
-extern void queue_init(struct queue_head *queue);
-extern void *queue_push(struct queue_head *queue, void *data);
-extern void *queue_pop(struct queue_head *queue);
-extern void * queue_peek(struct queue_head *queue);
-extern void queue_foreach(struct queue_head *queue, void (*func)(void *arg, void *data), void *arg);
-
 extern uint16_t hton16(uint16_t h);
 extern uint16_t ntoh16(uint16_t n);
 extern uint32_t hton32(uint32_t h);
 extern uint32_t ntoh32(uint32_t n);
 
 extern uint16_t cksum16(uint16_t *addr, uint16_t count, uint32_t init);
+extern uint16_t cksum16v(const struct iovec *iov, int iovcnt, uint32_t init);
 
 #endif
\ No newline at end of file
@@ -181,44 +181,68 @@ arp_cache_delete(struct arp_cache *cache)
 static int
 arp_request(struct network_interface *iface, IPAddress tpa)
 {
-    struct arp_ether request;
-
-    request.hdr.hrd = hton16(ARP_HRD_ETHER);
-    request.hdr.pro = hton16(ARP_PRO_IP);
-    request.hdr.hln = ETHER_ADDR_LEN;
-    request.hdr.pln = IP_ADDRESS_LENGTH;
-    request.hdr.op = hton16(ARP_OP_REQUEST);
-    memcpy(request.sha, iface->dev->address, ETHER_ADDR_LEN);
-    memcpy(request.spa, &((struct IP_INTERFACE *)iface)->unicast, IP_ADDRESS_LENGTH);
-    memset(request.tha, 0, ETHER_ADDR_LEN);
-    memcpy(request.tpa, &tpa, IP_ADDRESS_LENGTH);
-    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(request.hdr.op), ntoh16(request.hdr.op), sizeof(request));
-    arp_dump((uint8_t *)&request, sizeof(request));
-    return network_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&request, sizeof(request), iface->dev->broadcast);
+    struct pktbuf *pb;
+    struct arp_ether *request;
+    int ret;
+
+    pb = pktbuf_alloc(iface->dev->header_len + sizeof(*request));
+    if (!pb) {
+        errorf("pktbuf_alloc() failure");
+        return -1;
+    }
+    pktbuf_reserve(pb, iface->dev->header_len);
+    request = (struct arp_ether *)pktbuf_append(pb, sizeof(*request));
+    request->hdr.hrd = hton16(ARP_HRD_ETHER);
+    request->hdr.pro = hton16(ARP_PRO_IP);
+    request->hdr.hln = ETHER_ADDR_LEN;
+    request->hdr.pln = IP_ADDRESS_LENGTH;
+    request->hdr.op = hton16(ARP_OP_REQUEST);
+    memcpy(request->sha, iface->dev->address, ETHER_ADDR_LEN);
+    memcpy(request->spa, &((struct IP_INTERFACE *)iface)->unicast, IP_ADDRESS_LENGTH);
+    memset(request->tha, 0, ETHER_ADDR_LEN);
+    memcpy(request->tpa, &tpa, IP_ADDRESS_LENGTH);
+    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(request->hdr.op), ntoh16(request->hdr.op), sizeof(*request));
+    arp_dump((uint8_t *)request, sizeof(*request));
+    ret = network_device_output(iface->dev, ETHER_TYPE_ARP, pb, iface->dev->broadcast);
+    pktbuf_release(pb);
+    return ret;
 }
 
 static int
 arp_reply(struct network_interface *iface, const uint8_t *tha, IPAddress tpa, const uint8_t *dst)
 {
-    struct arp_ether reply;
-
-    reply.hdr.hrd = hton16(ARP_HRD_ETHER);
-    reply.hdr.pro = hton16(ARP_PRO_IP);
-    reply.hdr.hln = ETHER_ADDR_LEN;
-    reply.hdr.pln = IP_ADDRESS_LENGTH;
-    reply.hdr.op = hton16(ARP_OP_REPLY);
-    memcpy(reply.sha, iface->dev->address, ETHER_ADDR_LEN);
-    memcpy(reply.spa, &((struct IP_INTERFACE *)iface)->unicast, IP_ADDRESS_LENGTH);
-    memcpy(reply.tha, tha, ETHER_ADDR_LEN);
-    memcpy(reply.tpa, &tpa, IP_ADDRESS_LENGTH);
-    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(reply.hdr.op), ntoh16(reply.hdr.op), sizeof(reply));
-    arp_dump((uint8_t *)&reply, sizeof(reply));
-    return network_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&reply, sizeof(reply), dst);
+    struct pktbuf *pb;
+    struct arp_ether *reply;
+    int ret;
+
+    pb = pktbuf_alloc(iface->dev->header_len + sizeof(*reply));
+    if (!pb) {
+        errorf("pktbuf_alloc() failure");
+        return -1;
+    }
+    pktbuf_reserve(pb, iface->dev->header_len);
+    reply = (struct arp_ether *)pktbuf_append(pb, sizeof(*reply));
+    reply->hdr.hrd = hton16(ARP_HRD_ETHER);
+    reply->hdr.pro = hton16(ARP_PRO_IP);
+    reply->hdr.hln = ETHER_ADDR_LEN;
+    reply->hdr.pln = IP_ADDRESS_LENGTH;
+    reply->hdr.op = hton16(ARP_OP_REPLY);
+    memcpy(reply->sha, iface->dev->address, ETHER_ADDR_LEN);
+    memcpy(reply->spa, &((struct IP_INTERFACE *)iface)->unicast, IP_ADDRESS_LENGTH);
+    memcpy(reply->tha, tha, ETHER_ADDR_LEN);
+    memcpy(reply->tpa, &tpa, IP_ADDRESS_LENGTH);
+    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(reply->hdr.op), ntoh16(reply->hdr.op), sizeof(*reply));
+    arp_dump((uint8_t *)reply, sizeof(*reply));
+    ret = network_device_output(iface->dev, ETHER_TYPE_ARP, pb, dst);
+    pktbuf_release(pb);
+    return ret;
 }
 
 static void
-arp_input(const uint8_t *data, size_t len, struct network_device *dev)
+arp_input(struct pktbuf *pb, struct network_device *dev)
 {
+    const uint8_t *data = pktbuf_data(pb);
+    size_t len = pktbuf_len(pb);
     struct arp_ether *msg;
     IPAddress spa, tpa;
     int merge = 0;
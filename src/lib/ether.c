@@ -2,8 +2,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/poll.h>
 
+#include "handler.h"
 #include "util.h"
 #include "net2.h"
 #include "ether.h"
@@ -82,40 +87,53 @@ ether_dump(const uint8_t *frame, size_t flen)
     funlockfile(stderr);
 }
 
-int ether_transmit_helper(struct network_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, ssize_t (*callback)(struct network_device *dev, const uint8_t *data, size_t len))
+static const uint8_t zero[ETHER_PAYLOAD_SIZE_MIN] = {};
+
+int ether_transmit_helper(struct network_device *dev, uint16_t type, struct pktbuf *pb, const void *dst, ssize_t (*callback)(struct network_device *dev, struct pktbuf *pb, const struct iovec *iov, int iovcnt))
 {
-    uint8_t frame[ETHER_FRAME_SIZE_MAX] = {};
+    struct iovec iov[PKTBUF_FRAG_MAX + 2];
     struct ether_hdr *hdr;
-    size_t flen, pad = 0;
+    size_t len, flen, pad = 0;
+    int i, iovcnt = 0;
 
-    hdr = (struct ether_hdr *)frame;
+    len = pktbuf_total_len(pb);
+    hdr = (struct ether_hdr *)pktbuf_push(pb, sizeof(*hdr));
+    if (!hdr) {
+        errorf("not enough headroom, dev=%s", dev->name);
+        return -1;
+    }
     memcpy(hdr->dst, dst, ETHER_ADDR_LEN);
     memcpy(hdr->src, dev->address, ETHER_ADDR_LEN);
     hdr->type = hton16(type);
-    memcpy(hdr + 1, data, len);
+    /* header and linear data, then the payload fragments, then the padding */
+    iov[iovcnt].iov_base = hdr;
+    iov[iovcnt++].iov_len = pktbuf_len(pb);
+    for (i = 0; i < pb->nfrags; i++) {
+        iov[iovcnt++] = pb->frags[i];
+    }
     if (len < ETHER_PAYLOAD_SIZE_MIN) {
         pad = ETHER_PAYLOAD_SIZE_MIN - len;
+        iov[iovcnt].iov_base = (void *)zero;
+        iov[iovcnt++].iov_len = pad;
     }
     flen = sizeof(*hdr) + len + pad;
     debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), type, flen);
-    ether_dump(frame, flen);
-    return callback(dev, frame, flen) == (ssize_t)flen ? 0 : -1;
+    ether_dump((uint8_t *)hdr, pktbuf_len(pb));
+    return callback(dev, pb, iov, iovcnt) == (ssize_t)flen ? 0 : -1;
 }
 
-int
-ether_poll_helper(struct network_device *dev, ssize_t (*callback)(struct network_device *dev, uint8_t *buf, size_t size))
+/* strips the header of a received frame, returns its type or -1 if the frame is to be dropped */
+static int
+ether_input_frame(struct network_device *dev, struct pktbuf *pb)
 {
-    uint8_t frame[ETHER_FRAME_SIZE_MAX];
-    ssize_t flen;
     struct ether_hdr *hdr;
     uint16_t type;
 
-    flen = callback(dev, frame, sizeof(frame));
-    if (flen < (ssize_t)sizeof(*hdr)) {
+    if (pktbuf_len(pb) < sizeof(*hdr)) {
         errorf("input data is too short");
         return -1;
     }
-    hdr = (struct ether_hdr *)frame;
+    hdr = (struct ether_hdr *)pktbuf_data(pb);
     if (memcmp(dev->address, hdr->dst, ETHER_ADDR_LEN) != 0) {
         if (memcmp(ETHER_ADDR_BROADCAST, hdr->dst, ETHER_ADDR_LEN) != 0) {
             /* for other host */
@@ -123,9 +141,302 @@ ether_poll_helper(struct network_device *dev, ssize_t (*callback)(struct network
         }
     }
     type = ntoh16(hdr->type);
-    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), type, flen);
-    ether_dump(frame, flen);
-    return network_input_handler(type, (uint8_t *)(hdr + 1), flen - sizeof(*hdr), dev);
+    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), type, pktbuf_len(pb));
+    ether_dump((uint8_t *)hdr, pktbuf_len(pb));
+    pktbuf_pull(pb, sizeof(*hdr));
+    return type;
+}
+
+int
+ether_poll_helper(struct network_device *dev, ssize_t (*callback)(struct network_device *dev, struct pktbuf *pb))
+{
+    struct pktbuf *pb;
+    ssize_t flen;
+    int type, ret;
+
+    /* the driver reads straight into the packet buffer that is handed up the stack */
+    pb = pktbuf_alloc(ETHER_FRAME_SIZE_MAX);
+    if (!pb) {
+        errorf("pktbuf_alloc() failure");
+        return -1;
+    }
+    flen = callback(dev, pb);
+    if (flen <= 0) {
+        /* nothing to read, or error */
+        pktbuf_release(pb);
+        return flen;
+    }
+    pktbuf_append(pb, flen);
+    type = ether_input_frame(dev, pb);
+    if (type == -1) {
+        pktbuf_release(pb);
+        return 1;
+    }
+    ret = network_input_handler(type, pb, dev);
+    pktbuf_release(pb);
+    return ret == -1 ? -1 : 1;
+}
+
+/*
+ * reads up to max frames into pbs, sets *num to the number read and returns the number of reads consumed,
+ * failed ones included; sets *drained when the fd ran empty, or when no buffer is left and the round has to end
+ */
+static unsigned int
+ether_read_batch(struct network_device *dev, ssize_t (*callback)(struct network_device *dev, struct pktbuf *pb), struct pktbuf **pbs, unsigned int max, unsigned int *num, int *drained)
+{
+    unsigned int consumed = 0;
+    ssize_t flen;
+
+    *num = 0;
+    while (consumed < max) {
+        pbs[*num] = pktbuf_alloc(ETHER_FRAME_SIZE_MAX);
+        if (!pbs[*num]) {
+            /* the frames stay queued in the device until the stack has given buffers back */
+            errorf("pktbuf_alloc() failure");
+            *drained = 1;
+            break;
+        }
+        flen = callback(dev, pbs[*num]);
+        if (flen <= 0) {
+            pktbuf_release(pbs[*num]);
+            if (flen == 0) {
+                *drained = 1;
+                break;
+            }
+            /* read error, the frame is lost but still counts against the budget */
+            consumed++;
+            continue;
+        }
+        pktbuf_append(pbs[*num], flen);
+        (*num)++;
+        consumed++;
+    }
+    return consumed;
+}
+
+void
+ether_input_batch_helper(struct network_device *dev, struct pktbuf **pbs, unsigned int num)
+{
+    struct pktbuf *sorted[PKTBUF_VEC_MAX];
+    int types[PKTBUF_VEC_MAX];
+    unsigned int i, j, n, start;
+    int type;
+
+    /* classify the whole vector by ethertype */
+    for (i = 0; i < num; i++) {
+        if (i + 1 < num) {
+            __builtin_prefetch(pktbuf_data(pbs[i + 1]));
+        }
+        types[i] = ether_input_frame(dev, pbs[i]);
+    }
+    /* hand each ethertype's frames up as one batch, preserving their order */
+    n = 0;
+    for (i = 0; i < num; i++) {
+        if (types[i] == -1) {
+            continue;
+        }
+        type = types[i];
+        start = n;
+        for (j = i; j < num; j++) {
+            if (types[j] == type) {
+                sorted[n++] = pbs[j];
+                types[j] = -1;
+            }
+        }
+        network_input_batch(type, &sorted[start], n - start, dev);
+    }
+    for (i = 0; i < num; i++) {
+        pktbuf_release(pbs[i]);
+    }
+}
+
+int
+ether_poll_batch_helper(struct network_device *dev, ssize_t (*callback)(struct network_device *dev, struct pktbuf *pb), int budget)
+{
+    struct pktbuf *pbs[PKTBUF_VEC_MAX];
+    unsigned int num;
+    int total = 0, drained = 0;
+
+    while (total < budget && !drained) {
+        total += ether_read_batch(dev, callback, pbs, MIN(budget - total, PKTBUF_VEC_MAX), &num, &drained);
+        if (num) {
+            ether_input_batch_helper(dev, pbs, num);
+        }
+    }
+    return total;
+}
+
+void
+ether_tx_queue_init(struct ether_tx_queue *q, int (*send)(struct network_device *dev, struct pktbuf **pbs, unsigned int num))
+{
+    memset(q, 0, sizeof(*q));
+    mutex_init(&q->mutex);
+    q->send = send;
+}
+
+/* NOTE: must be called after q->mutex locked, the lock is held while sending to keep the frames in order */
+static void
+ether_tx_queue_flush_locked(struct network_device *dev, struct ether_tx_queue *q)
+{
+    unsigned int i, num, bucket;
+    int sent;
+
+    num = q->num;
+    if (!num) {
+        return;
+    }
+    sent = q->send(dev, q->pbs, num);
+    if (sent < (int)num) {
+        q->errors += num - (sent < 0 ? 0 : sent);
+    }
+    for (i = 0; i < num; i++) {
+        pktbuf_release(q->pbs[i]);
+    }
+    q->num = 0;
+    q->flushes++;
+    q->frames += num;
+    for (bucket = 0; num > 1 && bucket < ETHER_TX_BATCH_BUCKETS - 1; num >>= 1) {
+        bucket++;
+    }
+    q->batches[bucket]++;
+}
+
+ssize_t
+ether_tx_queue_push(struct network_device *dev, struct ether_tx_queue *q, struct pktbuf *pb)
+{
+    struct pktbuf *qpb;
+    unsigned int batch;
+    size_t len;
+
+    len = MAX(pktbuf_total_len(pb), ETHER_FRAME_SIZE_MIN);
+    /* the buffer itself is queued, only sender-owned fragments, valid during the call alone, are copied */
+    qpb = pktbuf_linearize(pb);
+    if (!qpb) {
+        errorf("pktbuf_linearize() failure, dev=%s", dev->name);
+        return -1;
+    }
+    batch = dev->tx_batch ? dev->tx_batch : NETWORK_TX_BATCH_DEFAULT;
+    mutex_lock(&q->mutex);
+    q->pbs[q->num++] = qpb;
+    if (q->num >= MIN(batch, ETHER_TX_QUEUE_MAX)) {
+        ether_tx_queue_flush_locked(dev, q);
+        mutex_unlock(&q->mutex);
+        return len;
+    }
+    mutex_unlock(&q->mutex);
+    network_device_tx_pending(dev);
+    return len;
+}
+
+int
+ether_tx_frame_iov(struct pktbuf *pb, struct iovec *iov)
+{
+    iov[0].iov_base = pktbuf_data(pb);
+    iov[0].iov_len = pktbuf_len(pb);
+    if (pktbuf_len(pb) >= ETHER_FRAME_SIZE_MIN) {
+        return 1;
+    }
+    iov[1].iov_base = (void *)zero;
+    iov[1].iov_len = ETHER_FRAME_SIZE_MIN - pktbuf_len(pb);
+    return 2;
+}
+
+void
+ether_tx_queue_flush(struct network_device *dev, struct ether_tx_queue *q)
+{
+    mutex_lock(&q->mutex);
+    ether_tx_queue_flush_locked(dev, q);
+    mutex_unlock(&q->mutex);
+}
+
+void
+ether_tx_queue_destroy(struct network_device *dev, struct ether_tx_queue *q)
+{
+    ether_tx_queue_flush(dev, q);
+    infof("dev=%s, tx flushes=%lu, frames=%lu, errors=%lu, batches=%lu/%lu/%lu/%lu/%lu/%lu", dev->name,
+        q->flushes, q->frames, q->errors, q->batches[0], q->batches[1], q->batches[2], q->batches[3], q->batches[4], q->batches[5]);
+}
+
+static uint64_t
+ether_busy_poll_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+ether_busy_poll_thread(void *arg)
+{
+    struct ether_busy_poll *bp = arg;
+    struct pollfd pfd;
+    uint64_t budget, last, spin_start, now;
+    int ret;
+
+    budget = (uint64_t)bp->spin_us * 1000;
+    pfd.fd = bp->fd;
+    pfd.events = POLLIN;
+    last = spin_start = ether_busy_poll_now();
+    while (__atomic_load_n(&bp->running, __ATOMIC_ACQUIRE)) {
+        ret = ether_poll_helper(bp->dev, bp->callback);
+        now = ether_busy_poll_now();
+        if (ret != 0) {
+            bp->stats.frames++;
+            bp->stats.busy_ns += now - last;
+            last = spin_start = now;
+            continue;
+        }
+        bp->stats.spin_ns += now - last;
+        last = now;
+        if (now - spin_start < budget) {
+            continue;
+        }
+        /* spin budget exhausted without traffic, block until the fd is readable */
+        bp->stats.sleeps++;
+        ret = poll(&pfd, 1, ETHER_BUSY_POLL_BLOCK_MS);
+        if (ret == -1 && errno != EINTR) {
+            errorf("poll: %s, dev=%s", strerror(errno), bp->dev->name);
+            break;
+        }
+        now = ether_busy_poll_now();
+        bp->stats.idle_ns += now - last;
+        last = spin_start = now;
+    }
+    return NULL;
+}
+
+int
+ether_busy_poll_start(struct ether_busy_poll *bp, struct network_device *dev, int fd, ssize_t (*callback)(struct network_device *dev, struct pktbuf *pb))
+{
+    int err;
+
+    bp->dev = dev;
+    bp->fd = fd;
+    bp->callback = callback;
+    memset(&bp->stats, 0, sizeof(bp->stats));
+    bp->running = 1;
+    err = pthread_create(&bp->thread, NULL, ether_busy_poll_thread, bp);
+    if (err) {
+        errorf("pthread_create() %s, dev=%s", strerror(err), dev->name);
+        bp->running = 0;
+        return -1;
+    }
+    infof("busy-poll started, dev=%s, spin=%uus", dev->name, bp->spin_us);
+    return 0;
+}
+
+void
+ether_busy_poll_stop(struct ether_busy_poll *bp)
+{
+    if (!bp->running) {
+        return;
+    }
+    __atomic_store_n(&bp->running, 0, __ATOMIC_RELEASE);
+    pthread_join(bp->thread, NULL);
+    infof("busy-poll stopped, dev=%s, frames=%lu, busy=%luus, spin=%luus, idle=%luus, sleeps=%lu",
+        bp->dev->name, bp->stats.frames, bp->stats.busy_ns / 1000, bp->stats.spin_ns / 1000,
+        bp->stats.idle_ns / 1000, bp->stats.sleeps);
 }
 
 void
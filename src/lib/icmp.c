@@ -88,8 +88,10 @@ static void icmp_dump(const uint8_t *data, size_t len) {
     funlockfile(stderr);
 }
 
-static void icmp_input(const uint8_t *data, size_t len, IPAddress src, IPAddress dst, struct IP_INTERFACE *iface)
+static void icmp_input(struct pktbuf *pb, IPAddress src, IPAddress dst, struct IP_INTERFACE *iface)
 {
+    const uint8_t *data = pktbuf_data(pb);
+    size_t len = pktbuf_len(pb);
     struct icmp_header *hdr;
     char addr1[MAX_IP_ADDRESS_STRING_LENGTH];
     char addr2[MAX_IP_ADDRESS_STRING_LENGTH];
@@ -125,26 +127,40 @@ static void icmp_input(const uint8_t *data, size_t len, IPAddress src, IPAddress
 
 int icmp_output(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data, size_t len, IPAddress src, IPAddress dst)
 {
-    uint8_t buf[ICMP_BUFSIZ];
+    struct pktbuf *pb;
     struct icmp_header *hdr;
-    size_t msg_len;
+    size_t msg_len, headroom;
+    ssize_t ret;
     char addr1[MAX_IP_ADDRESS_STRING_LENGTH];
     char addr2[MAX_IP_ADDRESS_STRING_LENGTH];
 
-    hdr = (struct icmp_header *)buf;
+    if (len > ICMP_BUFSIZ - sizeof(*hdr)) {
+        errorf("too long");
+        return -1;
+    }
+    headroom = ip_headroom(dst);
+    msg_len = sizeof(*hdr) + len;
+    pb = pktbuf_alloc(headroom + msg_len);
+    if (!pb) {
+        errorf("pktbuf_alloc() failure");
+        return -1;
+    }
+    pktbuf_reserve(pb, headroom);
+    hdr = (struct icmp_header *)pktbuf_append(pb, msg_len);
     hdr->type = type;
     hdr->code = code;
     hdr->sum = 0;
     hdr->values = values;
     memcpy(hdr + 1, data, len);
-    msg_len = sizeof(*hdr) + len;
     hdr->sum = cksum16((uint16_t *)hdr, msg_len, 0);
     debugf("%s => %s, type=%s(%u), len=%zu",
         ip_address_to_string(src, addr1, sizeof(addr1)),
         ip_address_to_string(dst, addr2, sizeof(addr2)),
         icmp_type_ntoa(hdr->type), hdr->type, msg_len);
     icmp_dump((uint8_t *)hdr, msg_len);
-    return ip_send_packet(ICMP_PROTOCOL, (uint8_t *)hdr, msg_len, src, dst);
+    ret = ip_send_packet(ICMP_PROTOCOL, pb, src, dst);
+    pktbuf_release(pb);
+    return ret;
 }
 
 int icmp_init(void)
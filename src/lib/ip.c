@@ -15,7 +15,8 @@ struct ip_protocol {
     struct ip_protocol *next;
     char name[16];
     uint8_t type;
-    void (*handler)(const uint8_t *data, size_t len, IPAddress src, IPAddress dst, struct IP_INTERFACE *iface);
+    void (*handler)(struct pktbuf *pb, IPAddress src, IPAddress dst, struct IP_INTERFACE *iface);
+    void (*batch_handler)(struct ip_batch *batch); /* optional, called once per batch instead of handler */
 };
 
 struct ip_route {
@@ -240,38 +241,93 @@ struct IP_INTERFACE *ip_select_interface(IPAddress addr) {
     return entry;
 }
 
-static void ip_input(const uint8_t *data, size_t len, struct network_device *dev) {
+/* validates the IP header of a received packet and strips it in place, returns the header or NULL to drop */
+static struct ip_hdr *ip_input_check(struct pktbuf *pb, struct network_device *dev, struct IP_INTERFACE **ifacep) {
+    const uint8_t *data = pktbuf_data(pb);
+    size_t len = pktbuf_len(pb);
     struct ip_hdr *hdr;
     uint8_t v;
     uint16_t hlen, total, offset;
     struct IP_INTERFACE *iface;
     char addr[MAX_IP_ADDRESS_STRING_LENGTH];
-    struct ip_protocol *proto;
 
     if (len < MIN_IP_HEADER_SIZE || !(iface = (struct IP_INTERFACE *)network_device_get_interface(dev, NETWORK_INTERFACE_FAMILY_IP))) {
-        return;
+        return NULL;
     }
     hdr = (struct ip_hdr *)data;
     v = hdr->vhl >> 4;
-    if (v != IPV4 || (hlen = (hdr->vhl & 0x0f) << 2) > len || (total = ntoh16(hdr->total)) > len || cksum16((uint16_t *)hdr, hlen, 0) != 0) {
-        return;
+    if (v != IPV4 || (hlen = (hdr->vhl & 0x0f) << 2) > len || (total = ntoh16(hdr->total)) > len || (!(pb->flags & PKTBUF_FLAG_CSUM_VALID) && cksum16((uint16_t *)hdr, hlen, 0) != 0)) {
+        return NULL;
     }
     offset = ntoh16(hdr->offset);
     if (offset & 0x2000 || offset & 0x1fff || (hdr->dst != iface->unicast && hdr->dst != iface->broadcast && hdr->dst != IP_ADDR_BROADCAST)) {
-        return;
+        return NULL;
     }
     debugf("dev=%s, iface=%s, protocol=%s(0x%02x), len=%u",
         dev->name, ip_address_to_string(iface->unicast, addr, sizeof(addr)), ip_get_protocol_name(hdr->protocol), hdr->protocol, total);
     ip_dump(data, total);
+    /* drop link-layer padding and strip the IP header in place */
+    pktbuf_trim(pb, total);
+    pktbuf_pull(pb, hlen);
+    *ifacep = iface;
+    return hdr;
+}
+
+static void ip_input(struct pktbuf *pb, struct network_device *dev) {
+    struct ip_hdr *hdr;
+    struct IP_INTERFACE *iface;
+    struct ip_protocol *proto;
+
+    hdr = ip_input_check(pb, dev, &iface);
+    if (!hdr) {
+        return;
+    }
     for (proto = protocols; proto; proto = proto->next) {
         if (proto->type == hdr->protocol) {
-            proto->handler((uint8_t *)hdr + hlen, total - hlen, hdr->src, hdr->dst, iface);
+            proto->handler(pb, hdr->src, hdr->dst, iface);
             return;
         }
     }
 }
 
-static ssize_t ip_output_device(struct IP_INTERFACE *iface, const uint8_t *data, size_t len, IPAddress dst) {
+static void ip_input_batch(struct pktbuf **pbs, unsigned int num) {
+    struct ip_batch batch;
+    struct ip_hdr *hdrs[PKTBUF_VEC_MAX];
+    struct IP_INTERFACE *ifaces[PKTBUF_VEC_MAX];
+    struct ip_protocol *proto;
+    unsigned int i;
+
+    /* validate the whole vector first, prefetching the next header */
+    for (i = 0; i < num; i++) {
+        if (i + 1 < num) {
+            __builtin_prefetch(pktbuf_data(pbs[i + 1]));
+        }
+        hdrs[i] = ip_input_check(pbs[i], pbs[i]->dev, &ifaces[i]);
+    }
+    /* then demultiplex it, each upper protocol is called once for all of its packets */
+    for (proto = protocols; proto; proto = proto->next) {
+        batch.num = 0;
+        for (i = 0; i < num; i++) {
+            if (!hdrs[i] || hdrs[i]->protocol != proto->type) {
+                continue;
+            }
+            if (!proto->batch_handler) {
+                proto->handler(pbs[i], hdrs[i]->src, hdrs[i]->dst, ifaces[i]);
+                continue;
+            }
+            batch.pbs[batch.num] = pbs[i];
+            batch.src[batch.num] = hdrs[i]->src;
+            batch.dst[batch.num] = hdrs[i]->dst;
+            batch.iface[batch.num] = ifaces[i];
+            batch.num++;
+        }
+        if (batch.num) {
+            proto->batch_handler(&batch);
+        }
+    }
+}
+
+static ssize_t ip_output_device(struct IP_INTERFACE *iface, struct pktbuf *pb, IPAddress dst) {
     uint8_t hwaddr[NETWORK_DEVICE_ADDR_LEN] = {};
     int ret;
     if (NETWORK_INTERFACE(iface)->dev->flags & NETWORK_DEVICE_FLAG_NEED_ARP) {
@@ -281,20 +337,23 @@ static ssize_t ip_output_device(struct IP_INTERFACE *iface, const uint8_t *data,
             return ret;
         }
     }
-    return network_device_output(NETWORK_INTERFACE(iface)->dev, NETWORK_PROTOCOL_TYPE_IP, data, len, hwaddr);
+    return network_device_output(NETWORK_INTERFACE(iface)->dev, NETWORK_PROTOCOL_TYPE_IP, pb, hwaddr);
 }
 
-static ssize_t ip_output_core(struct IP_INTERFACE *iface, uint8_t protocol, const uint8_t *data, size_t len, IPAddress src, IPAddress dst, IPAddress nexthop, uint16_t id, uint16_t offset) {
-    uint8_t buf[MAX_IP_PACKET_SIZE];
+static ssize_t ip_output_core(struct IP_INTERFACE *iface, uint8_t protocol, struct pktbuf *pb, IPAddress src, IPAddress dst, IPAddress nexthop, uint16_t id, uint16_t offset) {
     struct ip_hdr *hdr;
     uint16_t hlen, total;
     char addr[MAX_IP_ADDRESS_STRING_LENGTH];
 
-    hdr = (struct ip_hdr *)buf;
     hlen = sizeof(*hdr);
+    hdr = (struct ip_hdr *)pktbuf_push(pb, hlen);
+    if (!hdr) {
+        errorf("not enough headroom for the IP header");
+        return -1;
+    }
     hdr->vhl = (IPV4 << 4) | (hlen >> 2);
     hdr->tos = 0;
-    total = hlen + len;
+    total = pktbuf_total_len(pb);
     hdr->total = hton16(total);
     hdr->id = hton16(id);
     hdr->offset = hton16(offset);
@@ -303,12 +362,13 @@ static ssize_t ip_output_core(struct IP_INTERFACE *iface, uint8_t protocol, cons
     hdr->sum = 0;
     hdr->src = src;
     hdr->dst = dst;
-    hdr->sum = cksum16((uint16_t *)hdr, hlen, 0);
-    memcpy(hdr + 1, data, len);
+    if (!(NETWORK_INTERFACE(iface)->dev->flags & NETWORK_DEVICE_FLAG_NO_CSUM)) {
+        hdr->sum = cksum16((uint16_t *)hdr, hlen, 0);
+    }
     debugf("dev=%s, iface=%s, protocol=%s(0x%02x), len=%u",
         NETWORK_INTERFACE(iface)->dev->name, ip_address_to_string(iface->unicast, addr, sizeof(addr)), ip_get_protocol_name(protocol), protocol, total);
-    ip_dump(buf, total);
-    return ip_output_device(iface, buf, total, nexthop);
+    ip_dump((uint8_t *)hdr, pktbuf_len(pb));
+    return ip_output_device(iface, pb, nexthop);
 }
 
 static uint16_t ip_generate_id(void) {
@@ -321,12 +381,30 @@ static uint16_t ip_generate_id(void) {
     return ret;
 }
 
-ssize_t ip_send_packet(uint8_t protocol, const uint8_t *data, size_t len, IPAddress src, IPAddress dst) {
+size_t ip_headroom(IPAddress dst) {
+    struct ip_route *route;
+    route = ip_route_lookup(dst);
+    if (!route) {
+        return MIN_IP_HEADER_SIZE;
+    }
+    return NETWORK_INTERFACE(route->iface)->dev->header_len + MIN_IP_HEADER_SIZE;
+}
+
+struct network_device *ip_route_device(IPAddress dst) {
+    struct ip_route *route;
+    route = ip_route_lookup(dst);
+    if (!route) {
+        return NULL;
+    }
+    return NETWORK_INTERFACE(route->iface)->dev;
+}
+
+ssize_t ip_send_packet(uint8_t protocol, struct pktbuf *pb, IPAddress src, IPAddress dst) {
     struct ip_route *route;
     struct IP_INTERFACE *iface;
-    char addr[MAX_IP_ADDRESS_STRING_LENGTH];
     IPAddress nexthop;
     uint16_t id;
+    size_t len = pktbuf_total_len(pb);
 
     if (src == IP_ADDR_ANY && dst == IP_ADDR_BROADCAST) {
         errorf("source address is required for broadcast addresses");
@@ -337,19 +415,19 @@ ssize_t ip_send_packet(uint8_t protocol, const uint8_t *data, size_t len, IPAddr
         return -1;
     }
     nexthop = (route->nexthop != IP_ADDR_ANY) ? route->nexthop : dst;
-    if (NETWORK_INTERFACE(iface)->dev->mtu < MIN_IP_HEADER_SIZE + len) {
+    if (NETWORK_INTERFACE(iface)->dev->mtu < MIN_IP_HEADER_SIZE + len && !pb->gso_size) {
         errorf("packet size too large");
         return -1;
     }
     id = ip_generate_id();
-    if (ip_output_core(iface, protocol, data, len, iface->unicast, dst, nexthop, id, 0) == -1) {
+    if (ip_output_core(iface, protocol, pb, iface->unicast, dst, nexthop, id, 0) == -1) {
         errorf("ip_output_core() failure");
         return -1;
     }
     return len;
 }
 
-int ip_register_protocol(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, IPAddress src, IPAddress dst, struct IP_INTERFACE *iface)) {
+int ip_register_protocol(const char *name, uint8_t type, void (*handler)(struct pktbuf *pb, IPAddress src, IPAddress dst, struct IP_INTERFACE *iface)) {
     struct ip_protocol *entry;
 
     for (entry = protocols; entry; entry = entry->next) {
@@ -371,6 +449,19 @@ int ip_register_protocol(const char *name, uint8_t type, void (*handler)(const u
     return 0;
 }
 
+int ip_set_protocol_batch_handler(uint8_t type, void (*handler)(struct ip_batch *batch)) {
+    struct ip_protocol *entry;
+
+    for (entry = protocols; entry; entry = entry->next) {
+        if (entry->type == type) {
+            entry->batch_handler = handler;
+            return 0;
+        }
+    }
+    errorf("protocol not registered");
+    return -1;
+}
+
 char *ip_get_protocol_name(uint8_t type) {
     struct ip_protocol *entry;
 
@@ -387,5 +478,6 @@ int ip_initialize(void) {
         errorf("network protocol registration failure");
         return -1;
     }
+    network_protocol_set_batch_handler(NETWORK_PROTOCOL_TYPE_IP, ip_input_batch);
     return 0;
 }
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "handler.h"
+#include "util.h"
+#include "mempool.h"
+
+#define MEMPOOL_ALIGN 16
+
+struct mempool_cache {
+    unsigned int num;
+    void *objs[MEMPOOL_CACHE_SIZE];
+};
+
+static __thread struct mempool_cache caches[MEMPOOL_MAX];
+static __thread int caches_registered;
+
+static mutex_t registry_mutex = MUTEX_INITIALIZER;
+static struct mempool *pools;
+static int next_id;
+
+/* its destructor runs on every thread that has cached objects when the thread exits */
+static pthread_key_t caches_key;
+static pthread_once_t caches_key_once = PTHREAD_ONCE_INIT;
+
+static void mempool_put(struct mempool *pool, void *obj);
+
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+/* gives the objects cached by an exiting thread back to their pools, they would count as created but never be handed out again */
+static void mempool_caches_flush(void *arg) {
+    struct mempool *pool;
+    struct mempool_cache *cache;
+
+    mutex_lock(&registry_mutex);
+    for (pool = pools; pool; pool = pool->next) {
+        if (pool->id > MEMPOOL_MAX) {
+            continue;
+        }
+        cache = &caches[pool->id - 1];
+        if (!cache->num) {
+            continue;
+        }
+        mutex_lock(&pool->mutex);
+        while (cache->num) {
+            mempool_put(pool, cache->objs[--cache->num]);
+        }
+        mutex_unlock(&pool->mutex);
+    }
+    mutex_unlock(&registry_mutex);
+}
+
+static void mempool_caches_key_create(void) {
+    if (pthread_key_create(&caches_key, mempool_caches_flush) != 0) {
+        errorf("pthread_key_create() failure");
+    }
+}
+
+/* assigns a per-thread cache slot on first use and adds the pool to the registry */
+static struct mempool_cache *mempool_cache(struct mempool *pool) {
+    int id;
+
+    id = __atomic_load_n(&pool->id, __ATOMIC_ACQUIRE);
+    if (!id) {
+        mutex_lock(&registry_mutex);
+        if (!pool->id) {
+            pool->next = pools;
+            pools = pool;
+            __atomic_store_n(&pool->id, ++next_id, __ATOMIC_RELEASE);
+        }
+        id = pool->id;
+        mutex_unlock(&registry_mutex);
+    }
+    if (id > MEMPOOL_MAX) {
+        return NULL;
+    }
+    if (!caches_registered) {
+        pthread_once(&caches_key_once, mempool_caches_key_create);
+        /* any non-NULL value, the destructor is only run for those */
+        pthread_setspecific(caches_key, caches);
+        caches_registered = 1;
+    }
+    return &caches[id - 1];
+}
+
+/* NOTE: must be called after pool->mutex locked */
+static void *mempool_get(struct mempool *pool) {
+    void *obj;
+    uint8_t *slab;
+    size_t stride;
+    unsigned int num, i;
+
+    if (!pool->free) {
+        if (pool->created >= pool->capacity) {
+            return NULL;
+        }
+        stride = (MAX(pool->objsize, sizeof(void *)) + MEMPOOL_ALIGN - 1) & ~(size_t)(MEMPOOL_ALIGN - 1);
+        num = MIN(MEMPOOL_SLAB_OBJS, pool->capacity - pool->created);
+        slab = aligned_alloc(MEMPOOL_ALIGN, stride * num);
+        if (!slab) {
+            errorf("aligned_alloc() failure, pool=%s", pool->name);
+            return NULL;
+        }
+        for (i = 0; i < num; i++) {
+            *(void **)(slab + stride * i) = pool->free;
+            pool->free = slab + stride * i;
+        }
+        pool->created += num;
+    }
+    obj = pool->free;
+    pool->free = *(void **)obj;
+    return obj;
+}
+
+/* NOTE: must be called after pool->mutex locked */
+static void mempool_put(struct mempool *pool, void *obj) {
+    *(void **)obj = pool->free;
+    pool->free = obj;
+}
+
+void *mempool_alloc(struct mempool *pool) {
+    struct mempool_cache *cache;
+    unsigned int in_use, hw;
+    void *obj = NULL;
+
+    cache = mempool_cache(pool);
+    if (cache && cache->num) {
+        obj = cache->objs[--cache->num];
+    } else {
+        mutex_lock(&pool->mutex);
+        obj = mempool_get(pool);
+        if (obj && cache) {
+            /* refill half of the thread cache while the lock is held */
+            while (cache->num < MEMPOOL_CACHE_SIZE / 2) {
+                void *extra = mempool_get(pool);
+                if (!extra) {
+                    break;
+                }
+                cache->objs[cache->num++] = extra;
+            }
+        }
+        mutex_unlock(&pool->mutex);
+    }
+    if (!obj) {
+        __atomic_add_fetch(&pool->failures, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    __atomic_add_fetch(&pool->allocs, 1, __ATOMIC_RELAXED);
+    in_use = __atomic_add_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+    hw = __atomic_load_n(&pool->high_water, __ATOMIC_RELAXED);
+    while (in_use > hw && !__atomic_compare_exchange_n(&pool->high_water, &hw, in_use, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return obj;
+}
+
+void mempool_free(struct mempool *pool, void *obj) {
+    struct mempool_cache *cache;
+
+    if (!obj) {
+        return;
+    }
+    __atomic_sub_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+    cache = mempool_cache(pool);
+    if (cache && cache->num < MEMPOOL_CACHE_SIZE) {
+        cache->objs[cache->num++] = obj;
+        return;
+    }
+    mutex_lock(&pool->mutex);
+    if (cache) {
+        /* flush half of the thread cache back to the shared free list */
+        while (cache->num > MEMPOOL_CACHE_SIZE / 2) {
+            mempool_put(pool, cache->objs[--cache->num]);
+        }
+        cache->objs[cache->num++] = obj;
+    } else {
+        mempool_put(pool, obj);
+    }
+    mutex_unlock(&pool->mutex);
+}
+
+void mempool_get_stats(struct mempool *pool, struct mempool_stats *stats) {
+    mutex_lock(&pool->mutex);
+    stats->objsize = pool->objsize;
+    stats->capacity = pool->capacity;
+    stats->created = pool->created;
+    mutex_unlock(&pool->mutex);
+    stats->in_use = __atomic_load_n(&pool->in_use, __ATOMIC_RELAXED);
+    stats->high_water = __atomic_load_n(&pool->high_water, __ATOMIC_RELAXED);
+    stats->allocs = __atomic_load_n(&pool->allocs, __ATOMIC_RELAXED);
+    stats->failures = __atomic_load_n(&pool->failures, __ATOMIC_RELAXED);
+}
+
+void mempool_dump(void) {
+    struct mempool *pool;
+    struct mempool_stats stats;
+
+    mutex_lock(&registry_mutex);
+    for (pool = pools; pool; pool = pool->next) {
+        mempool_get_stats(pool, &stats);
+        infof("pool=%s, objsize=%zu, capacity=%u, created=%u, in_use=%u, high_water=%u, allocs=%lu, failures=%lu",
+            pool->name, stats.objsize, stats.capacity, stats.created, stats.in_use, stats.high_water, stats.allocs, stats.failures);
+    }
+    mutex_unlock(&registry_mutex);
+}
@@ -13,23 +13,23 @@
 #include "ip2.h"
 #include "icmp.h"
 #include "udp.h"
+#include "mempool.h"
+#include "ring.h"
 
 #define MAX_NAME_LENGTH 16
+#define PROTOCOL_QUEUE_SIZE 1024
 
-typedef void (*ProtocolHandler)(const uint8_t *data, size_t len, struct network_device *dev);
+typedef void (*ProtocolHandler)(struct pktbuf *pb, struct network_device *dev);
+typedef void (*ProtocolBatchHandler)(struct pktbuf **pbs, unsigned int num);
 
 struct network_protocol {
     struct network_protocol *next;
     char name[MAX_NAME_LENGTH];
     uint16_t type;
-    struct queue_head queue; /* input queue */
+    struct mpsc_ring queue; /* input queue of packet buffers, filled by any thread, drained by the softirq */
+    unsigned long inlined; /* packets handled inline in run-to-completion mode */
     ProtocolHandler handler;
-};
-
-struct network_protocol_queue_entry {
-    struct network_device *dev;
-    size_t len;
-    uint8_t data[]; /* Flexible array member for storing data */
+    ProtocolBatchHandler batch_handler; /* optional, called once per batch instead of handler */
 };
 
 struct network_timer {
@@ -47,9 +47,11 @@ struct network_event {
 };
 
 static struct network_device *devices;
+static struct network_device *poll_head, *poll_tail; /* devices scheduled for polling, interrupt thread only */
 static struct network_protocol *protocols;
 static struct network_timer *timers;
 static struct network_event *events;
+static int inline_depth; /* nesting of inline protocol handler calls, interrupt thread only */
 
 /* Function prototypes */
 int network_device_open(struct network_device *dev);
@@ -135,55 +137,161 @@ struct network_interface *network_device_get_interface(struct network_device *de
     return entry;
 }
 
-/* Function to transmit data through a network device */
-int network_device_output(struct network_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst) {
+/* Function to transmit a packet buffer through a network device */
+int network_device_output(struct network_device *dev, uint16_t type, struct pktbuf *pb, const void *dst) {
     if (!NETWORK_DEVICE_IS_UP(dev)) {
         errorf("not opened, dev=%s", dev->name);
         return -1;
     }
-    if (len > dev->mtu) {
-        errorf("too long, dev=%s, mtu=%u, len=%zu", dev->name, dev->mtu, len);
+    if (pktbuf_total_len(pb) > (pb->gso_size ? NETWORK_GSO_MAX_SIZE : dev->mtu)) {
+        errorf("too long, dev=%s, mtu=%u, len=%zu", dev->name, dev->mtu, pktbuf_total_len(pb));
         return -1;
     }
-    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, network_protocol_name(type), type, len);
-    debugdump(data, len);
-    if (dev->ops->transmit(dev, type, data, len, dst) == -1) {
-        errorf("device transmit failure, dev=%s, len=%zu", dev->name, len);
+    if (pb->gso_size && !(dev->flags & NETWORK_DEVICE_FLAG_TX_GSO_UDP)) {
+        errorf("segmentation offload not supported, dev=%s", dev->name);
+        return -1;
+    }
+    if ((pb->flags & PKTBUF_FLAG_CSUM_PARTIAL) && !(dev->flags & NETWORK_DEVICE_FLAG_TX_CSUM)) {
+        pktbuf_csum_finish(pb);
+    }
+    if (pktbuf_headroom(pb) < dev->header_len) {
+        errorf("not enough headroom, dev=%s, need=%u, have=%zu", dev->name, dev->header_len, pktbuf_headroom(pb));
+        return -1;
+    }
+    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, network_protocol_name(type), type, pktbuf_total_len(pb));
+    debugdump(pktbuf_data(pb), pktbuf_len(pb));
+    if (dev->ops->transmit(dev, type, pb, dst) == -1) {
+        errorf("device transmit failure, dev=%s, len=%zu", dev->name, pktbuf_total_len(pb));
         return -1;
     }
     return 0;
 }
 
-/* Function to handle network input */
-int network_input_handler(uint16_t type, const uint8_t *data, size_t len, struct network_device *dev) {
+/* Function to schedule a device for polling, called from its ISR on the interrupt thread */
+void network_device_schedule_poll(struct network_device *dev) {
+    if (dev->poll_scheduled) {
+        return;
+    }
+    dev->poll_scheduled = 1;
+    dev->poll_next = NULL;
+    if (poll_tail) {
+        poll_tail->poll_next = dev;
+    } else {
+        poll_head = dev;
+    }
+    poll_tail = dev;
+}
+
+/* Function to run one round-robin poll round over the scheduled devices */
+int network_device_poll_handler(void) {
+    struct network_device *dev, *last;
+    unsigned int budget;
+    int num;
+
+    last = poll_tail;
+    while ((dev = poll_head) != NULL) {
+        poll_head = dev->poll_next;
+        if (!poll_head) {
+            poll_tail = NULL;
+        }
+        dev->poll_scheduled = 0;
+        if (NETWORK_DEVICE_IS_UP(dev) && dev->ops->poll) {
+            budget = dev->poll_budget ? dev->poll_budget : NETWORK_POLL_BUDGET_DEFAULT;
+            num = dev->ops->poll(dev, budget);
+            dev->poll_rounds++;
+            if (num >= (int)budget) {
+                /* not drained yet, the IRQ stays disabled and the device goes to the back of the list */
+                dev->poll_exhausted++;
+                network_device_schedule_poll(dev);
+            }
+        }
+        if (dev == last) {
+            break;
+        }
+    }
+    return poll_head != NULL;
+}
+
+/* Function to flag a device for the flush at the end of the softirq */
+void network_device_tx_pending(struct network_device *dev) {
+    if (__atomic_exchange_n(&dev->tx_pending, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    if (!intr_in_context()) {
+        raise_softirq();
+    }
+}
+
+/* Function to flush the devices holding queued transmit frames */
+void network_device_flush_handler(void) {
+    struct network_device *dev;
+
+    for (dev = devices; dev; dev = dev->next) {
+        /* frames queued after the flag is cleared flag the device again */
+        if (dev->ops->flush && __atomic_exchange_n(&dev->tx_pending, 0, __ATOMIC_ACQ_REL)) {
+            dev->ops->flush(dev);
+        }
+    }
+}
+
+/* Function to hand a batch of received packets of one protocol to the stack */
+int network_input_batch(uint16_t type, struct pktbuf **pbs, unsigned int num, struct network_device *dev) {
     struct network_protocol *proto;
-    struct network_protocol_queue_entry *entry;
+    unsigned int i, queued = 0;
+    int ret = 0;
+
     for (proto = protocols; proto; proto = proto->next) {
         if (proto->type == type) {
-            entry = memory_alloc(sizeof(*entry) + len);
-            if (!entry) {
-                errorf("memory_alloc() failure");
-                return -1;
-            }
-            entry->dev = dev;
-            entry->len = len;
-            memcpy(entry + 1, data, len);
-            if (!queue_push(&proto->queue, entry)) {
-                errorf("queue_push() failure");
-                memory_free(entry);
-                return -1;
+            break;
+        }
+    }
+    if (!proto) {
+        return 0; /* Unsupported protocol */
+    }
+    for (i = 0; i < num; i++) {
+        pbs[i]->dev = dev;
+    }
+    if ((dev->flags & NETWORK_DEVICE_FLAG_RUN_TO_COMPLETION) && intr_in_context() &&
+        inline_depth < NETWORK_INLINE_DEPTH_MAX && !mpsc_ring_count(&proto->queue)) {
+        /* run to completion, the queue is only needed to hand over to another thread */
+        debugf("inline (depth:%d, num:%u), dev=%s, type=%s(0x%04x)", inline_depth, num, dev->name, proto->name, type);
+        inline_depth++;
+        if (proto->batch_handler) {
+            proto->batch_handler(pbs, num);
+        } else {
+            for (i = 0; i < num; i++) {
+                proto->handler(pbs[i], dev);
             }
-            debugf("queue pushed (num:%u), dev=%s, type=%s(0x%04x), len=%zd", proto->queue.num, dev->name, proto->name, type, len);
-            debugdump(data, len);
-            raise_softirq();
-            return 0;
         }
+        inline_depth--;
+        proto->inlined += num;
+        return 0;
+    }
+    for (i = 0; i < num; i++) {
+        if (mpsc_ring_enqueue(&proto->queue, pktbuf_ref(pbs[i])) == -1) {
+            debugf("queue full, dropped, dev=%s, type=%s(0x%04x)", dev->name, proto->name, type);
+            pktbuf_release(pbs[i]);
+            ret = -1;
+            continue;
+        }
+        queued++;
+        debugf("queue pushed (num:%u), dev=%s, type=%s(0x%04x), len=%zd", mpsc_ring_count(&proto->queue), dev->name, proto->name, type, pktbuf_len(pbs[i]));
+        debugdump(pktbuf_data(pbs[i]), pktbuf_len(pbs[i]));
+    }
+    if (queued) {
+        /* one softirq for the whole batch */
+        raise_softirq();
     }
-    return 0; /* Unsupported protocol */
+    return ret;
+}
+
+/* Function to handle network input */
+int network_input_handler(uint16_t type, struct pktbuf *pb, struct network_device *dev) {
+    return network_input_batch(type, &pb, 1, dev);
 }
 
 /* Function to register a network protocol */
-int network_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct network_device *dev)) {
+int network_protocol_register(const char *name, uint16_t type, void (*handler)(struct pktbuf *pb, struct network_device *dev)) {
     struct network_protocol *proto;
     for (proto = protocols; proto; proto = proto->next) {
         if (type == proto->type) {
@@ -196,6 +304,11 @@ int network_protocol_register(const char *name, uint16_t type, void (*handler)(c
         errorf("memory_alloc() failure");
         return -1;
     }
+    if (mpsc_ring_init(&proto->queue, PROTOCOL_QUEUE_SIZE) == -1) {
+        errorf("mpsc_ring_init() failure");
+        memory_free(proto);
+        return -1;
+    }
     strncpy(proto->name, name, sizeof(proto->name) - 1);
     proto->type = type;
     proto->handler = handler;
@@ -205,6 +318,19 @@ int network_protocol_register(const char *name, uint16_t type, void (*handler)(c
     return 0;
 }
 
+/* Function to set the batch handler of a registered network protocol */
+int network_protocol_set_batch_handler(uint16_t type, void (*handler)(struct pktbuf **pbs, unsigned int num)) {
+    struct network_protocol *proto;
+    for (proto = protocols; proto; proto = proto->next) {
+        if (proto->type == type) {
+            proto->batch_handler = handler;
+            return 0;
+        }
+    }
+    errorf("not registered, type=0x%04x", type);
+    return -1;
+}
+
 /* Function to get the name of a network protocol */
 char *network_protocol_name(uint16_t type) {
     struct network_protocol *entry;
@@ -218,19 +344,22 @@ char *network_protocol_name(uint16_t type) {
 
 int network_protocol_handler(void) {
     struct network_protocol *proto;
-    struct network_protocol_queue_entry *entry;
-    unsigned int num;
+    struct pktbuf *batch[PKTBUF_VEC_MAX];
+    unsigned int num, i;
     for (proto = protocols; proto; proto = proto->next) {
-        while (1) {
-            entry = queue_pop(&proto->queue);
-            if (!entry) {
-                break;
+        while ((num = mpsc_ring_dequeue_batch(&proto->queue, (void **)batch, PKTBUF_VEC_MAX)) != 0) {
+            debugf("queue popped (num:%u), type=0x%04x", num, proto->type);
+            if (proto->batch_handler) {
+                proto->batch_handler(batch, num);
+            } else {
+                for (i = 0; i < num; i++) {
+                    debugdump(pktbuf_data(batch[i]), pktbuf_len(batch[i]));
+                    proto->handler(batch[i], batch[i]->dev);
+                }
+            }
+            for (i = 0; i < num; i++) {
+                pktbuf_release(batch[i]);
             }
-            num = proto->queue.num;
-            debugf("queue popped (num:%u), dev=%s, type=0x%04x, len=%zd", num, entry->dev->name, proto->type, entry->len);
-            debugdump((uint8_t *)(entry + 1), entry->len);
-            proto->handler((uint8_t *)(entry + 1), entry->len, entry->dev);
-            free(entry);
         }
     }
     return 0;
@@ -267,7 +396,8 @@ int network_timer_handler(void) {
 }
 
 int network_interrupt(void) {
-    return kill(getpid(), SIGUSR2);
+    raise_event();
+    return 0;
 }
 
 int network_event_subscribe(void (*handler)(void *arg), void *arg) {
@@ -308,10 +438,20 @@ int network_run(void) {
 
 void network_shutdown(void) {
     struct network_device *dev;
+    struct network_protocol *proto;
     debugf("closing all connections and devices...");
+    /* devices are closed with nothing left running on the interrupt thread */
+    intr_shutdown();
     for (dev = devices; dev; dev = dev->next) {
         network_device_close(dev);
     }
+    for (dev = devices; dev; dev = dev->next) {
+        infof("dev=%s, poll_rounds=%lu, poll_exhausted=%lu", dev->name, dev->poll_rounds, dev->poll_exhausted);
+    }
+    for (proto = protocols; proto; proto = proto->next) {
+        infof("protocol=%s, queued=%u, drops=%lu, inlined=%lu", proto->name, mpsc_ring_count(&proto->queue), mpsc_ring_drops(&proto->queue), proto->inlined);
+    }
+    mempool_dump();
     debugf("shutdown completed");
     return;
 }
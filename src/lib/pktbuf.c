@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "mempool.h"
+#include "pktbuf.h"
+
+static struct mempool pool = MEMPOOL_INITIALIZER("pktbuf", sizeof(struct pktbuf) + PKTBUF_POOL_DATA_SIZE, PKTBUF_POOL_CAPACITY);
+static struct mempool ext_pool = MEMPOOL_INITIALIZER("pktbuf_ext", sizeof(struct pktbuf), PKTBUF_POOL_CAPACITY);
+
+struct pktbuf *pktbuf_alloc(size_t size) {
+    struct pktbuf *pb;
+
+    /* storage is allocated together with the descriptor */
+    if (size <= PKTBUF_POOL_DATA_SIZE) {
+        pb = mempool_alloc(&pool);
+        if (!pb) {
+            errorf("mempool_alloc() failure, pool exhausted");
+            return NULL;
+        }
+        pb->pool = &pool;
+    } else {
+        pb = malloc(sizeof(*pb) + size);
+        if (!pb) {
+            errorf("malloc() failure, size=%zu", size);
+            return NULL;
+        }
+        pb->pool = NULL;
+    }
+    pb->data = (uint8_t *)(pb + 1);
+    pb->size = size;
+    pb->head = 0;
+    pb->tail = 0;
+    pb->refcnt = 1;
+    pb->dev = NULL;
+    pb->frags = NULL;
+    pb->nfrags = 0;
+    pb->fraglen = 0;
+    pb->flags = 0;
+    pb->csum_start = 0;
+    pb->csum_offset = 0;
+    pb->gso_size = 0;
+    pb->protocol = 0;
+    pb->ext_release = NULL;
+    pb->ext_arg = NULL;
+    return pb;
+}
+
+struct pktbuf *pktbuf_alloc_ext(uint8_t *data, size_t len, void (*release)(void *arg), void *arg) {
+    struct pktbuf *pb;
+
+    /* only the descriptor is allocated, the storage is lent by the caller */
+    pb = mempool_alloc(&ext_pool);
+    if (!pb) {
+        errorf("mempool_alloc() failure, pool exhausted");
+        return NULL;
+    }
+    pb->pool = &ext_pool;
+    pb->data = data;
+    pb->size = len;
+    pb->head = 0;
+    pb->tail = len;
+    pb->refcnt = 1;
+    pb->dev = NULL;
+    pb->frags = NULL;
+    pb->nfrags = 0;
+    pb->fraglen = 0;
+    pb->flags = 0;
+    pb->csum_start = 0;
+    pb->csum_offset = 0;
+    pb->gso_size = 0;
+    pb->protocol = 0;
+    pb->ext_release = release;
+    pb->ext_arg = arg;
+    return pb;
+}
+
+struct pktbuf *pktbuf_ref(struct pktbuf *pb) {
+    __atomic_add_fetch(&pb->refcnt, 1, __ATOMIC_RELAXED);
+    return pb;
+}
+
+void pktbuf_release(struct pktbuf *pb) {
+    if (__atomic_sub_fetch(&pb->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (pb->ext_release) {
+            pb->ext_release(pb->ext_arg);
+        }
+        if (pb->pool) {
+            mempool_free(pb->pool, pb);
+        } else {
+            free(pb);
+        }
+    }
+}
+
+int pktbuf_reserve(struct pktbuf *pb, size_t len) {
+    if (pktbuf_len(pb) || len > pktbuf_tailroom(pb)) {
+        return -1;
+    }
+    pb->head += len;
+    pb->tail += len;
+    return 0;
+}
+
+uint8_t *pktbuf_push(struct pktbuf *pb, size_t len) {
+    if (len > pktbuf_headroom(pb)) {
+        return NULL;
+    }
+    pb->head -= len;
+    return pktbuf_data(pb);
+}
+
+uint8_t *pktbuf_append(struct pktbuf *pb, size_t len) {
+    uint8_t *p;
+
+    if (len > pktbuf_tailroom(pb)) {
+        return NULL;
+    }
+    p = pb->data + pb->tail;
+    pb->tail += len;
+    return p;
+}
+
+uint8_t *pktbuf_pull(struct pktbuf *pb, size_t len) {
+    if (len > pktbuf_len(pb)) {
+        return NULL;
+    }
+    pb->head += len;
+    return pktbuf_data(pb);
+}
+
+int pktbuf_trim(struct pktbuf *pb, size_t len) {
+    if (len > pktbuf_len(pb)) {
+        return -1;
+    }
+    pb->tail = pb->head + len;
+    return 0;
+}
+
+int pktbuf_attach_frags(struct pktbuf *pb, const struct iovec *iov, int iovcnt) {
+    int i;
+
+    if (iovcnt < 0 || iovcnt > PKTBUF_FRAG_MAX) {
+        return -1;
+    }
+    pb->frags = iov;
+    pb->nfrags = iovcnt;
+    pb->fraglen = 0;
+    for (i = 0; i < iovcnt; i++) {
+        pb->fraglen += iov[i].iov_len;
+    }
+    return 0;
+}
+
+static struct pktbuf *pktbuf_copy(struct pktbuf *pb) {
+    struct pktbuf *new;
+    uint8_t *p;
+    int i;
+
+    new = pktbuf_alloc(pktbuf_headroom(pb) + pktbuf_total_len(pb));
+    if (!new) {
+        return NULL;
+    }
+    pktbuf_reserve(new, pktbuf_headroom(pb));
+    p = pktbuf_append(new, pktbuf_total_len(pb));
+    memcpy(p, pktbuf_data(pb), pktbuf_len(pb));
+    p += pktbuf_len(pb);
+    for (i = 0; i < pb->nfrags; i++) {
+        memcpy(p, pb->frags[i].iov_base, pb->frags[i].iov_len);
+        p += pb->frags[i].iov_len;
+    }
+    new->dev = pb->dev;
+    /* the headroom is the same, so the checksum offsets still apply */
+    new->flags = pb->flags & ~PKTBUF_FLAG_PINNED;
+    new->csum_start = pb->csum_start;
+    new->csum_offset = pb->csum_offset;
+    new->gso_size = pb->gso_size;
+    new->protocol = pb->protocol;
+    return new;
+}
+
+struct pktbuf *pktbuf_linearize(struct pktbuf *pb) {
+    if (!pb->nfrags) {
+        return pktbuf_ref(pb);
+    }
+    return pktbuf_copy(pb);
+}
+
+struct pktbuf *pktbuf_unpin(struct pktbuf *pb) {
+    if (!(pb->flags & PKTBUF_FLAG_PINNED)) {
+        return pktbuf_ref(pb);
+    }
+    return pktbuf_copy(pb);
+}
+
+void pktbuf_csum_partial(struct pktbuf *pb, const uint8_t *start, uint16_t offset) {
+    pb->flags |= PKTBUF_FLAG_CSUM_PARTIAL;
+    pb->csum_start = start - pb->data;
+    pb->csum_offset = offset;
+}
+
+void pktbuf_csum_finish(struct pktbuf *pb) {
+    struct iovec iov[PKTBUF_FRAG_MAX + 1];
+    uint16_t sum;
+    int i, iovcnt = 0;
+
+    /* the field already holds the pseudo-header sum, so summing over it completes the checksum */
+    iov[iovcnt].iov_base = pb->data + pb->csum_start;
+    iov[iovcnt++].iov_len = pb->tail - pb->csum_start;
+    for (i = 0; i < pb->nfrags; i++) {
+        iov[iovcnt++] = pb->frags[i];
+    }
+    sum = cksum16v(iov, iovcnt, 0);
+    /* 0 means no checksum in UDP, the equivalent 0xffff is sent instead */
+    if (!sum) {
+        sum = 0xffff;
+    }
+    memcpy(pb->data + pb->csum_start + pb->csum_offset, &sum, sizeof(sum));
+    pb->flags &= ~PKTBUF_FLAG_CSUM_PARTIAL;
+}
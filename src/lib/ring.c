@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "handler.h"
+#include "util.h"
+#include "ring.h"
+
+/*
+ * Slot sequence protocol: slot (pos % size) is free for the producer claiming
+ * position pos when seq == pos, and holds published data for the consumer
+ * when seq == pos + 1. The consumer hands the slot back for the next lap by
+ * setting seq = pos + size.
+ */
+
+int mpsc_ring_init(struct mpsc_ring *ring, unsigned int size) {
+    unsigned int n = 1, i;
+
+    while (n < size) {
+        n <<= 1;
+    }
+    ring->slots = memory_alloc(sizeof(*ring->slots) * n);
+    if (!ring->slots) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        ring->slots[i].seq = i;
+    }
+    ring->size = n;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->drops = 0;
+    return 0;
+}
+
+void mpsc_ring_destroy(struct mpsc_ring *ring) {
+    memory_free(ring->slots);
+    ring->slots = NULL;
+    ring->size = 0;
+}
+
+int mpsc_ring_enqueue(struct mpsc_ring *ring, void *data) {
+    struct mpsc_ring_slot *slot;
+    unsigned long pos, seq;
+    long diff;
+
+    pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    while (1) {
+        slot = &ring->slots[pos & (ring->size - 1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        diff = (long)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+            /* pos was reloaded by the failed exchange */
+        } else if (diff < 0) {
+            /* the consumer has not freed this slot yet */
+            __atomic_add_fetch(&ring->drops, 1, __ATOMIC_RELAXED);
+            return -1;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->data = data;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+unsigned int mpsc_ring_dequeue_batch(struct mpsc_ring *ring, void **objs, unsigned int max) {
+    struct mpsc_ring_slot *slot;
+    unsigned long pos;
+    unsigned int num = 0;
+
+    pos = ring->tail;
+    while (num < max) {
+        slot = &ring->slots[pos & (ring->size - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+            /* empty, or the producer that claimed this slot has not published yet */
+            break;
+        }
+        objs[num++] = slot->data;
+        __atomic_store_n(&slot->seq, pos + ring->size, __ATOMIC_RELEASE);
+        pos++;
+    }
+    __atomic_store_n(&ring->tail, pos, __ATOMIC_RELAXED);
+    return num;
+}
+
+unsigned int mpsc_ring_count(struct mpsc_ring *ring) {
+    unsigned long head, tail;
+
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    return head > tail ? (unsigned int)(head - tail) : 0;
+}
+
+unsigned long mpsc_ring_drops(struct mpsc_ring *ring) {
+    return __atomic_load_n(&ring->drops, __ATOMIC_RELAXED);
+}
+
+int spsc_ring_init(struct spsc_ring *ring, unsigned int size) {
+    unsigned int n = 1;
+
+    while (n < size) {
+        n <<= 1;
+    }
+    ring->slots = memory_alloc(sizeof(*ring->slots) * n);
+    if (!ring->slots) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    ring->size = n;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->drops = 0;
+    return 0;
+}
+
+void spsc_ring_destroy(struct spsc_ring *ring) {
+    memory_free(ring->slots);
+    ring->slots = NULL;
+    ring->size = 0;
+}
+
+int spsc_ring_enqueue(struct spsc_ring *ring, void *data) {
+    unsigned long head, tail;
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= ring->size) {
+        __atomic_add_fetch(&ring->drops, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    ring->slots[head & (ring->size - 1)] = data;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void *spsc_ring_dequeue(struct spsc_ring *ring) {
+    unsigned long head, tail;
+    void *data;
+
+    tail = ring->tail;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return NULL;
+    }
+    data = ring->slots[tail & (ring->size - 1)];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return data;
+}
+
+unsigned int spsc_ring_count(struct spsc_ring *ring) {
+    unsigned long head, tail;
+
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    return (unsigned int)(head - tail);
+}
+
+unsigned long spsc_ring_drops(struct spsc_ring *ring) {
+    return __atomic_load_n(&ring->drops, __ATOMIC_RELAXED);
+}
@@ -136,6 +136,32 @@ ssize_t sock_recvfrom(int id, void *buf, size_t n, struct sockaddr *addr, int *a
     return ret;
 }
 
+ssize_t sock_recvfrom_loan(int id, struct sock_loan *loan, struct sockaddr *addr, int *addrlen)
+{
+    struct sock *s = sock_get(id);
+    if (!s || s->type != SOCK_DGRAM || s->family != AF_INET)
+    {
+        return -1;
+    }
+
+    int ret = udp_recvfrom_loan(s->desc, &loan->udp);
+    if (ret != -1)
+    {
+        loan->data = loan->udp.data;
+        loan->len = loan->udp.len;
+        ((struct sockaddr_in *)addr)->sin_addr = loan->udp.foreign.address;
+        ((struct sockaddr_in *)addr)->sin_port = loan->udp.foreign.port;
+    }
+    return ret;
+}
+
+void sock_loan_release(struct sock_loan *loan)
+{
+    udp_loan_release(&loan->udp);
+    loan->data = NULL;
+    loan->len = 0;
+}
+
 ssize_t sock_sendto(int id, const void *buf, size_t n, const struct sockaddr *addr, int addrlen)
 {
     struct sock *s = sock_get(id);
@@ -151,6 +177,21 @@ ssize_t sock_sendto(int id, const void *buf, size_t n, const struct sockaddr *ad
     return udp_sendto(s->desc, (uint8_t *)buf, n, &ep);
 }
 
+ssize_t sock_sendmsg(int id, const struct iovec *iov, int iovcnt, const struct sockaddr *addr, int addrlen)
+{
+    struct sock *s = sock_get(id);
+    if (!s || s->type != SOCK_DGRAM || s->family != AF_INET)
+    {
+        return -1;
+    }
+
+    struct IP_ENDPOINT ep = {
+        .address = ((struct sockaddr_in *)addr)->sin_addr,
+        .port = ((struct sockaddr_in *)addr)->sin_port
+    };
+    return udp_sendmsg(s->desc, iov, iovcnt, &ep);
+}
+
 int sock_bind(int id, const struct sockaddr *addr, int addrlen)
 {
     struct sock *s = sock_get(id);
@@ -3,9 +3,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <errno.h>
 
 #include "handler.h"
+#include "mempool.h"
+#include "ring.h"
 
 #include "util.h"
 #include "net2.h"
@@ -13,6 +16,7 @@
 #include "udp.h"
 
 #define UDP_PCB_SIZE 16
+#define UDP_PCB_RING_SIZE 512
 
 #define UDP_PCB_STATE_FREE    0
 #define UDP_PCB_STATE_OPEN    1
@@ -37,20 +41,40 @@ struct udp_hdr {
     uint16_t sum;
 };
 
+/*
+ * Locking: the global mutex serializes pcb allocation, binding, closing and the
+ * port lookup in udp_input(). Each pcb has its own mutex that serializes its
+ * receivers and protects its sched_ctx. Writes to state and local hold both.
+ *
+ * The receive ring is single-producer only because every enqueue happens in
+ * udp_input_vec() with the global mutex held: it is called from the softirq
+ * thread, but also from TAP queue threads, fanout workers, busy-poll threads
+ * and inline from the interrupt thread for run-to-completion devices, so the
+ * enqueue must never be moved out of that lock. There is one consumer at a
+ * time, the receiver holding pcb->mutex. The producer only takes pcb->mutex
+ * to wake a receiver that announced itself in waiters, so receivers on
+ * different sockets never contend with each other.
+ */
 struct udp_pcb {
     int state;
     struct IP_ENDPOINT local;
-    struct queue_head queue; /* receive queue */
+    struct spsc_ring ring; /* receive ring of udp_queue_entry */
+    mutex_t mutex;
+    int waiters; /* receivers about to sleep or sleeping on ctx */
     struct sched_ctx ctx;
+    uint16_t gso_size; /* payload size of each datagram sent, 0 for one datagram per send */
 };
 
 struct udp_queue_entry {
     struct IP_ENDPOINT foreign;
-    uint16_t len;
+    struct pktbuf *pb; /* positioned at the UDP payload */
 };
 
+#define UDP_QUEUE_ENTRY_POOL_CAPACITY 4096
+
 static mutex_t mutex = MUTEX_INITIALIZER;
 static struct udp_pcb pcbs[UDP_PCB_SIZE];
+static struct mempool entry_pool = MEMPOOL_INITIALIZER("udp_queue_entry", sizeof(struct udp_queue_entry), UDP_QUEUE_ENTRY_POOL_CAPACITY);
 
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 static void udp_dump(const uint8_t *data, size_t len)
@@ -71,37 +95,45 @@ static void udp_dump(const uint8_t *data, size_t len)
 
 
 
+/* NOTE: must be called after mutex locked */
 static struct udp_pcb *
 udp_pcb_alloc(void)
 {
     struct udp_pcb *pcb;
 
     for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == UDP_PCB_STATE_FREE) {
-            pcb->state = UDP_PCB_STATE_OPEN;
+        if (__atomic_load_n(&pcb->state, __ATOMIC_ACQUIRE) == UDP_PCB_STATE_FREE) {
+            mutex_lock(&pcb->mutex);
             sched_ctx_init(&pcb->ctx);
+            __atomic_store_n(&pcb->state, UDP_PCB_STATE_OPEN, __ATOMIC_RELEASE);
+            mutex_unlock(&pcb->mutex);
             return pcb;
         }
     }
     return NULL;
 }
 
+/* NOTE: must be called after pcb->mutex locked */
 static void
 udp_pcb_release(struct udp_pcb *pcb)
 {
-    struct queue_entry *entry;
+    struct udp_queue_entry *entry;
 
-    pcb->state = UDP_PCB_STATE_CLOSING;
-    if (sched_ctx_destroy(&pcb->ctx) == -1) {
-        sched_wakeup(&pcb->ctx);
+    __atomic_store_n(&pcb->state, UDP_PCB_STATE_CLOSING, __ATOMIC_RELEASE);
+    if (pcb->waiters) {
+        /* the last receiver to wake up finishes the release */
+        sched_wakeup_all(&pcb->ctx);
         return;
     }
-    pcb->state = UDP_PCB_STATE_FREE;
+    sched_ctx_destroy(&pcb->ctx);
     pcb->local.address = IP_ADDR_ANY;
     pcb->local.port = 0;
-    while ((entry = queue_pop(&pcb->queue)) != NULL) {
-        memory_free(entry);
+    pcb->gso_size = 0;
+    while ((entry = spsc_ring_dequeue(&pcb->ring)) != NULL) {
+        pktbuf_release(entry->pb);
+        mempool_free(&entry_pool, entry);
     }
+    __atomic_store_n(&pcb->state, UDP_PCB_STATE_FREE, __ATOMIC_RELEASE);
 }
 
 static struct udp_pcb *
@@ -110,7 +142,7 @@ udp_pcb_select(IPAddress addr, uint16_t port)
     struct udp_pcb *pcb;
 
     for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == UDP_PCB_STATE_OPEN) {
+        if (__atomic_load_n(&pcb->state, __ATOMIC_ACQUIRE) == UDP_PCB_STATE_OPEN) {
             if ((pcb->local.address == IP_ADDR_ANY || pcb->local.address == addr) && pcb->local.port == port) {
                 return pcb;
             }
@@ -129,7 +161,26 @@ udp_pcb_get(int id)
         return NULL;
     }
     pcb = &pcbs[id];
-    if (pcb->state != UDP_PCB_STATE_OPEN) {
+    if (__atomic_load_n(&pcb->state, __ATOMIC_ACQUIRE) != UDP_PCB_STATE_OPEN) {
+        return NULL;
+    }
+    return pcb;
+}
+
+/* like udp_pcb_get(), but returns with pcb->mutex locked */
+static struct udp_pcb *
+udp_pcb_lock(int id)
+{
+    struct udp_pcb *pcb;
+
+    if (id < 0 || id >= (int)countof(pcbs)) {
+        /* out of range */
+        return NULL;
+    }
+    pcb = &pcbs[id];
+    mutex_lock(&pcb->mutex);
+    if (__atomic_load_n(&pcb->state, __ATOMIC_ACQUIRE) != UDP_PCB_STATE_OPEN) {
+        mutex_unlock(&pcb->mutex);
         return NULL;
     }
     return pcb;
@@ -141,74 +192,137 @@ udp_pcb_id(struct udp_pcb *pcb)
     return indexof(pcbs, pcb);
 }
 
-static void
-udp_input(const uint8_t *data, size_t len, IPAddress src, IPAddress dst, struct IP_INTERFACE *iface)
+/* validates a received datagram, returns its header or NULL to drop it */
+static struct udp_hdr *
+udp_input_check(struct pktbuf *pb, IPAddress src, IPAddress dst)
 {
+    const uint8_t *data = pktbuf_data(pb);
+    size_t len = pktbuf_len(pb);
     struct pseudo_hdr pseudo;
     uint16_t psum = 0;
     struct udp_hdr *hdr;
     char addr1[MAX_IP_ADDRESS_STRING_LENGTH];
     char addr2[MAX_IP_ADDRESS_STRING_LENGTH];
-    struct udp_pcb *pcb;
-    struct udp_queue_entry *entry;
 
     if (len < sizeof(*hdr)) {
         errorf("too short");
-        return;
+        return NULL;
     }
     hdr = (struct udp_hdr *)data;
     if (len != ntoh16(hdr->len)) { /* just to make sure */
         errorf("length error: len=%zu, hdr->len=%u", len, ntoh16(hdr->len));
-        return;
+        return NULL;
     }
-    pseudo.src = src;
-    pseudo.dst = dst;
-    pseudo.zero = 0;
-    pseudo.protocol = UDP_PROTOCOL;
-    pseudo.len = hton16(len);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    if (cksum16((uint16_t *)hdr, len, psum) != 0) {
-        errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
-        return;
+    /* the device may have verified the checksum already */
+    if (!(pb->flags & PKTBUF_FLAG_CSUM_VALID)) {
+        pseudo.src = src;
+        pseudo.dst = dst;
+        pseudo.zero = 0;
+        pseudo.protocol = UDP_PROTOCOL;
+        pseudo.len = hton16(len);
+        psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+        if (cksum16((uint16_t *)hdr, len, psum) != 0) {
+            errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
+            return NULL;
+        }
     }
     debugf("%s:%d => %s:%d, len=%zu (payload=%zu)",
         ip_address_to_string(src, addr1, sizeof(addr1)), ntoh16(hdr->src),
         ip_address_to_string(dst, addr2, sizeof(addr2)), ntoh16(hdr->dst),
         len, len - sizeof(*hdr));
     udp_dump(data, len);
-    mutex_lock(&mutex);
-    pcb = udp_pcb_select(dst, hdr->dst);
-    if (!pcb) {
-        /* port is not in use */
-        mutex_unlock(&mutex);
-        return;
-    }
-    entry = memory_alloc(sizeof(*entry) + (len - sizeof(*hdr)));
-    if (!entry) {
-        mutex_unlock(&mutex);
-        errorf("memory_alloc() failure");
-        return;
+    return hdr;
+}
+
+/*
+ * Delivers a vector of datagrams to their sockets. The global lock is taken
+ * once for the whole vector, and each socket with sleeping receivers is woken
+ * once after all datagrams have been queued; the woken receiver passes the
+ * wakeup on while datagrams are left, see udp_dequeue().
+ */
+static void
+udp_input_vec(struct pktbuf **pbs, const IPAddress *src, const IPAddress *dst, unsigned int num)
+{
+    struct udp_hdr *hdrs[PKTBUF_VEC_MAX];
+    struct udp_pcb *pcb, *queued[UDP_PCB_SIZE];
+    uint8_t marked[UDP_PCB_SIZE] = {};
+    struct udp_queue_entry *entry;
+    unsigned int i, nqueued = 0;
+
+    for (i = 0; i < num; i++) {
+        hdrs[i] = udp_input_check(pbs[i], src[i], dst[i]);
     }
-    entry->foreign.address = src;
-    entry->foreign.port = hdr->src;
-    entry->len = len - sizeof(*hdr);
-    memcpy(entry + 1, hdr + 1, entry->len);
-    if (!queue_push(&pcb->queue, entry)) {
-        mutex_unlock(&mutex);
-        errorf("queue_push() failure");
-        return;
+    mutex_lock(&mutex);
+    for (i = 0; i < num; i++) {
+        if (!hdrs[i]) {
+            continue;
+        }
+        pcb = udp_pcb_select(dst[i], hdrs[i]->dst);
+        if (!pcb) {
+            /* port is not in use */
+            continue;
+        }
+        entry = mempool_alloc(&entry_pool);
+        if (!entry) {
+            errorf("mempool_alloc() failure, receive queue entries exhausted");
+            continue;
+        }
+        entry->foreign.address = src[i];
+        entry->foreign.port = hdrs[i]->src;
+        /* queue the packet buffer itself, the payload is only copied when it
+           pins a driver receive ring the application could otherwise stall */
+        pktbuf_pull(pbs[i], sizeof(*hdrs[i]));
+        entry->pb = pktbuf_unpin(pbs[i]);
+        if (!entry->pb) {
+            errorf("pktbuf_unpin() failure");
+            mempool_free(&entry_pool, entry);
+            continue;
+        }
+        if (spsc_ring_enqueue(&pcb->ring, entry) == -1) {
+            debugf("receive ring full, dropped, port=%u", ntoh16(hdrs[i]->dst));
+            pktbuf_release(entry->pb);
+            mempool_free(&entry_pool, entry);
+            continue;
+        }
+        if (!marked[udp_pcb_id(pcb)]) {
+            marked[udp_pcb_id(pcb)] = 1;
+            queued[nqueued++] = pcb;
+        }
     }
-    sched_wakeup(&pcb->ctx);
     mutex_unlock(&mutex);
+    /* pairs with the fence in udp_dequeue(): either we see the waiter or it sees the entry */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < nqueued; i++) {
+        pcb = queued[i];
+        if (__atomic_load_n(&pcb->waiters, __ATOMIC_RELAXED)) {
+            mutex_lock(&pcb->mutex);
+            sched_wakeup(&pcb->ctx);
+            mutex_unlock(&pcb->mutex);
+        }
+    }
+}
+
+static void
+udp_input(struct pktbuf *pb, IPAddress src, IPAddress dst, struct IP_INTERFACE *iface)
+{
+    udp_input_vec(&pb, &src, &dst, 1);
+}
+
+static void
+udp_input_batch(struct ip_batch *batch)
+{
+    udp_input_vec(batch->pbs, batch->src, batch->dst, batch->num);
 }
 
 ssize_t
 udp_output(struct IP_ENDPOINT *src, struct IP_ENDPOINT *dst, const  uint8_t *data, size_t len)
 {
-    uint8_t buf[MAX_IP_PAYLOAD_SIZE];
+    struct pktbuf *pb;
     struct udp_hdr *hdr;
     struct pseudo_hdr pseudo;
-    uint16_t total, psum = 0;
+    uint16_t total;
+    size_t headroom;
+    ssize_t ret;
     char ep1[MAX_IP_ENDPOINT_STRING_LENGTH];
     char ep2[MAX_IP_ENDPOINT_STRING_LENGTH];
 
@@ -216,10 +330,18 @@ udp_output(struct IP_ENDPOINT *src, struct IP_ENDPOINT *dst, const  uint8_t *dat
         errorf("too long");
         return -1;
     }
-    hdr = (struct udp_hdr *)buf;
+    /* reserve room for the lower layer headers so they are prepended in place */
+    headroom = ip_headroom(dst->address);
+    total = sizeof(*hdr) + len;
+    pb = pktbuf_alloc(headroom + total);
+    if (!pb) {
+        errorf("pktbuf_alloc() failure");
+        return -1;
+    }
+    pktbuf_reserve(pb, headroom);
+    hdr = (struct udp_hdr *)pktbuf_append(pb, total);
     hdr->src = src->port;
     hdr->dst = dst->port;
-    total = sizeof(*hdr) + len;
     hdr->len = hton16(total);
     hdr->sum = 0;
     memcpy(hdr + 1, data, len);
@@ -228,39 +350,165 @@ udp_output(struct IP_ENDPOINT *src, struct IP_ENDPOINT *dst, const  uint8_t *dat
     pseudo.zero = 0;
     pseudo.protocol = UDP_PROTOCOL;
     pseudo.len = hton16(total);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    hdr->sum = cksum16((uint16_t *)hdr, total, psum);
+    /* only the pseudo-header is summed here, the device or network_device_output() completes it */
+    hdr->sum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+    pktbuf_csum_partial(pb, (uint8_t *)hdr, offsetof(struct udp_hdr, sum));
     debugf("%s => %s, len=%u (payload=%zu)",
         ip_endpoint_to_string(src, ep1, sizeof(ep1)), ip_endpoint_to_string(dst, ep2, sizeof(ep2)), total, len);
     udp_dump((uint8_t *)hdr, total);
-    if (ip_send_packet(UDP_PROTOCOL, (uint8_t *)hdr, total, src->address, dst->address) == -1) {
+    ret = ip_send_packet(UDP_PROTOCOL, pb, src->address, dst->address);
+    pktbuf_release(pb);
+    if (ret == -1) {
         errorf("ip_output() failure");
         return -1;
     }
     return len;
 }
 
+/* sends one datagram, or a super-packet of datagrams of gso_size bytes the device cuts */
+static ssize_t
+udp_outputv_gso(struct IP_ENDPOINT *src, struct IP_ENDPOINT *dst, const struct iovec *iov, int iovcnt, uint16_t gso_size)
+{
+    struct pktbuf *pb;
+    struct udp_hdr *hdr;
+    struct pseudo_hdr pseudo;
+    uint16_t total;
+    size_t len, headroom;
+    ssize_t ret;
+    char ep1[MAX_IP_ENDPOINT_STRING_LENGTH];
+    char ep2[MAX_IP_ENDPOINT_STRING_LENGTH];
+
+    /* only the UDP header is built here, the payload fragments are gathered by the driver */
+    headroom = ip_headroom(dst->address);
+    pb = pktbuf_alloc(headroom + sizeof(*hdr));
+    if (!pb) {
+        errorf("pktbuf_alloc() failure");
+        return -1;
+    }
+    pktbuf_reserve(pb, headroom);
+    if (pktbuf_attach_frags(pb, iov, iovcnt) == -1) {
+        errorf("too many fragments, iovcnt=%d", iovcnt);
+        pktbuf_release(pb);
+        return -1;
+    }
+    len = pb->fraglen;
+    if (len > MAX_IP_PAYLOAD_SIZE - sizeof(*hdr)) {
+        errorf("too long");
+        pktbuf_release(pb);
+        return -1;
+    }
+    hdr = (struct udp_hdr *)pktbuf_append(pb, sizeof(*hdr));
+    hdr->src = src->port;
+    hdr->dst = dst->port;
+    total = sizeof(*hdr) + len;
+    hdr->len = hton16(total);
+    hdr->sum = 0;
+    pseudo.src = src->address;
+    pseudo.dst = dst->address;
+    pseudo.zero = 0;
+    pseudo.protocol = UDP_PROTOCOL;
+    pseudo.len = hton16(total);
+    hdr->sum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+    pktbuf_csum_partial(pb, (uint8_t *)hdr, offsetof(struct udp_hdr, sum));
+    pb->gso_size = gso_size;
+    debugf("%s => %s, len=%u (payload=%zu, iovcnt=%d)",
+        ip_endpoint_to_string(src, ep1, sizeof(ep1)), ip_endpoint_to_string(dst, ep2, sizeof(ep2)), total, len, iovcnt);
+    udp_dump((uint8_t *)hdr, sizeof(*hdr));
+    ret = ip_send_packet(UDP_PROTOCOL, pb, src->address, dst->address);
+    pktbuf_release(pb);
+    if (ret == -1) {
+        errorf("ip_output() failure");
+        return -1;
+    }
+    return len;
+}
+
+ssize_t
+udp_outputv(struct IP_ENDPOINT *src, struct IP_ENDPOINT *dst, const struct iovec *iov, int iovcnt)
+{
+    return udp_outputv_gso(src, dst, iov, iovcnt, 0);
+}
+
+/* cuts the payload into datagrams of gso_size bytes, handing them to the device as one super-packet if it can */
+static ssize_t
+udp_output_segments(struct IP_ENDPOINT *src, struct IP_ENDPOINT *dst, const struct iovec *iov, int iovcnt, uint16_t gso_size)
+{
+    struct network_device *dev;
+    struct iovec seg[PKTBUF_FRAG_MAX];
+    size_t len = 0, off, n, rest, chunk, skip = 0;
+    int i, segcnt;
+
+    if (iovcnt > PKTBUF_FRAG_MAX) {
+        errorf("too many fragments, iovcnt=%d", iovcnt);
+        return -1;
+    }
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (len <= gso_size) {
+        return udp_outputv_gso(src, dst, iov, iovcnt, 0);
+    }
+    dev = ip_route_device(dst->address);
+    if (dev && (dev->flags & NETWORK_DEVICE_FLAG_TX_GSO_UDP)) {
+        if (MIN_IP_HEADER_SIZE + sizeof(struct udp_hdr) + gso_size > dev->mtu) {
+            errorf("segment size too large, dev=%s, mtu=%u, gso_size=%u", dev->name, dev->mtu, gso_size);
+            return -1;
+        }
+        return udp_outputv_gso(src, dst, iov, iovcnt, gso_size);
+    }
+    /* the device cannot segment, send each datagram on its own */
+    i = 0;
+    for (off = 0; off < len; off += n) {
+        n = MIN(gso_size, len - off);
+        segcnt = 0;
+        for (rest = n; rest; rest -= chunk) {
+            chunk = MIN(iov[i].iov_len - skip, rest);
+            seg[segcnt].iov_base = (uint8_t *)iov[i].iov_base + skip;
+            seg[segcnt++].iov_len = chunk;
+            skip += chunk;
+            if (skip == iov[i].iov_len) {
+                i++;
+                skip = 0;
+            }
+        }
+        if (udp_outputv_gso(src, dst, seg, segcnt, 0) == -1) {
+            return -1;
+        }
+    }
+    return len;
+}
+
 static void
 event_handler(void *arg)
 {
     struct udp_pcb *pcb;
 
-    mutex_lock(&mutex);
     for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
+        mutex_lock(&pcb->mutex);
         if (pcb->state == UDP_PCB_STATE_OPEN) {
             sched_interrupt(&pcb->ctx);
         }
+        mutex_unlock(&pcb->mutex);
     }
-    mutex_unlock(&mutex);
 }
 
 int
 udp_init(void)
 {
+    struct udp_pcb *pcb;
+
+    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
+        mutex_init(&pcb->mutex);
+        if (spsc_ring_init(&pcb->ring, UDP_PCB_RING_SIZE) == -1) {
+            errorf("spsc_ring_init() failure");
+            return -1;
+        }
+    }
     if (ip_register_protocol("UDP", UDP_PROTOCOL, udp_input) == -1) {
         errorf("ip_protocol_register() failure");
         return -1;
     }
+    ip_set_protocol_batch_handler(UDP_PROTOCOL, udp_input_batch);
     network_event_subscribe(event_handler, NULL);
     return 0;
 }
@@ -299,7 +547,9 @@ udp_close(int id)
         mutex_unlock(&mutex);
         return -1;
     }
+    mutex_lock(&pcb->mutex);
     udp_pcb_release(pcb);
+    mutex_unlock(&pcb->mutex);
     mutex_unlock(&mutex);
     return 0;
 }
@@ -325,93 +575,232 @@ udp_bind(int id, struct IP_ENDPOINT *local)
         mutex_unlock(&mutex);
         return -1;
     }
+    mutex_lock(&pcb->mutex);
     pcb->local = *local;
+    mutex_unlock(&pcb->mutex);
     debugf("bound, id=%d, local=%s", id, ip_endpoint_to_string(&pcb->local, ep1, sizeof(ep1)));
     mutex_unlock(&mutex);
     return 0;
 }
 
-ssize_t
-udp_sendto(int id, uint8_t *data, size_t len, struct IP_ENDPOINT *foreign)
+int
+udp_set_gso_size(int id, uint16_t size)
+{
+    struct udp_pcb *pcb;
+
+    if (size > MAX_IP_PAYLOAD_SIZE - sizeof(struct udp_hdr)) {
+        errorf("too large, size=%u", size);
+        return -1;
+    }
+    pcb = udp_pcb_lock(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        return -1;
+    }
+    pcb->gso_size = size;
+    mutex_unlock(&pcb->mutex);
+    debugf("id=%d, gso_size=%u", id, size);
+    return 0;
+}
+
+int
+udp_set_spin(int id, unsigned int spin)
+{
+    struct udp_pcb *pcb;
+
+    pcb = udp_pcb_lock(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        return -1;
+    }
+    sched_ctx_set_spin(&pcb->ctx, spin);
+    mutex_unlock(&pcb->mutex);
+    debugf("id=%d, spin=%u", id, spin);
+    return 0;
+}
+
+/* resolves the local endpoint of the pcb for sending to foreign, assigning an ephemeral port if needed */
+static int
+udp_local_endpoint(int id, struct IP_ENDPOINT *foreign, struct IP_ENDPOINT *local, uint16_t *gso_size)
 {
     struct udp_pcb *pcb;
-    struct IP_ENDPOINT local;
     struct IP_INTERFACE *iface;
     char addr[MAX_IP_ADDRESS_STRING_LENGTH];
     uint32_t p;
 
-    mutex_lock(&mutex);
-    pcb = udp_pcb_get(id);
+    pcb = udp_pcb_lock(id);
     if (!pcb) {
         errorf("pcb not found, id=%d", id);
-        mutex_unlock(&mutex);
         return -1;
     }
-    local.address = pcb->local.address;
-    if (local.address == IP_ADDR_ANY) {
+    *local = pcb->local;
+    *gso_size = pcb->gso_size;
+    mutex_unlock(&pcb->mutex);
+    if (local->address == IP_ADDR_ANY) {
         iface = ip_get_interface(foreign->address);
         if (!iface) {
             errorf("iface not found that can reach foreign address, addr=%s",
                 ip_address_to_string(foreign->address, addr, sizeof(addr)));
-            mutex_unlock(&mutex);
             return -1;
         }
-        local.address = iface->unicast;
-        debugf("select local address, addr=%s", ip_address_to_string(local.address, addr, sizeof(addr)));
+        local->address = iface->unicast;
+        debugf("select local address, addr=%s", ip_address_to_string(local->address, addr, sizeof(addr)));
+    }
+    if (local->port) {
+        return 0;
+    }
+    /* first send on an unbound pcb, the port is assigned like a bind */
+    mutex_lock(&mutex);
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
     }
     if (!pcb->local.port) {
         for (p = UDP_SOURCE_PORT_MIN; p <= UDP_SOURCE_PORT_MAX; p++) {
-            if (!udp_pcb_select(local.address, hton16(p))) {
+            if (!udp_pcb_select(local->address, hton16(p))) {
+                mutex_lock(&pcb->mutex);
                 pcb->local.port = hton16(p);
+                mutex_unlock(&pcb->mutex);
                 debugf("dynamic assign local port, port=%d", p);
                 break;
             }
         }
         if (!pcb->local.port) {
-            debugf("failed to dynamic assign local port, addr=%s", ip_address_to_string(local.address, addr, sizeof(addr)));
+            debugf("failed to dynamic assign local port, addr=%s", ip_address_to_string(local->address, addr, sizeof(addr)));
             mutex_unlock(&mutex);
             return -1;
         }
     }
-    local.port = pcb->local.port;
+    local->port = pcb->local.port;
     mutex_unlock(&mutex);
+    return 0;
+}
+
+ssize_t
+udp_sendto(int id, uint8_t *data, size_t len, struct IP_ENDPOINT *foreign)
+{
+    struct IP_ENDPOINT local;
+    struct iovec iov;
+    uint16_t gso_size;
+
+    if (udp_local_endpoint(id, foreign, &local, &gso_size) == -1) {
+        return -1;
+    }
+    if (gso_size) {
+        iov.iov_base = data;
+        iov.iov_len = len;
+        return udp_output_segments(&local, foreign, &iov, 1, gso_size);
+    }
     return udp_output(&local, foreign, data, len);
 }
 
 ssize_t
-udp_recvfrom(int id, uint8_t *buf, size_t size, struct IP_ENDPOINT *foreign)
+udp_sendmsg(int id, const struct iovec *iov, int iovcnt, struct IP_ENDPOINT *foreign)
+{
+    struct IP_ENDPOINT local;
+    uint16_t gso_size;
+
+    if (udp_local_endpoint(id, foreign, &local, &gso_size) == -1) {
+        return -1;
+    }
+    if (gso_size) {
+        return udp_output_segments(&local, foreign, iov, iovcnt, gso_size);
+    }
+    return udp_outputv(&local, foreign, iov, iovcnt);
+}
+
+/* blocks until a datagram is queued on the pcb and dequeues it */
+static struct udp_queue_entry *
+udp_dequeue(int id)
 {
     struct udp_pcb *pcb;
     struct udp_queue_entry *entry;
-    ssize_t len;
+    int ret;
 
-    mutex_lock(&mutex);
-    pcb = udp_pcb_get(id);
+    pcb = udp_pcb_lock(id);
     if (!pcb) {
         errorf("pcb not found, id=%d", id);
-        mutex_unlock(&mutex);
-        return -1;
+        return NULL;
     }
-    while (!(entry = queue_pop(&pcb->queue))) {
-        if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+    while (!(entry = spsc_ring_dequeue(&pcb->ring))) {
+        /* announce the sleeper before checking the ring once more, see udp_input() */
+        __atomic_add_fetch(&pcb->waiters, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        entry = spsc_ring_dequeue(&pcb->ring);
+        if (entry) {
+            __atomic_sub_fetch(&pcb->waiters, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        ret = sched_sleep(&pcb->ctx, &pcb->mutex, NULL);
+        __atomic_sub_fetch(&pcb->waiters, 1, __ATOMIC_RELAXED);
+        if (ret == -1) {
             debugf("interrupted");
-            mutex_unlock(&mutex);
+            mutex_unlock(&pcb->mutex);
             errno = EINTR;
-            return -1;
+            return NULL;
         }
         if (pcb->state == UDP_PCB_STATE_CLOSING) {
             debugf("closed");
             udp_pcb_release(pcb);
-            mutex_unlock(&mutex);
-            return -1;
+            mutex_unlock(&pcb->mutex);
+            return NULL;
         }
     }
-    mutex_unlock(&mutex);
+    if (__atomic_load_n(&pcb->waiters, __ATOMIC_RELAXED) && spsc_ring_count(&pcb->ring)) {
+        /* a whole vector may have been queued for a single wakeup */
+        sched_wakeup(&pcb->ctx);
+    }
+    mutex_unlock(&pcb->mutex);
+    return entry;
+}
+
+ssize_t
+udp_recvfrom(int id, uint8_t *buf, size_t size, struct IP_ENDPOINT *foreign)
+{
+    struct udp_queue_entry *entry;
+    ssize_t len;
+
+    entry = udp_dequeue(id);
+    if (!entry) {
+        return -1;
+    }
     if (foreign) {
         *foreign = entry->foreign;
     }
-    len = MIN(size, entry->len); /* truncate */
-    memcpy(buf, entry + 1, len);
-    memory_free(entry);
+    len = MIN(size, pktbuf_len(entry->pb)); /* truncate */
+    memcpy(buf, pktbuf_data(entry->pb), len);
+    pktbuf_release(entry->pb);
+    mempool_free(&entry_pool, entry);
     return len;
-}
\ No newline at end of file
+}
+
+ssize_t
+udp_recvfrom_loan(int id, struct udp_loan *loan)
+{
+    struct udp_queue_entry *entry;
+
+    entry = udp_dequeue(id);
+    if (!entry) {
+        return -1;
+    }
+    /* the queued packet buffer itself is lent to the caller */
+    loan->pb = entry->pb;
+    loan->data = pktbuf_data(entry->pb);
+    loan->len = pktbuf_len(entry->pb);
+    loan->foreign = entry->foreign;
+    mempool_free(&entry_pool, entry);
+    return loan->len;
+}
+
+void
+udp_loan_release(struct udp_loan *loan)
+{
+    if (loan->pb) {
+        pktbuf_release(loan->pb);
+        loan->pb = NULL;
+    }
+    loan->data = NULL;
+    loan->len = 0;
+}
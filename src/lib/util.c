@@ -98,81 +98,6 @@ void hexdump(FILE *fp, const void *data, size_t size)
     funlockfile(fp);
 }
 
-struct queue_entry {
-    struct queue_entry *next;
-    void *data;
-};
-
-void queue_init(struct queue_head *queue)
-{
-    queue->head = NULL;
-    queue->tail = NULL;
-    queue->num = 0;
-}
-
-void * queue_push(struct queue_head *queue, void *data)
-{
-    struct queue_entry *entry;
-
-    if (!queue) {
-        return NULL;
-    }
-    entry = memory_alloc(sizeof(*entry));
-    if (!entry) {
-        return NULL;
-    }
-    entry->next = NULL;
-    entry->data = data;
-    if (queue->tail) {
-        queue->tail->next = entry;
-    }
-    queue->tail = entry;
-    if (!queue->head) {
-        queue->head = entry;
-    }
-    queue->num++;
-    return data;
-}
-
-void * queue_pop(struct queue_head *queue)
-{
-    struct queue_entry *entry;
-    void *data;
-
-    if (!queue || !queue->head) {
-        return NULL;
-    }
-    entry = queue->head;
-    queue->head = entry->next;
-    if (!queue->head) {
-        queue->tail = NULL;
-    }
-    queue->num--;
-    data = entry->data;
-    memory_free(entry);
-    return data;
-}
-
-void *queue_peek(struct queue_head *queue)
-{
-    if (!queue || !queue->head) {
-        return NULL;
-    }
-    return queue->head->data;
-}
-
-void queue_foreach(struct queue_head *queue, void (*func)(void *arg, void *data), void *arg)
-{
-    struct queue_entry *entry;
-
-    if (!queue || !func) {
-        return;
-    }
-    for (entry = queue->head; entry; entry = entry->next) {
-        func(arg, entry->data);
-    }
-}
-
 #ifndef __BIG_ENDIAN
 #define __BIG_ENDIAN 4321
 #endif
@@ -247,4 +172,51 @@ uint16_t cksum16(uint16_t *addr, uint16_t count, uint32_t init)
         sum = (sum & 0xffff) + (sum >> 16);
     }
     return ~(uint16_t)sum;
-}
\ No newline at end of file
+}
+
+/* same as cksum16() but over a chain of fragments that may have odd lengths */
+uint16_t cksum16v(const struct iovec *iov, int iovcnt, uint32_t init)
+{
+    uint32_t sum;
+    uint8_t pair[2];
+    uint16_t word;
+    const uint8_t *p;
+    size_t n;
+    int i, odd = 0;
+
+    sum = init;
+    for (i = 0; i < iovcnt; i++) {
+        p = iov[i].iov_base;
+        n = iov[i].iov_len;
+        if (odd && n) {
+            /* complete the word left open by the previous fragment */
+            pair[1] = *p++;
+            n--;
+            memcpy(&word, pair, sizeof(word));
+            sum += word;
+            odd = 0;
+        }
+        while (n > 1) {
+            memcpy(&word, p, sizeof(word));
+            sum += word;
+            p += 2;
+            n -= 2;
+        }
+        if (n) {
+            pair[0] = *p;
+            odd = 1;
+        }
+        while (sum >> 16) {
+            sum = (sum & 0xffff) + (sum >> 16);
+        }
+    }
+    if (odd) {
+        pair[1] = 0;
+        memcpy(&word, pair, sizeof(word));
+        sum += word;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~(uint16_t)sum;
+}